@@ -174,6 +174,65 @@ int fpga_mgr_buf_load_sg(struct fpga_manager *mgr, struct fpga_image_info *info,
 }
 EXPORT_SYMBOL_GPL(fpga_mgr_buf_load_sg);
 
+/**
+ * fpga_mgr_stream_load - load fpga from an image delivered in chunks
+ * @mgr:	fpga manager
+ * @info:	fpga image specific information
+ * @next:	callback which returns the next chunk of the image in @sgt, or
+ *		a NULL @sgt once the whole image has been delivered
+ * @priv:	private data passed to @next
+ *
+ * Same as fpga_mgr_buf_load_sg(), but the image doesn't need to be available
+ * as a whole before programming starts, @next may produce the following
+ * chunks while the previous ones are written. A chunk returned by @next only
+ * needs to stay valid until the next call of @next. Only low level drivers
+ * implementing write_sg are supported, write_sg is called once per chunk.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int fpga_mgr_stream_load(struct fpga_manager *mgr, struct fpga_image_info *info,
+			 int (*next)(void *priv, struct sg_table **sgt),
+			 void *priv)
+{
+	struct sg_table *sgt;
+	int ret;
+
+	if (!mgr->mops->write_sg)
+		return -EINVAL;
+
+	ret = next(priv, &sgt);
+	if (ret)
+		return ret;
+
+	if (!sgt)
+		return -EINVAL;
+
+	ret = fpga_mgr_write_init_sg(mgr, info, sgt);
+	if (ret)
+		return ret;
+
+	/* Write the FPGA image to the FPGA chunk by chunk. */
+	mgr->state = FPGA_MGR_STATE_WRITE;
+	while (sgt) {
+		ret = mgr->mops->write_sg(mgr, sgt);
+		if (ret)
+			break;
+
+		ret = next(priv, &sgt);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		dev_err(&mgr->dev, "Error while writing image data to FPGA\n");
+		mgr->state = FPGA_MGR_STATE_WRITE_ERR;
+		return ret;
+	}
+
+	return fpga_mgr_write_complete(mgr, info);
+}
+EXPORT_SYMBOL_GPL(fpga_mgr_stream_load);
+
 static int fpga_mgr_buf_load_mapped(struct fpga_manager *mgr,
 				    struct fpga_image_info *info,
 				    const char *buf, size_t count)
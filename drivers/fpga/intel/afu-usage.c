@@ -0,0 +1,141 @@
+/*
+ * Driver for FPGA Accelerated Function Unit (AFU) Usage Accounting
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/stddef.h> /* offsetofend */
+#include <linux/vfio.h> /* offsetofend in pre-4.1.0 kernels */
+#include "afu.h"
+
+/*
+ * Snapshot the FME counters of the port. Without FME driver or on a VF
+ * there are none, only the time is accounted.
+ */
+void afu_usage_read(struct platform_device *pdev,
+		    struct fpga_port_usage_snap *snap)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+
+	if (pdata->read_usage(pdev, snap)) {
+		memset(snap, 0, sizeof(*snap));
+		snap->counters.time_ns = ktime_get_ns();
+	}
+}
+
+long afu_ioctl_get_usage(struct fpga_afu_file *afile, void __user *arg)
+{
+	struct fpga_port_usage_snap end;
+	struct fpga_port_usage usage;
+	unsigned long minsz;
+
+	minsz = offsetofend(struct fpga_port_usage, fabric);
+
+	if (copy_from_user(&usage, arg,
+			   offsetofend(struct fpga_port_usage, flags)))
+		return -EFAULT;
+
+	if (usage.argsz < minsz || usage.flags)
+		return -EINVAL;
+
+	afu_usage_read(afile->pdev, &end);
+	fpga_port_usage_delta(&afile->usage, &end, &usage);
+	usage.padding = 0;
+
+	if (copy_to_user(arg, &usage, minsz))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* charge the port with the usage of a file being closed. */
+void afu_usage_release(struct fpga_afu_file *afile)
+{
+	struct feature_platform_data *pdata;
+	struct fpga_port_usage_snap end;
+	struct fpga_port_usage delta;
+
+	afu_usage_read(afile->pdev, &end);
+	fpga_port_usage_delta(&afile->usage, &end, &delta);
+
+	pdata = dev_get_platdata(&afile->pdev->dev);
+	mutex_lock(&pdata->lock);
+	fpga_port_usage_account(pdata, &delta, false);
+	mutex_unlock(&pdata->lock);
+}
+
+/* sysfs attributes of the usage accounted to the port */
+static ssize_t usage_show(struct device *dev, u64 *value, bool counter,
+			  char *buf)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(dev);
+	u64 v;
+
+	mutex_lock(&pdata->lock);
+	v = *value;
+	mutex_unlock(&pdata->lock);
+
+	if (counter)
+		return scnprintf(buf, PAGE_SIZE, "0x%llx\n", v);
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", v);
+}
+
+#define USAGE_SHOW(name, field, counter)				\
+static ssize_t name##_show(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct feature_platform_data *pdata = dev_get_platdata(dev);	\
+									\
+	return usage_show(dev, &pdata->usage.field, counter, buf);	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+USAGE_SHOW(files, files, false);
+USAGE_SHOW(jobs, jobs, false);
+USAGE_SHOW(fabric_time_ns, fabric_ns, false);
+
+/* the fabric counters, named as in the FME performance counters */
+USAGE_SHOW(pcie0_read, fabric[IPERF_FAB_PCIE0_RD], true);
+USAGE_SHOW(pcie0_write, fabric[IPERF_FAB_PCIE0_WR], true);
+USAGE_SHOW(pcie1_read, fabric[IPERF_FAB_PCIE1_RD], true);
+USAGE_SHOW(pcie1_write, fabric[IPERF_FAB_PCIE1_WR], true);
+USAGE_SHOW(upi_read, fabric[IPERF_FAB_UPI_RD], true);
+USAGE_SHOW(upi_write, fabric[IPERF_FAB_UPI_WR], true);
+USAGE_SHOW(mmio_read, fabric[IPERF_FAB_MMIO_RD], true);
+USAGE_SHOW(mmio_write, fabric[IPERF_FAB_MMIO_WR], true);
+
+static struct attribute *port_usage_attrs[] = {
+	&dev_attr_files.attr,
+	&dev_attr_jobs.attr,
+	&dev_attr_fabric_time_ns.attr,
+	&dev_attr_pcie0_read.attr,
+	&dev_attr_pcie0_write.attr,
+	&dev_attr_pcie1_read.attr,
+	&dev_attr_pcie1_write.attr,
+	&dev_attr_upi_read.attr,
+	&dev_attr_upi_write.attr,
+	&dev_attr_mmio_read.attr,
+	&dev_attr_mmio_write.attr,
+	NULL,
+};
+
+static struct attribute_group port_usage_attr_group = {
+	.attrs = port_usage_attrs,
+	.name = "usage",
+};
+
+int afu_usage_init(struct platform_device *pdev)
+{
+	return sysfs_create_group(&pdev->dev.kobj, &port_usage_attr_group);
+}
+
+void afu_usage_uinit(struct platform_device *pdev)
+{
+	sysfs_remove_group(&pdev->dev.kobj, &port_usage_attr_group);
+}
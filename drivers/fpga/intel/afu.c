@@ -25,6 +25,8 @@
 #include <linux/errno.h>
 #include <linux/delay.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/dma-mapping.h>
 #include <linux/intel-fpga.h>
 
@@ -440,6 +442,73 @@ static long port_afu_set_irq(struct platform_device *pdev,
 	return ret;
 }
 
+static long port_afu_set_irq_moderation(struct platform_device *pdev,
+			struct feature *feature, unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_port_uafu_irq_moderation hdr;
+	struct fpga_afu *afu;
+	unsigned long minsz;
+	long ret;
+
+	minsz = offsetofend(struct fpga_port_uafu_irq_moderation, max_delay_us);
+
+	if (copy_from_user(&hdr, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (hdr.argsz < minsz || hdr.flags)
+		return -EINVAL;
+
+	if ((hdr.start + hdr.count > feature->ctx_num) ||
+		(hdr.start + hdr.count < hdr.start) || !hdr.count)
+		return -EINVAL;
+
+	mutex_lock(&pdata->lock);
+	afu = fpga_pdata_get_private(pdata);
+	if (!(afu->capability & FPGA_PORT_CAP_UAFU_IRQ)) {
+		mutex_unlock(&pdata->lock);
+		return -ENODEV;
+	}
+	ret = fpga_msix_set_moderation(feature, hdr.start, hdr.count,
+				       hdr.max_events, hdr.max_delay_us);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
+static long port_afu_set_irq_affinity(struct platform_device *pdev,
+			struct feature *feature, unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_port_uafu_irq_affinity hdr;
+	struct fpga_afu *afu;
+	unsigned long minsz;
+	long ret;
+
+	minsz = offsetofend(struct fpga_port_uafu_irq_affinity, cpu);
+
+	if (copy_from_user(&hdr, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (hdr.argsz < minsz || hdr.flags || hdr.cpu < -1)
+		return -EINVAL;
+
+	if ((hdr.start + hdr.count > feature->ctx_num) ||
+		(hdr.start + hdr.count < hdr.start) || !hdr.count)
+		return -EINVAL;
+
+	mutex_lock(&pdata->lock);
+	afu = fpga_pdata_get_private(pdata);
+	if (!(afu->capability & FPGA_PORT_CAP_UAFU_IRQ)) {
+		mutex_unlock(&pdata->lock);
+		return -ENODEV;
+	}
+	ret = fpga_msix_set_affinity(feature, hdr.start, hdr.count, hdr.cpu);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
 struct feature_ops port_afu_ops = {
 	.init = port_afu_init,
 	.uinit = port_afu_uinit,
@@ -769,26 +838,200 @@ struct feature_ops port_stp_ops = {
 	.test = port_stp_test,
 };
 
+#define UINT_STATUS_SIZE(n)	\
+	PAGE_ALIGN((n) * sizeof(struct fpga_port_uint_status))
+
+static void port_uint_pages_release(struct kref *kref)
+{
+	struct fpga_afu_uint_pages *pages = container_of(kref,
+					struct fpga_afu_uint_pages, kref);
+
+	__free_pages(pages->page, pages->order);
+	kfree(pages);
+}
+
+static void port_uint_pages_put(struct fpga_afu_uint_pages *pages)
+{
+	kref_put(&pages->kref, port_uint_pages_release);
+}
+
 static int port_uint_init(struct platform_device *pdev, struct feature *feature)
 {
 	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct device *dev = fpga_pdata_to_pcidev(pdata);
+	size_t size = UINT_STATUS_SIZE(feature->ctx_num);
+	struct fpga_afu_uint_pages *pages;
 	struct fpga_afu *afu;
+	dma_addr_t iova;
+	u8 *mode;
+	int ret;
+
+	dev_dbg(&pdev->dev, "PORT UINT Init.\n");
+
+	if (!feature->ctx_num)
+		return 0;
+
+	mode = devm_kcalloc(&pdev->dev, feature->ctx_num, sizeof(*mode),
+			    GFP_KERNEL);
+	if (!mode)
+		return -ENOMEM;
+
+	pages = kzalloc(sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		ret = -ENOMEM;
+		goto free_mode;
+	}
+
+	kref_init(&pages->kref);
+	pages->order = get_order(size);
+	pages->page = alloc_pages(GFP_KERNEL | __GFP_ZERO, pages->order);
+	if (!pages->page) {
+		kfree(pages);
+		ret = -ENOMEM;
+		goto free_mode;
+	}
+
+	iova = dma_map_page(dev, pages->page, 0, size, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, iova)) {
+		ret = -EFAULT;
+		goto put_pages;
+	}
+
+	ret = afu_region_add(pdata, FPGA_PORT_INDEX_UINT_STATUS, size,
+			     page_to_phys(pages->page), FPGA_REGION_READ |
+			     FPGA_REGION_WRITE | FPGA_REGION_MMAP);
+	if (ret)
+		goto unmap_page;
 
 	mutex_lock(&pdata->lock);
 	afu = fpga_pdata_get_private(pdata);
-	if (feature->ctx_num) {
-		afu->capability |= FPGA_PORT_CAP_UAFU_IRQ;
-		afu->num_uafu_irqs = feature->ctx_num;
-	}
+	afu->capability |= FPGA_PORT_CAP_UAFU_IRQ;
+	afu->num_uafu_irqs = feature->ctx_num;
+	afu->uint_status = page_address(pages->page);
+	afu->uint_pages = pages;
+	afu->uint_status_iova = iova;
+	afu->uint_mode = mode;
 	mutex_unlock(&pdata->lock);
 
 	return 0;
+
+unmap_page:
+	dma_unmap_page(dev, iova, size, DMA_BIDIRECTIONAL);
+put_pages:
+	port_uint_pages_put(pages);
+free_mode:
+	devm_kfree(&pdev->dev, mode);
+	return ret;
+}
+
+static void port_uint_set_mode(struct fpga_afu *afu, struct feature *feature,
+			       unsigned int vector, u32 mode)
+{
+	struct fpga_port_uint_status *status = &afu->uint_status[vector];
+
+	if (afu->uint_mode[vector] == mode)
+		return;
+
+	if (afu->uint_mode[vector] == FPGA_PORT_UINT_MODE_POLL_DMA)
+		enable_irq(feature->ctx[vector].irq);
+
+	if (mode == FPGA_PORT_UINT_MODE_EVENTFD) {
+		fpga_msix_set_poll(feature, vector, NULL, NULL);
+		WRITE_ONCE(status->armed, 0);
+	} else {
+		fpga_msix_set_poll(feature, vector, &status->seq,
+				   &status->armed);
+	}
+
+	if (mode == FPGA_PORT_UINT_MODE_POLL_DMA)
+		disable_irq(feature->ctx[vector].irq);
+
+	afu->uint_mode[vector] = mode;
+}
+
+/* must be called with pdata->lock held */
+static void port_uint_reset_mode(struct feature_platform_data *pdata)
+{
+	struct feature *feature = &pdata->features[PORT_FEATURE_ID_UINT];
+	struct fpga_afu *afu = fpga_pdata_get_private(pdata);
+	int i;
+
+	if (!afu->uint_status)
+		return;
+
+	for (i = 0; i < feature->ctx_num; i++)
+		port_uint_set_mode(afu, feature, i,
+				   FPGA_PORT_UINT_MODE_EVENTFD);
 }
 
 static void port_uint_uinit(struct platform_device *pdev,
 			    struct feature *feature)
 {
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	size_t size = UINT_STATUS_SIZE(feature->ctx_num);
+	struct fpga_afu_uint_pages *pages = NULL;
+	struct fpga_afu *afu;
+
 	dev_dbg(&pdev->dev, "PORT UINT UInit.\n");
+
+	/* no new mapping of the status pages from now on. */
+	afu_region_remove(pdata, FPGA_PORT_INDEX_UINT_STATUS);
+
+	mutex_lock(&pdata->lock);
+	afu = fpga_pdata_get_private(pdata);
+	if (afu->uint_status) {
+		port_uint_reset_mode(pdata);
+		dma_unmap_page(fpga_pdata_to_pcidev(pdata),
+			       afu->uint_status_iova, size, DMA_BIDIRECTIONAL);
+		afu->uint_status = NULL;
+		pages = afu->uint_pages;
+		afu->uint_pages = NULL;
+	}
+	mutex_unlock(&pdata->lock);
+
+	/* the pages are freed once the last user mapping is gone. */
+	if (pages)
+		port_uint_pages_put(pages);
+}
+
+static long port_afu_set_irq_mode(struct platform_device *pdev,
+			struct feature *feature, unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_port_uafu_irq_mode hdr;
+	struct fpga_afu *afu;
+	unsigned long minsz;
+	unsigned int i;
+
+	minsz = offsetofend(struct fpga_port_uafu_irq_mode, status_iova);
+
+	if (copy_from_user(&hdr, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (hdr.argsz < minsz || hdr.flags || hdr.padding ||
+	    hdr.mode > FPGA_PORT_UINT_MODE_POLL_DMA)
+		return -EINVAL;
+
+	if ((hdr.start + hdr.count > feature->ctx_num) ||
+		(hdr.start + hdr.count < hdr.start) || !hdr.count)
+		return -EINVAL;
+
+	mutex_lock(&pdata->lock);
+	afu = fpga_pdata_get_private(pdata);
+	if (!afu->uint_status) {
+		mutex_unlock(&pdata->lock);
+		return -ENODEV;
+	}
+
+	for (i = hdr.start; i < hdr.start + hdr.count; i++)
+		port_uint_set_mode(afu, feature, i, hdr.mode);
+	hdr.status_iova = afu->uint_status_iova;
+	mutex_unlock(&pdata->lock);
+
+	if (copy_to_user((void __user *)arg, &hdr, minsz))
+		return -EFAULT;
+
+	return 0;
 }
 
 static long
@@ -801,6 +1044,15 @@ port_uint_ioctl(struct platform_device *pdev, struct feature *feature,
 	case FPGA_PORT_UAFU_SET_IRQ:
 		ret = port_afu_set_irq(pdev, feature, arg);
 		break;
+	case FPGA_PORT_UAFU_SET_IRQ_MODERATION:
+		ret = port_afu_set_irq_moderation(pdev, feature, arg);
+		break;
+	case FPGA_PORT_UAFU_SET_IRQ_AFFINITY:
+		ret = port_afu_set_irq_affinity(pdev, feature, arg);
+		break;
+	case FPGA_PORT_UAFU_SET_IRQ_MODE:
+		ret = port_afu_set_irq_mode(pdev, feature, arg);
+		break;
 	default:
 		dev_dbg(&pdev->dev, "%x cmd not handled", cmd);
 		return -ENODEV;
@@ -848,32 +1100,45 @@ static int afu_open(struct inode *inode, struct file *filp)
 {
 	struct platform_device *fdev = fpga_inode_to_feature_dev(inode);
 	struct feature_platform_data *pdata;
+	struct fpga_afu_file *afile;
 	int ret;
 
 	pdata = dev_get_platdata(&fdev->dev);
 	if (WARN_ON(!pdata))
 		return -ENODEV;
 
+	afile = kzalloc(sizeof(*afile), GFP_KERNEL);
+	if (!afile)
+		return -ENOMEM;
+
 	if (filp->f_flags & O_EXCL)
 		ret = feature_dev_use_excl_begin(pdata);
 	else
 		ret = feature_dev_use_begin(pdata);
 
-	if (ret)
+	if (ret) {
+		kfree(afile);
 		return ret;
+	}
 
 	dev_dbg(&fdev->dev, "Device File Opened %d Times\n", pdata->open_count);
-	filp->private_data = fdev;
+	afile->pdev = fdev;
+	afu_usage_read(fdev, &afile->usage);
+	filp->private_data = afile;
 
 	return 0;
 }
 
 static int afu_release(struct inode *inode, struct file *filp)
 {
-	struct platform_device *pdev = filp->private_data;
+	struct fpga_afu_file *afile = filp->private_data;
+	struct platform_device *pdev = afile->pdev;
 	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
 
 	dev_dbg(&pdev->dev, "Device File Release\n");
+	afu_usage_release(afile);
+	kfree(afile);
+
 	mutex_lock(&pdata->lock);
 	__feature_dev_use_end(pdata);
 
@@ -882,6 +1147,11 @@ static int afu_release(struct inode *inode, struct file *filp)
 			pdata->features[PORT_FEATURE_ID_ERROR].ctx_num, NULL);
 		fpga_msix_set_block(&pdata->features[PORT_FEATURE_ID_UINT], 0,
 			pdata->features[PORT_FEATURE_ID_UINT].ctx_num, NULL);
+		fpga_msix_set_moderation(&pdata->features[PORT_FEATURE_ID_UINT],
+			0, pdata->features[PORT_FEATURE_ID_UINT].ctx_num, 0, 0);
+		fpga_msix_set_affinity(&pdata->features[PORT_FEATURE_ID_UINT],
+			0, pdata->features[PORT_FEATURE_ID_UINT].ctx_num, -1);
+		port_uint_reset_mode(pdata);
 		afu_port_umsg_halt(&pdata->dev->dev);
 		__fpga_port_reset(pdev);
 		afu_dma_region_destroy(pdata);
@@ -1008,7 +1278,8 @@ afu_ioctl_dma_unmap(struct feature_platform_data *pdata, void __user *arg)
 
 static long afu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	struct platform_device *pdev = filp->private_data;
+	struct fpga_afu_file *afile = filp->private_data;
+	struct platform_device *pdev = afile->pdev;
 	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	struct feature *f;
 	long ret;
@@ -1028,6 +1299,8 @@ static long afu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return afu_ioctl_dma_map(pdata, (void __user *)arg);
 	case FPGA_PORT_DMA_UNMAP:
 		return afu_ioctl_dma_unmap(pdata, (void __user *)arg);
+	case FPGA_PORT_GET_USAGE:
+		return afu_ioctl_get_usage(afile, (void __user *)arg);
 	default:
 		/*
 		 * Let sub-feature's ioctl function to handle the cmd
@@ -1048,10 +1321,59 @@ static long afu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return -EINVAL;
 }
 
+static void afu_uint_vm_open(struct vm_area_struct *vma)
+{
+	struct fpga_afu_uint_pages *pages = vma->vm_private_data;
+
+	kref_get(&pages->kref);
+}
+
+static void afu_uint_vm_close(struct vm_area_struct *vma)
+{
+	port_uint_pages_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct afu_uint_vm_ops = {
+	.open = afu_uint_vm_open,
+	.close = afu_uint_vm_close,
+};
+
+/* map the interrupt status pages, which stay until the mapping is gone */
+static int afu_mmap_uint_status(struct feature_platform_data *pdata,
+				struct vm_area_struct *vma, u64 offset)
+{
+	struct fpga_afu_uint_pages *pages;
+	struct fpga_afu *afu;
+	int ret;
+
+	mutex_lock(&pdata->lock);
+	afu = fpga_pdata_get_private(pdata);
+	pages = afu->uint_pages;
+	if (pages)
+		kref_get(&pages->kref);
+	mutex_unlock(&pdata->lock);
+
+	if (!pages)
+		return -ENODEV;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      page_to_pfn(pages->page) + (offset >> PAGE_SHIFT),
+			      vma->vm_end - vma->vm_start, vma->vm_page_prot);
+	if (ret) {
+		port_uint_pages_put(pages);
+		return ret;
+	}
+
+	vma->vm_private_data = pages;
+	vma->vm_ops = &afu_uint_vm_ops;
+	return 0;
+}
+
 static int afu_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	struct fpga_afu_region region;
-	struct platform_device *pdev = filp->private_data;
+	struct fpga_afu_file *afile = filp->private_data;
+	struct platform_device *pdev = afile->pdev;
 	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	u64 size = vma->vm_end - vma->vm_start;
 	u64 offset;
@@ -1074,7 +1396,13 @@ static int afu_mmap(struct file *filp, struct vm_area_struct *vma)
 	if ((vma->vm_flags & VM_WRITE) && !(region.flags & FPGA_REGION_WRITE))
 		return -EPERM;
 
+	/* the interrupt status page is normal memory, keep it cacheable. */
+	if (region.index == FPGA_PORT_INDEX_UINT_STATUS)
+		return afu_mmap_uint_status(pdata, vma,
+					    offset - region.offset);
+
 	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
 	return remap_pfn_range(vma, vma->vm_start,
 			(region.phys + (offset - region.offset)) >> PAGE_SHIFT,
 			size, vma->vm_page_prot);
@@ -1137,14 +1465,20 @@ static int afu_probe(struct platform_device *pdev)
 	if (ret)
 		goto dev_destroy;
 
+	ret = afu_usage_init(pdev);
+	if (ret)
+		goto feature_uinit;
+
 	ret = fpga_register_dev_ops(pdev, &afu_fops, THIS_MODULE);
-	if (ret) {
-		fpga_dev_feature_uinit(pdev);
-		goto dev_destroy;
-	}
+	if (ret)
+		goto usage_uinit;
 
 	return 0;
 
+usage_uinit:
+	afu_usage_uinit(pdev);
+feature_uinit:
+	fpga_dev_feature_uinit(pdev);
 dev_destroy:
 	afu_dev_destroy(pdev);
 exit:
@@ -1155,6 +1489,7 @@ static int afu_remove(struct platform_device *pdev)
 {
 	dev_dbg(&pdev->dev, "%s\n", __func__);
 
+	afu_usage_uinit(pdev);
 	fpga_dev_feature_uinit(pdev);
 	fpga_unregister_dev_ops(pdev);
 	afu_dev_destroy(pdev);
@@ -15,18 +15,35 @@
  */
 
 #include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "feature-dev.h"
 
+static struct dentry *fpga_debugfs_root;
+
+static enum hrtimer_restart fpga_msix_moderation_timer(struct hrtimer *timer);
+static int feature_irq_init(struct feature_platform_data *pdata,
+			    struct feature *feature);
+static void feature_irq_uinit(struct feature *feature);
+
 void feature_platform_data_add(struct feature_platform_data *pdata,
 			       int index, const char *name,
 			       int resource_index, void __iomem *ioaddr,
 			       struct feature_irq_ctx *ctx,
 			       unsigned int ctx_num)
 {
+	unsigned int i;
+
 	WARN_ON(index >= pdata->num);
 	WARN_ON(ctx_num && !ctx);
 
+	for (i = 0; i < ctx_num; i++) {
+		spin_lock_init(&ctx[i].lock);
+		hrtimer_init(&ctx[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		ctx[i].timer.function = fpga_msix_moderation_timer;
+	}
+
 	pdata->features[index].name = name;
 	pdata->features[index].resource_index = resource_index;
 	pdata->features[index].ioaddr = ioaddr;
@@ -79,8 +96,12 @@ void fpga_dev_feature_uinit(struct platform_device *pdev)
 	fpga_dev_for_each_feature(pdata, feature)
 		if (feature->ops) {
 			feature->ops->uinit(pdev, feature);
+			feature_irq_uinit(feature);
 			feature->ops = NULL;
 		}
+
+	debugfs_remove_recursive(pdata->debugfs);
+	pdata->debugfs = NULL;
 }
 EXPORT_SYMBOL_GPL(fpga_dev_feature_uinit);
 
@@ -103,6 +124,12 @@ feature_instance_init(struct platform_device *pdev,
 	if (ret)
 		return ret;
 
+	ret = feature_irq_init(pdata, feature);
+	if (ret) {
+		drv->ops->uinit(pdev, feature);
+		return ret;
+	}
+
 	feature->ops = drv->ops;
 	return ret;
 }
@@ -115,6 +142,10 @@ int fpga_dev_feature_init(struct platform_device *pdev,
 	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	int ret;
 
+	if (!IS_ERR_OR_NULL(fpga_debugfs_root))
+		pdata->debugfs = debugfs_create_dir(dev_name(&pdev->dev),
+						    fpga_debugfs_root);
+
 	while (drv->ops) {
 		fpga_dev_for_each_feature(pdata, feature) {
 			/* skip the feature which is not initialized. */
@@ -137,6 +168,17 @@ exit:
 }
 EXPORT_SYMBOL_GPL(fpga_dev_feature_init);
 
+void fpga_debugfs_init(void)
+{
+	fpga_debugfs_root = debugfs_create_dir("intel-fpga", NULL);
+}
+
+void fpga_debugfs_uinit(void)
+{
+	debugfs_remove_recursive(fpga_debugfs_root);
+	fpga_debugfs_root = NULL;
+}
+
 struct fpga_chardev_info {
 	const char *name;
 	dev_t devt;
@@ -227,6 +269,53 @@ int fpga_port_id(struct platform_device *pdev)
 }
 EXPORT_SYMBOL_GPL(fpga_port_id);
 
+/* the counters accumulated from @start to @end, see fpga_port_usage_snap */
+void fpga_port_usage_delta(const struct fpga_port_usage_snap *start,
+			   const struct fpga_port_usage_snap *end,
+			   struct fpga_port_usage *delta)
+{
+	int i;
+
+	delta->valid = start->counters.valid & end->counters.valid;
+	if (start->fab_key != end->fab_key)
+		delta->valid &= ~FPGA_PORT_USAGE_FABRIC;
+
+	/* the counters went backwards, they were reset in between. */
+	for (i = 0; i < FPGA_PORT_USAGE_EVENTS; i++)
+		if (end->counters.fabric[i] < start->counters.fabric[i])
+			delta->valid &= ~FPGA_PORT_USAGE_FABRIC;
+
+	delta->time_ns = end->counters.time_ns - start->counters.time_ns;
+
+	for (i = 0; i < FPGA_PORT_USAGE_EVENTS; i++) {
+		delta->fabric[i] = 0;
+		if (delta->valid & FPGA_PORT_USAGE_FABRIC)
+			delta->fabric[i] = end->counters.fabric[i] -
+					   start->counters.fabric[i];
+	}
+}
+EXPORT_SYMBOL_GPL(fpga_port_usage_delta);
+
+/* add @delta to the usage of a port, pdata->lock held. */
+void fpga_port_usage_account(struct feature_platform_data *pdata,
+			     const struct fpga_port_usage *delta, bool job)
+{
+	struct fpga_port_usage_acct *acct = &pdata->usage;
+	int i;
+
+	if (job)
+		acct->jobs++;
+	else
+		acct->files++;
+
+	if (delta->valid & FPGA_PORT_USAGE_FABRIC)
+		acct->fabric_ns += delta->time_ns;
+
+	for (i = 0; i < FPGA_PORT_USAGE_EVENTS; i++)
+		acct->fabric[i] += delta->fabric[i];
+}
+EXPORT_SYMBOL_GPL(fpga_port_usage_account);
+
 /*
  * Enable Port by clear the port soft reset bit, which is set by default.
  * The AFU is unable to respond to any MMIO access while in reset.
@@ -257,14 +346,20 @@ EXPORT_SYMBOL_GPL(__fpga_port_enable);
 #define RST_POLL_INVL 10 /* us */
 #define RST_POLL_TIMEOUT 1000 /* us */
 
-int __fpga_port_disable(struct platform_device *pdev)
+/*
+ * __fpga_port_disable is split into asserting the soft reset and waiting
+ * for HW to ack it, so several ports can be drained at the same time.
+ * __fpga_port_disable_begin returns true if it has put the port into soft
+ * reset, __fpga_port_disable_wait is only needed in that case.
+ */
+bool __fpga_port_disable_begin(struct platform_device *pdev)
 {
 	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	struct feature_port_header *port_hdr;
 	struct feature_port_control control;
 
 	if (pdata->disable_count++ != 0)
-		return 0;
+		return false;
 
 	port_hdr = get_feature_ioaddr_by_index(&pdev->dev,
 					       PORT_FEATURE_ID_HEADER);
@@ -275,6 +370,19 @@ int __fpga_port_disable(struct platform_device *pdev)
 	control.port_sftrst = 0x1;
 	writeq(control.csr, &port_hdr->control);
 
+	return true;
+}
+EXPORT_SYMBOL_GPL(__fpga_port_disable_begin);
+
+int __fpga_port_disable_wait(struct platform_device *pdev)
+{
+	struct feature_port_header *port_hdr;
+	struct feature_port_control control;
+
+	port_hdr = get_feature_ioaddr_by_index(&pdev->dev,
+					       PORT_FEATURE_ID_HEADER);
+	WARN_ON(!port_hdr);
+
 	/*
 	 * HW sets ack bit to 1 when all outstanding requests have been drained
 	 * on this port and minimum soft reset pulse width has elapsed.
@@ -290,56 +398,264 @@ int __fpga_port_disable(struct platform_device *pdev)
 
 	return 0;
 }
+EXPORT_SYMBOL_GPL(__fpga_port_disable_wait);
+
+int __fpga_port_disable(struct platform_device *pdev)
+{
+	if (!__fpga_port_disable_begin(pdev))
+		return 0;
+
+	return __fpga_port_disable_wait(pdev);
+}
 EXPORT_SYMBOL_GPL(__fpga_port_disable);
 
+/* must be called with ctx->lock held */
+static void fpga_msix_account_signal(struct feature_irq_ctx *ctx, u64 since)
+{
+	u64 latency = ktime_to_ns(ktime_get()) - since;
+
+	ctx->stats.signals++;
+	ctx->stats.latency[min_t(int, fls64(latency),
+				 FEATURE_IRQ_LAT_BUCKETS - 1)]++;
+}
+
+/* must be called with ctx->lock held */
+static void fpga_msix_flush_pending(struct feature_irq_ctx *ctx)
+{
+	if (ctx->pending) {
+		eventfd_signal(ctx->trigger, ctx->pending);
+		fpga_msix_account_signal(ctx, ctx->pending_since);
+		ctx->pending = 0;
+	}
+}
+
+static enum hrtimer_restart fpga_msix_moderation_timer(struct hrtimer *timer)
+{
+	struct feature_irq_ctx *ctx = container_of(timer,
+					struct feature_irq_ctx, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	fpga_msix_flush_pending(ctx);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
 static irqreturn_t fpga_msix_handler(int irq, void *arg)
 {
-	struct eventfd_ctx *trigger = arg;
+	struct feature_irq_ctx *ctx = arg;
+	u64 now = ktime_to_ns(ktime_get());
+
+	spin_lock(&ctx->lock);
+	ctx->stats.fires++;
+
+	if (ctx->poll_seq) {
+		WRITE_ONCE(*ctx->poll_seq, *ctx->poll_seq + 1);
+		/* xchg orders the seq update before reading armed. */
+		if (xchg(ctx->poll_armed, 0) && ctx->trigger) {
+			eventfd_signal(ctx->trigger, 1);
+			fpga_msix_account_signal(ctx, now);
+		}
+	} else if (!ctx->trigger) {
+		/* no eventfd bound to this vector, drop it. */
+		ctx->stats.spurious++;
+	} else if (!ktime_to_ns(ctx->max_delay)) {
+		eventfd_signal(ctx->trigger, 1);
+		fpga_msix_account_signal(ctx, now);
+	} else {
+		if (++ctx->pending == 1)
+			ctx->pending_since = now;
+
+		if (ctx->max_events && ctx->pending >= ctx->max_events) {
+			hrtimer_try_to_cancel(&ctx->timer);
+			fpga_msix_flush_pending(ctx);
+		} else if (ctx->pending == 1) {
+			/* first event of a new batch, arm the delay timer. */
+			hrtimer_start(&ctx->timer, ctx->max_delay,
+				      HRTIMER_MODE_REL);
+		}
+	}
+	spin_unlock(&ctx->lock);
 
-	eventfd_signal(trigger, 1);
 	return IRQ_HANDLED;
 }
 
-static int fpga_set_vector_signal(struct feature *feature, int vector, int fd)
+static int feature_irq_stats_show(struct seq_file *m, void *v)
 {
-	struct eventfd_ctx *trigger;
-	int irq, ret;
+	struct feature *feature = m->private;
+	struct feature_irq_stats stats;
+	struct feature_irq_ctx *ctx;
+	int i, j;
+
+	for (i = 0; i < feature->ctx_num; i++) {
+		ctx = &feature->ctx[i];
+
+		spin_lock_irq(&ctx->lock);
+		stats = ctx->stats;
+		spin_unlock_irq(&ctx->lock);
+
+		seq_printf(m, "vector %d: irq %d cpu %d\n", i, ctx->irq,
+			   ctx->cpu);
+		seq_printf(m, "  fires:    %llu\n", stats.fires);
+		seq_printf(m, "  signals:  %llu\n", stats.signals);
+		seq_printf(m, "  spurious: %llu\n", stats.spurious);
+		seq_puts(m, "  latency (ns):\n");
+		for (j = 0; j < FEATURE_IRQ_LAT_BUCKETS; j++) {
+			if (!stats.latency[j])
+				continue;
 
-	if (vector < 0 || vector >= feature->ctx_num)
-		return -EINVAL;
+			seq_printf(m, "    < %llu: %llu\n", 1ULL << j,
+				   stats.latency[j]);
+		}
+	}
+
+	return 0;
+}
+
+static int feature_irq_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, feature_irq_stats_show, inode->i_private);
+}
+
+/* any write resets the statistics of all vectors of the feature. */
+static ssize_t feature_irq_stats_write(struct file *file,
+				       const char __user *buf, size_t count,
+				       loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct feature *feature = m->private;
+	struct feature_irq_ctx *ctx;
+	int i;
 
-	irq = feature->ctx[vector].irq;
+	for (i = 0; i < feature->ctx_num; i++) {
+		ctx = &feature->ctx[i];
 
-	if (feature->ctx[vector].trigger) {
-		free_irq(irq, feature->ctx[vector].trigger);
-		kfree(feature->ctx[vector].name);
-		eventfd_ctx_put(feature->ctx[vector].trigger);
-		feature->ctx[vector].trigger = NULL;
+		spin_lock_irq(&ctx->lock);
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+		spin_unlock_irq(&ctx->lock);
 	}
 
-	if (fd < 0)
-		return 0;
+	return count;
+}
 
-	feature->ctx[vector].name = kasprintf(GFP_KERNEL, "fpga-msix[%d](%s)",
-						vector, feature->name);
-	if (!feature->ctx[vector].name)
-		return -ENOMEM;
+static const struct file_operations feature_irq_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = feature_irq_stats_open,
+	.read = seq_read,
+	.write = feature_irq_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	trigger = eventfd_ctx_fdget(fd);
-	if (IS_ERR(trigger)) {
-		kfree(feature->ctx[vector].name);
-		return PTR_ERR(trigger);
+/*
+ * Interrupts are requested once when the feature is initialized, binding an
+ * eventfd later only swaps the trigger pointer under ctx->lock, which the
+ * handler holds anyway, so rebinding never goes through free_irq() and
+ * request_irq() again.
+ */
+static int feature_irq_init(struct feature_platform_data *pdata,
+			    struct feature *feature)
+{
+	struct feature_irq_ctx *ctx;
+	struct dentry *dir;
+	int i, ret;
+
+	for (i = 0; i < feature->ctx_num; i++) {
+		ctx = &feature->ctx[i];
+
+		ctx->name = kasprintf(GFP_KERNEL, "fpga-msix[%d](%s)",
+				      i, feature->name);
+		if (!ctx->name) {
+			ret = -ENOMEM;
+			goto exit;
+		}
+
+		ret = request_irq(ctx->irq, fpga_msix_handler, 0, ctx->name,
+				  ctx);
+		if (ret) {
+			kfree(ctx->name);
+			ctx->name = NULL;
+			goto exit;
+		}
+
+		irq_set_affinity_hint(ctx->irq, cpumask_of(ctx->cpu));
 	}
 
-	ret = request_irq(irq, fpga_msix_handler, 0, feature->ctx[vector].name,
-			  trigger);
-	if (ret) {
-		kfree(feature->ctx[vector].name);
-		eventfd_ctx_put(trigger);
-		return ret;
+	if (feature->ctx_num && !IS_ERR_OR_NULL(pdata->debugfs)) {
+		dir = debugfs_create_dir(feature->name, pdata->debugfs);
+		if (!IS_ERR_OR_NULL(dir))
+			debugfs_create_file("irq_stats", 0600, dir, feature,
+					    &feature_irq_stats_fops);
+	}
+
+	return 0;
+exit:
+	while (--i >= 0) {
+		ctx = &feature->ctx[i];
+		irq_set_affinity_hint(ctx->irq, NULL);
+		free_irq(ctx->irq, ctx);
+		kfree(ctx->name);
+		ctx->name = NULL;
+	}
+	return ret;
+}
+
+static void feature_irq_uinit(struct feature *feature)
+{
+	struct feature_irq_ctx *ctx;
+	int i;
+
+	for (i = 0; i < feature->ctx_num; i++) {
+		ctx = &feature->ctx[i];
+
+		irq_set_affinity_hint(ctx->irq, NULL);
+		free_irq(ctx->irq, ctx);
+		kfree(ctx->name);
+		ctx->name = NULL;
+
+		hrtimer_cancel(&ctx->timer);
+		ctx->pending = 0;
+		if (ctx->trigger) {
+			eventfd_ctx_put(ctx->trigger);
+			ctx->trigger = NULL;
+		}
+	}
+}
+
+static int fpga_set_vector_signal(struct feature *feature, int vector, int fd)
+{
+	struct eventfd_ctx *trigger = NULL, *old;
+	struct feature_irq_ctx *ctx;
+	unsigned long flags;
+
+	if (vector < 0 || vector >= feature->ctx_num)
+		return -EINVAL;
+
+	ctx = &feature->ctx[vector];
+
+	if (fd >= 0) {
+		trigger = eventfd_ctx_fdget(fd);
+		if (IS_ERR(trigger))
+			return PTR_ERR(trigger);
+	}
+
+	/*
+	 * deliver what is pending to the old eventfd before the swap, the
+	 * delay timer is stopped under the lock as in
+	 * fpga_msix_set_moderation().
+	 */
+	spin_lock_irqsave(&ctx->lock, flags);
+	old = ctx->trigger;
+	if (old) {
+		hrtimer_try_to_cancel(&ctx->timer);
+		fpga_msix_flush_pending(ctx);
 	}
+	ctx->trigger = trigger;
+	spin_unlock_irqrestore(&ctx->lock, flags);
 
-	feature->ctx[vector].trigger = trigger;
+	if (old)
+		eventfd_ctx_put(old);
 
 	return 0;
 }
@@ -366,3 +682,102 @@ int fpga_msix_set_block(struct feature *feature, unsigned int start,
 	return ret;
 }
 EXPORT_SYMBOL_GPL(fpga_msix_set_block);
+
+/*
+ * Update interrupt moderation of the given vectors. max_delay_us of zero
+ * turns moderation off and every interrupt is signalled right away, in this
+ * case max_events must be zero or one. Any pending events are signalled
+ * before the new setting takes effect.
+ */
+int fpga_msix_set_moderation(struct feature *feature, unsigned int start,
+			     unsigned int count, u32 max_events,
+			     u32 max_delay_us)
+{
+	struct feature_irq_ctx *ctx;
+	unsigned long flags;
+	unsigned int i;
+
+	if (start >= feature->ctx_num || start + count > feature->ctx_num)
+		return -EINVAL;
+
+	if (!max_delay_us && max_events > 1)
+		return -EINVAL;
+
+	for (i = start; i < start + count; i++) {
+		ctx = &feature->ctx[i];
+
+		/*
+		 * stop the delay timer under the lock, an interrupt arming it
+		 * for a new batch right after must not lose its timer. If the
+		 * timer is running it waits for the lock and finds nothing
+		 * pending.
+		 */
+		spin_lock_irqsave(&ctx->lock, flags);
+		hrtimer_try_to_cancel(&ctx->timer);
+		if (ctx->trigger)
+			fpga_msix_flush_pending(ctx);
+		ctx->max_events = max_events;
+		ctx->max_delay = ns_to_ktime((u64)max_delay_us * NSEC_PER_USEC);
+		spin_unlock_irqrestore(&ctx->lock, flags);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fpga_msix_set_moderation);
+
+/*
+ * Steer the given vectors to one cpu, e.g. the one which consumes the
+ * eventfd. A negative cpu restores the default spreading over the cpus of
+ * the device's numa node.
+ */
+int fpga_msix_set_affinity(struct feature *feature, unsigned int start,
+			   unsigned int count, int cpu)
+{
+	struct feature_irq_ctx *ctx;
+	unsigned int i;
+
+	if (start >= feature->ctx_num || start + count > feature->ctx_num)
+		return -EINVAL;
+
+	if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))
+		return -EINVAL;
+
+	for (i = start; i < start + count; i++) {
+		ctx = &feature->ctx[i];
+		ctx->cpu = cpu < 0 ? ctx->default_cpu : cpu;
+		irq_set_affinity_hint(ctx->irq, cpumask_of(ctx->cpu));
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fpga_msix_set_affinity);
+
+/*
+ * Switch a vector to busy-poll mode, where each interrupt increments *seq
+ * and is signalled to the eventfd only if *armed is set, or back to normal
+ * eventfd mode with a NULL seq. Any pending moderated events are signalled
+ * first.
+ */
+int fpga_msix_set_poll(struct feature *feature, unsigned int vector,
+		       u64 *seq, u32 *armed)
+{
+	struct feature_irq_ctx *ctx;
+	unsigned long flags;
+
+	if (vector >= feature->ctx_num || (seq && !armed))
+		return -EINVAL;
+
+	ctx = &feature->ctx[vector];
+
+	/* stop the delay timer under the lock, see fpga_msix_set_moderation */
+	spin_lock_irqsave(&ctx->lock, flags);
+	hrtimer_try_to_cancel(&ctx->timer);
+	if (ctx->trigger)
+		fpga_msix_flush_pending(ctx);
+	ctx->poll_seq = seq;
+	ctx->poll_armed = armed;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fpga_msix_set_poll);
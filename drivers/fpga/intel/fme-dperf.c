@@ -103,7 +103,7 @@ static const struct attribute_group *perf_dev_attr_groups[] = {
 	NULL,
 };
 
-static bool fabric_pobj_is_enabled(struct perf_object *pobj,
+static bool fabric_port_is_enabled(int port_id,
 				   struct feature_fme_dperf *dperf)
 {
 	struct feature_fme_dfpmon_fab_ctl ctl;
@@ -111,45 +111,100 @@ static bool fabric_pobj_is_enabled(struct perf_object *pobj,
 	ctl.csr = readq(&dperf->fab_ctl);
 
 	if (ctl.port_filter == FAB_DISABLE_FILTER)
-		return pobj->id == PERF_OBJ_ROOT_ID;
+		return port_id == PERF_OBJ_ROOT_ID;
 
-	return pobj->id == ctl.port_id;
+	return port_id == ctl.port_id;
 }
 
-static ssize_t read_fabric_counter(struct perf_object *pobj,
-				   enum dperf_fab_events fab_event, char *buf)
+/*
+ * Same as fme_iperf_read_fabric() for the discrete performance feature,
+ * called with fme->perf_lock held.
+ */
+int fme_dperf_read_fabric(struct device *fme_dev, int port_id, u8 event,
+			  u64 *counter)
 {
-	struct feature_platform_data *pdata = dev_get_platdata(pobj->fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	u8 *evsel = &fme->perf_evsel[FPGA_FME_PERF_BLOCK_FABRIC];
 	struct feature_fme_dfpmon_fab_ctl ctl;
 	struct feature_fme_dfpmon_fab_ctr ctr;
 	struct feature_fme_dperf *dperf;
-	u64 counter = 0;
 
-	mutex_lock(&pdata->lock);
-	dperf = get_feature_ioaddr_by_index(pobj->fme_dev,
+	dperf = get_feature_ioaddr_by_index(fme_dev,
 					    FME_FEATURE_ID_GLOBAL_DPERF);
 
-	/* if it is disabled, force the counter to return zero. */
-	if (!fabric_pobj_is_enabled(pobj, dperf))
-		goto exit;
+	/* the recorded select is only trusted if the counter agrees. */
+	ctr.csr = readq(&dperf->fab_ctr);
+	if (*evsel != event || ctr.event_code != event) {
+		ctl.csr = readq(&dperf->fab_ctl);
+		ctl.fab_evtcode = event;
+		writeq(ctl.csr, &dperf->fab_ctl);
+		*evsel = FME_PERF_EVSEL_NONE;
+
+		ctr.event_code = event;
+
+		if (fpga_wait_register_field(event_code, ctr,
+					     &dperf->fab_ctr,
+					     DPERF_TIMEOUT, 1)) {
+			dev_err(fme_dev, "timeout, unmatched VTd event type in counter registers.\n");
+			return -ETIMEDOUT;
+		}
+
+		*evsel = event;
+		ctr.csr = readq(&dperf->fab_ctr);
+	}
 
-	ctl.csr = readq(&dperf->fab_ctl);
-	ctl.fab_evtcode = fab_event;
-	writeq(ctl.csr, &dperf->fab_ctl);
+	*counter = fme_perf_accumulate(&fme->acc_fabric[event], ctr.fab_cnt,
+				       FME_PERF_FABRIC_WIDTH);
 
-	ctr.event_code = fab_event;
+	if (!fabric_port_is_enabled(port_id, dperf))
+		return -ENODATA;
 
-	if (fpga_wait_register_field(event_code, ctr,
-				     &dperf->fab_ctr, DPERF_TIMEOUT, 1)) {
-		dev_err(pobj->fme_dev, "timeout, unmatched VTd event type in counter registers.\n");
-		mutex_unlock(&pdata->lock);
-		return -ETIMEDOUT;
+	return 0;
+}
+
+void fme_dperf_set_fabric_port(struct device *fme_dev, int port_id)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	struct feature_fme_dfpmon_fab_ctl ctl;
+	struct feature_fme_dperf *dperf;
+	u64 old;
+
+	dperf = get_feature_ioaddr_by_index(fme_dev,
+					    FME_FEATURE_ID_GLOBAL_DPERF);
+
+	ctl.csr = old = readq(&dperf->fab_ctl);
+	if (port_id == PERF_OBJ_ROOT_ID)
+		ctl.port_filter = FAB_DISABLE_FILTER;
+	else {
+		ctl.port_filter = FAB_ENABLE_FILTER;
+		ctl.port_id = port_id;
 	}
 
-	ctr.csr = readq(&dperf->fab_ctr);
-	counter = ctr.fab_cnt;
-exit:
-	mutex_unlock(&pdata->lock);
+	if (ctl.csr != old)
+		fme->perf_fab_seq++;
+
+	writeq(ctl.csr, &dperf->fab_ctl);
+}
+
+static ssize_t read_fabric_counter(struct perf_object *pobj,
+				   enum dperf_fab_events fab_event, char *buf)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
+	u64 counter;
+	int ret;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	ret = fme_dperf_read_fabric(pobj->fme_dev, pobj->id, fab_event,
+				    &counter);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	/* if it is disabled, force the counter to return zero. */
+	if (ret == -ENODATA)
+		counter = 0;
+	else if (ret)
+		return ret;
+
 	return scnprintf(buf, PAGE_SIZE, "0x%llx\n", counter);
 }
 
@@ -165,6 +220,17 @@ FAB_SHOW(pcie0_write, DPERF_FAB_PCIE0_WR);
 FAB_SHOW(mmio_read, DPERF_FAB_MMIO_RD);
 FAB_SHOW(mmio_write, DPERF_FAB_MMIO_WR);
 
+#define METRIC_SHOW(name, metric)					\
+static ssize_t name##_show(struct perf_object *pobj, char *buf)		\
+{									\
+	return fme_perf_metric_show(pobj, metric, buf);			\
+}									\
+static PERF_OBJ_ATTR_RO(name)
+
+/* bytes per second, for the port the fabric counters counted for */
+METRIC_SHOW(pcie0_read_bandwidth, FME_PERF_PCIE0_READ_BW);
+METRIC_SHOW(pcie0_write_bandwidth, FME_PERF_PCIE0_WRITE_BW);
+
 static ssize_t fab_enable_show(struct perf_object *pobj, char *buf)
 {
 	struct feature_fme_dperf *dperf;
@@ -173,7 +239,7 @@ static ssize_t fab_enable_show(struct perf_object *pobj, char *buf)
 	dperf = get_feature_ioaddr_by_index(pobj->fme_dev,
 					    FME_FEATURE_ID_GLOBAL_DPERF);
 
-	status = fabric_pobj_is_enabled(pobj, dperf);
+	status = fabric_port_is_enabled(pobj->id, dperf);
 	return scnprintf(buf, PAGE_SIZE, "%d\n", status);
 }
 
@@ -184,10 +250,10 @@ static ssize_t fab_enable_show(struct perf_object *pobj, char *buf)
 static ssize_t fab_enable_store(struct perf_object *pobj,
 				const char *buf, size_t n)
 {
-	struct feature_platform_data *pdata  = dev_get_platdata(pobj->fme_dev);
-	struct feature_fme_dfpmon_fab_ctl ctl;
-	struct feature_fme_dperf *dperf;
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
 	bool state;
+	int ret = 0;
 
 	if (strtobool(buf, &state))
 		return -EINVAL;
@@ -195,26 +261,18 @@ static ssize_t fab_enable_store(struct perf_object *pobj,
 	if (!state)
 		return -EINVAL;
 
-	dperf = get_feature_ioaddr_by_index(pobj->fme_dev,
-					    FME_FEATURE_ID_GLOBAL_DPERF);
-
-	/* if it is already enabled. */
-	if (fabric_pobj_is_enabled(pobj, dperf))
-		return n;
-
-	mutex_lock(&pdata->lock);
-	ctl.csr = readq(&dperf->fab_ctl);
-	if (pobj->id == PERF_OBJ_ROOT_ID)
-		ctl.port_filter = FAB_DISABLE_FILTER;
-	else {
-		ctl.port_filter = FAB_ENABLE_FILTER;
-		ctl.port_id = pobj->id;
-	}
-
-	writeq(ctl.csr, &dperf->fab_ctl);
-	mutex_unlock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	/*
+	 * perf fabric events are counting with the port filter they need,
+	 * or the multiplexer owns it.
+	 */
+	if (fme->perf_fab_users || fme->fab_mux)
+		ret = -EBUSY;
+	else
+		fme_dperf_set_fabric_port(pobj->fme_dev, pobj->id);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
 
-	return n;
+	return ret ? ret : n;
 }
 
 static PERF_OBJ_ATTR(fab_enable, enable, 0644, fab_enable_show,
@@ -225,6 +283,8 @@ static struct attribute *fabric_attrs[] = {
 	&perf_obj_attr_pcie0_write.attr,
 	&perf_obj_attr_mmio_read.attr,
 	&perf_obj_attr_mmio_write.attr,
+	&perf_obj_attr_pcie0_read_bandwidth.attr,
+	&perf_obj_attr_pcie0_write_bandwidth.attr,
 	&perf_obj_attr_fab_enable.attr,
 	NULL,
 };
@@ -252,21 +312,22 @@ static ssize_t fab_freeze_show(struct perf_object *pobj, char *buf)
 static ssize_t fab_freeze_store(struct perf_object *pobj,
 				const char *buf, size_t n)
 {
-	struct feature_platform_data *pdata = dev_get_platdata(pobj->fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
 	struct feature_fme_dperf *dperf;
 	struct feature_fme_dfpmon_fab_ctl ctl;
+	unsigned long flags;
 	bool state;
 
 	if (strtobool(buf, &state))
 		return -EINVAL;
 
-	mutex_lock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
 	dperf = get_feature_ioaddr_by_index(pobj->fme_dev,
 					    FME_FEATURE_ID_GLOBAL_DPERF);
 	ctl.csr = readq(&dperf->fab_ctl);
 	ctl.freeze = state;
 	writeq(ctl.csr, &dperf->fab_ctl);
-	mutex_unlock(&pdata->lock);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
 
 	return n;
 }
@@ -289,6 +350,51 @@ static const struct attribute_group *fabric_top_attr_groups[] = {
 	NULL,
 };
 
+/*
+ * The dperf counterpart of fme_iperf_snapshot(). It only has the fabric
+ * counter block, which is read in one perf_lock hold.
+ */
+static int fme_dperf_snapshot(struct platform_device *pdev,
+			      struct fpga_fme_perf_snapshot *snap)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+	struct feature_fme_dfpmon_fab_ctl ctl;
+	struct feature_fme_dperf *dperf;
+	struct device *dev = &pdev->dev;
+	unsigned long flags;
+	int i, ret = 0;
+	bool frozen;
+
+	dperf = get_feature_ioaddr_by_index(dev, FME_FEATURE_ID_GLOBAL_DPERF);
+	snap->valid = FPGA_FME_PERF_SNAPSHOT_FABRIC;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	ctl.csr = readq(&dperf->fab_ctl);
+	frozen = ctl.freeze;
+	ctl.freeze = 1;
+	writeq(ctl.csr, &dperf->fab_ctl);
+	snap->clock = readq(&dperf->clk);
+
+	snap->fab_port = ctl.port_filter == FAB_ENABLE_FILTER ?
+			 ctl.port_id : -1;
+
+	for (i = 0; !ret && i <= DPERF_FAB_MMIO_WR; i++) {
+		if (i > DPERF_FAB_PCIE0_WR && i < DPERF_FAB_MMIO_RD)
+			continue;
+
+		ret = fme_dperf_read_fabric(dev, snap->fab_port < 0 ?
+					    PERF_OBJ_ROOT_ID : snap->fab_port,
+					    i, &snap->fabric[i]);
+	}
+
+	ctl.csr = readq(&dperf->fab_ctl);
+	ctl.freeze = frozen;
+	writeq(ctl.csr, &dperf->fab_ctl);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	return ret;
+}
+
 static struct perf_object *
 create_perf_obj(struct device *fme_dev, struct kobject *parent, int id,
 		const struct attribute_group **groups, const char *name)
@@ -367,7 +473,7 @@ static int create_perf_fabric_obj(struct perf_object *perf_dev)
 		list_add(&obj->node, &pobj->children);
 	}
 
-	return 0;
+	return fme_fab_mux_create_objs(pobj, create_perf_obj);
 }
 
 static struct perf_object *create_perf_dev(struct platform_device *pdev)
@@ -407,9 +513,28 @@ fme_dperf_uinit(struct platform_device *pdev, struct feature *feature)
 	fme = fpga_pdata_get_private(pdata);
 	destroy_perf_obj(fme->dperf_dev);
 	fme->dperf_dev = NULL;
+	fme_fab_mux_uinit(pdev);
+}
+
+static long fme_dperf_ioctl(struct platform_device *pdev,
+			    struct feature *feature, unsigned int cmd,
+			    unsigned long arg)
+{
+	long ret;
+
+	switch (cmd) {
+	case FPGA_FME_PERF_SNAPSHOT:
+		ret = fme_perf_snapshot_ioctl(pdev, arg, fme_dperf_snapshot);
+		break;
+	default:
+		ret = -ENODEV;
+	}
+
+	return ret;
 }
 
 struct feature_ops global_dperf_ops = {
 	.init = fme_dperf_init,
 	.uinit = fme_dperf_uinit,
+	.ioctl = fme_dperf_ioctl,
 };
@@ -0,0 +1,449 @@
+/*
+ * Driver for FPGA Global Performance Fabric Counter Multiplexing
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/intel-fpga.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+/* bounds of the time the port filter stays on one port */
+#define FAB_MUX_MIN_PERIOD_MS	1
+#define FAB_MUX_MAX_PERIOD_MS	1000
+
+/* fixed point shift of the extrapolation scale */
+#define FAB_MUX_SCALE_SHIFT	16
+
+/*
+ * The fabric counters only count for the port selected by the port
+ * filter. The multiplexer moves the filter from port to port, the slice
+ * counted for a port is extrapolated over the time since the port was
+ * last observed, as perf does for multiplexed events.
+ */
+struct fme_fab_mux_port {
+	u64 estimate[FME_PERF_EVENTS];	/* extrapolated total */
+	u64 rate[FME_PERF_EVENTS];	/* per second, in the last slice */
+	u64 last_end;			/* the last slice of the port ended */
+};
+
+struct fme_fab_mux {
+	struct delayed_work work;
+	struct device *fme_dev;
+	struct fpga_fme *fme;
+	unsigned int period_ms;
+	u16 events;			/* the fabric events of the FME */
+	int nr_ports;
+	int port;			/* the port the filter is on */
+	u32 seq;			/* perf_fab_seq, unique to this mux */
+	bool reverse;			/* read the events backwards */
+	u64 slice_start;
+	u64 last[FME_PERF_EVENTS];	/* the totals when the slice started */
+	struct fme_fab_mux_port ports[MAX_FPGA_PORT_NUM];
+};
+
+/* the number of ports of the FME, as many as the port filter can take */
+static int fme_fab_mux_nr_ports(struct device *fme_dev)
+{
+	struct feature_fme_capability fme_capability;
+	struct feature_fme_header *fme_hdr;
+
+	fme_hdr = get_feature_ioaddr_by_index(fme_dev, FME_FEATURE_ID_HEADER);
+	fme_capability.csr = readq(&fme_hdr->capability);
+
+	return min_t(int, fme_capability.num_ports, MAX_FPGA_PORT_NUM);
+}
+
+/*
+ * Read the fabric counters of the current port, fme->perf_lock held. Every
+ * other read goes backwards, starting with the event left selected.
+ */
+static void fme_fab_mux_read(struct fme_fab_mux *mux, u64 *counter)
+{
+	u64 config;
+	int n, event;
+
+	for (n = 0; n < FME_PERF_EVENTS; n++) {
+		event = mux->reverse ? FME_PERF_EVENTS - 1 - n : n;
+		counter[event] = mux->last[event];
+		if (!(mux->events & BIT(event)))
+			continue;
+
+		config = FPGA_FME_PERF_CONFIG(FPGA_FME_PERF_BLOCK_FABRIC,
+					      event) |
+			 FPGA_FME_PERF_PORT(mux->port);
+		fme_perf_read_config(mux->fme_dev, config, &counter[event]);
+	}
+
+	mux->reverse = !mux->reverse;
+}
+
+/* close the slice of the current port, fme->perf_lock held. */
+static void fme_fab_mux_account(struct fme_fab_mux *mux, u64 now)
+{
+	struct fme_fab_mux_port *p = &mux->ports[mux->port];
+	u64 counter[FME_PERF_EVENTS], delta, slice, scale;
+	int event;
+
+	slice = now - mux->slice_start;
+	if (!slice)
+		return;
+
+	scale = div64_u64((now - p->last_end) << FAB_MUX_SCALE_SHIFT, slice);
+
+	fme_fab_mux_read(mux, counter);
+	for (event = 0; event < FME_PERF_EVENTS; event++) {
+		delta = counter[event] - mux->last[event];
+		p->estimate[event] += (delta * scale) >> FAB_MUX_SCALE_SHIFT;
+		p->rate[event] = div64_u64(delta * NSEC_PER_SEC, slice);
+		mux->last[event] = counter[event];
+	}
+
+	p->last_end = now;
+	mux->slice_start = now;
+}
+
+static void fme_fab_mux_work(struct work_struct *work)
+{
+	struct fme_fab_mux *mux = container_of(to_delayed_work(work),
+					       struct fme_fab_mux, work);
+	struct fpga_fme *fme = mux->fme;
+	unsigned int period_ms;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	/* stopping, the filter isn't ours anymore. */
+	if (fme->fab_mux != mux) {
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+		return;
+	}
+
+	fme_fab_mux_account(mux, ktime_get_ns());
+	mux->port = (mux->port + 1) % mux->nr_ports;
+	fme_perf_set_fabric_port(mux->fme_dev, mux->port);
+	period_ms = mux->period_ms;
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	schedule_delayed_work(&mux->work, msecs_to_jiffies(period_ms));
+}
+
+static int fme_fab_mux_start(struct device *fme_dev, unsigned int period_ms)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	struct fme_fab_mux *mux;
+	unsigned long flags;
+	int event, port, ret = 0;
+	u64 now;
+
+	mux = kzalloc(sizeof(*mux), GFP_KERNEL);
+	if (!mux)
+		return -ENOMEM;
+
+	INIT_DELAYED_WORK(&mux->work, fme_fab_mux_work);
+	mux->fme_dev = fme_dev;
+	mux->fme = fme;
+	mux->period_ms = period_ms;
+	mux->nr_ports = fme_fab_mux_nr_ports(fme_dev);
+	for (event = 0; event < FME_PERF_EVENTS; event++)
+		if (fme_perf_config_valid(fme_dev, FPGA_FME_PERF_CONFIG(
+				FPGA_FME_PERF_BLOCK_FABRIC, event)))
+			mux->events |= BIT(event);
+
+	if (!mux->nr_ports || !mux->events) {
+		kfree(mux);
+		return -ENODEV;
+	}
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	/* perf fabric events are counting with the port filter they need. */
+	if (fme->perf_fab_users) {
+		ret = -EBUSY;
+	} else {
+		fme_perf_set_fabric_port(fme_dev, mux->port);
+		/*
+		 * a new key even if the filter didn't move, the estimates of
+		 * this mux don't compare to those of the previous one.
+		 */
+		mux->seq = ++fme->perf_fab_seq;
+		fme_fab_mux_read(mux, mux->last);
+		now = ktime_get_ns();
+		mux->slice_start = now;
+		for (port = 0; port < mux->nr_ports; port++)
+			mux->ports[port].last_end = now;
+		fme->fab_mux = mux;
+	}
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	if (ret) {
+		kfree(mux);
+		return ret;
+	}
+
+	schedule_delayed_work(&mux->work, msecs_to_jiffies(period_ms));
+	return 0;
+}
+
+static void fme_fab_mux_stop(struct device *fme_dev)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	struct fme_fab_mux *mux;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	mux = fme->fab_mux;
+	fme->fab_mux = NULL;
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	if (!mux)
+		return;
+
+	cancel_delayed_work_sync(&mux->work);
+	kfree(mux);
+}
+
+/* set the period of the multiplexer, 0 stops it, pdata->lock held. */
+static int fme_fab_mux_set_period(struct device *fme_dev,
+				  unsigned int period_ms)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	unsigned long flags;
+	bool running;
+
+	if (!period_ms) {
+		fme_fab_mux_stop(fme_dev);
+		return 0;
+	}
+
+	if (period_ms < FAB_MUX_MIN_PERIOD_MS ||
+	    period_ms > FAB_MUX_MAX_PERIOD_MS)
+		return -EINVAL;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	running = fme->fab_mux;
+	if (running)
+		fme->fab_mux->period_ms = period_ms;
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	return running ? 0 : fme_fab_mux_start(fme_dev, period_ms);
+}
+
+/*
+ * The estimated fabric counters of @port_id, fme->perf_lock held. They
+ * only compare to those read with the same @fab_key, i.e. while the same
+ * multiplexer ran.
+ */
+bool fme_fab_mux_read_port(struct fpga_fme *fme, int port_id, u64 *counter,
+			   u64 *fab_key)
+{
+	struct fme_fab_mux *mux = fme->fab_mux;
+
+	if (!mux || port_id >= mux->nr_ports)
+		return false;
+
+	memcpy(counter, mux->ports[port_id].estimate,
+	       sizeof(mux->ports[port_id].estimate));
+	*fab_key = BIT_ULL(32) | mux->seq;
+	return true;
+}
+
+/*
+ * The rate of @event for @port_id in its last slice, the sum over the
+ * ports for PERF_OBJ_ROOT_ID, fme->perf_lock held. False if the
+ * multiplexer is off.
+ */
+bool fme_fab_mux_read_rate(struct fpga_fme *fme, int port_id, u8 event,
+			   u64 *rate)
+{
+	struct fme_fab_mux *mux = fme->fab_mux;
+	int port;
+
+	if (!mux)
+		return false;
+
+	*rate = 0;
+	if (port_id == PERF_OBJ_ROOT_ID) {
+		for (port = 0; port < mux->nr_ports; port++)
+			*rate += mux->ports[port].rate[event];
+	} else if (port_id < mux->nr_ports) {
+		*rate = mux->ports[port_id].rate[event];
+	}
+
+	return true;
+}
+
+void fme_fab_mux_uinit(struct platform_device *pdev)
+{
+	fme_fab_mux_stop(&pdev->dev);
+}
+
+static ssize_t period_ms_show(struct perf_object *pobj, char *buf)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned int period_ms = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	if (fme->fab_mux)
+		period_ms = fme->fab_mux->period_ms;
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", period_ms);
+}
+
+static ssize_t period_ms_store(struct perf_object *pobj,
+			       const char *buf, size_t n)
+{
+	struct feature_platform_data *pdata;
+	unsigned int period_ms;
+	int ret;
+
+	if (kstrtouint(buf, 0, &period_ms))
+		return -EINVAL;
+
+	pdata = dev_get_platdata(pobj->fme_dev);
+	mutex_lock(&pdata->lock);
+	ret = fme_fab_mux_set_period(pobj->fme_dev, period_ms);
+	mutex_unlock(&pdata->lock);
+
+	return ret ? ret : n;
+}
+static PERF_OBJ_ATTR_RW(period_ms);
+
+static struct attribute *fab_mux_attrs[] = {
+	&perf_obj_attr_period_ms.attr,
+	NULL,
+};
+
+static struct attribute_group fab_mux_attr_group = {
+	.attrs = fab_mux_attrs,
+};
+
+static const struct attribute_group *fme_fab_mux_attr_groups[] = {
+	&fab_mux_attr_group,
+	NULL,
+};
+
+static ssize_t fab_mux_show(struct perf_object *pobj, u8 event, bool rate,
+			    char *buf)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	struct fme_fab_mux_port *p;
+	unsigned long flags;
+	u64 value = 0;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	/* read as zero as long as the multiplexer is off. */
+	if (fme->fab_mux) {
+		p = &fme->fab_mux->ports[pobj->id];
+		value = rate ? p->rate[event] : p->estimate[event];
+	}
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	if (rate)
+		return scnprintf(buf, PAGE_SIZE, "%llu\n", value);
+	return scnprintf(buf, PAGE_SIZE, "0x%llx\n", value);
+}
+
+#define FAB_MUX_SHOW(name, event)					\
+static ssize_t name##_show(struct perf_object *pobj, char *buf)		\
+{									\
+	return fab_mux_show(pobj, event, false, buf);			\
+}									\
+static PERF_OBJ_ATTR_RO(name);						\
+static ssize_t name##_rate_show(struct perf_object *pobj, char *buf)	\
+{									\
+	return fab_mux_show(pobj, event, true, buf);			\
+}									\
+static PERF_OBJ_ATTR_RO(name##_rate)
+
+FAB_MUX_SHOW(pcie0_read, IPERF_FAB_PCIE0_RD);
+FAB_MUX_SHOW(pcie0_write, IPERF_FAB_PCIE0_WR);
+FAB_MUX_SHOW(pcie1_read, IPERF_FAB_PCIE1_RD);
+FAB_MUX_SHOW(pcie1_write, IPERF_FAB_PCIE1_WR);
+FAB_MUX_SHOW(upi_read, IPERF_FAB_UPI_RD);
+FAB_MUX_SHOW(upi_write, IPERF_FAB_UPI_WR);
+FAB_MUX_SHOW(mmio_read, IPERF_FAB_MMIO_RD);
+FAB_MUX_SHOW(mmio_write, IPERF_FAB_MMIO_WR);
+
+/* an estimate and a rate per event, in the order of the event codes */
+static struct attribute *fab_mux_port_attrs[] = {
+	&perf_obj_attr_pcie0_read.attr,
+	&perf_obj_attr_pcie0_read_rate.attr,
+	&perf_obj_attr_pcie0_write.attr,
+	&perf_obj_attr_pcie0_write_rate.attr,
+	&perf_obj_attr_pcie1_read.attr,
+	&perf_obj_attr_pcie1_read_rate.attr,
+	&perf_obj_attr_pcie1_write.attr,
+	&perf_obj_attr_pcie1_write_rate.attr,
+	&perf_obj_attr_upi_read.attr,
+	&perf_obj_attr_upi_read_rate.attr,
+	&perf_obj_attr_upi_write.attr,
+	&perf_obj_attr_upi_write_rate.attr,
+	&perf_obj_attr_mmio_read.attr,
+	&perf_obj_attr_mmio_read_rate.attr,
+	&perf_obj_attr_mmio_write.attr,
+	&perf_obj_attr_mmio_write_rate.attr,
+	NULL,
+};
+
+/* dperf only has some of the fabric events */
+static umode_t fab_mux_port_attr_visible(struct kobject *kobj,
+					 struct attribute *attr, int n)
+{
+	struct perf_object *pobj = to_perf_obj(kobj);
+	u64 config = FPGA_FME_PERF_CONFIG(FPGA_FME_PERF_BLOCK_FABRIC, n / 2);
+
+	return fme_perf_config_valid(pobj->fme_dev, config) ? attr->mode : 0;
+}
+
+static struct attribute_group fab_mux_port_attr_group = {
+	.attrs = fab_mux_port_attrs,
+	.is_visible = fab_mux_port_attr_visible,
+};
+
+static const struct attribute_group *fme_fab_mux_port_attr_groups[] = {
+	&fab_mux_port_attr_group,
+	NULL,
+};
+
+/*
+ * Create the objects of the multiplexer under the fabric object of the
+ * iperf or dperf feature, with @create as both have their own objects.
+ */
+int fme_fab_mux_create_objs(struct perf_object *fabric,
+			    perf_obj_create_t create)
+{
+	struct perf_object *pobj, *obj;
+	int i, nr_ports;
+
+	pobj = create(fabric->fme_dev, &fabric->kobj, PERF_OBJ_ROOT_ID,
+		      fme_fab_mux_attr_groups, "mux");
+	if (IS_ERR(pobj))
+		return PTR_ERR(pobj);
+
+	list_add(&pobj->node, &fabric->children);
+
+	nr_ports = fme_fab_mux_nr_ports(fabric->fme_dev);
+	for (i = 0; i < nr_ports; i++) {
+		obj = create(fabric->fme_dev, &pobj->kobj, i,
+			     fme_fab_mux_port_attr_groups, "port");
+		if (IS_ERR(obj))
+			return PTR_ERR(obj);
+
+		list_add(&obj->node, &pobj->children);
+	}
+
+	return 0;
+}
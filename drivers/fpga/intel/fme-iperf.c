@@ -17,6 +17,8 @@
  *
  */
 
+#include <linux/uaccess.h>
+
 #include "feature-dev.h"
 #include "fme.h"
 
@@ -109,21 +111,22 @@ static ssize_t freeze_show(struct perf_object *pobj, char *buf)
 
 static ssize_t freeze_store(struct perf_object *pobj, const char *buf, size_t n)
 {
-	struct feature_platform_data *pdata = dev_get_platdata(pobj->fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
 	struct feature_fme_iperf *iperf;
 	struct feature_fme_ifpmon_ch_ctl ctl;
+	unsigned long flags;
 	bool state;
 
 	if (strtobool(buf, &state))
 		return -EINVAL;
 
-	mutex_lock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
 	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
 	ctl.csr = readq(&iperf->ch_ctl);
 	ctl.freeze = state;
 	writeq(ctl.csr, &iperf->ch_ctl);
-	mutex_unlock(&pdata->lock);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
 
 	return n;
 }
@@ -131,40 +134,90 @@ static PERF_OBJ_ATTR_RW(freeze);
 
 #define IPERF_TIMEOUT	30
 
-static ssize_t read_cache_counter(struct perf_object *pobj, char *buf,
-				  u8 channel, enum iperf_cache_events event)
+/*
+ * The counter readers below select the event in the control register of a
+ * counter block and read the counter once it reports that event, unless
+ * the event is selected already, see fme->perf_evsel, and the counter
+ * register still reports it. They are shared by sysfs and the perf PMU
+ * and must be called with fme->perf_lock held, which is a spinlock as perf
+ * reads counters in atomic context.
+ */
+int fme_iperf_read_cache(struct device *fme_dev, u8 channel, u8 event,
+			 u64 *counter)
 {
-	struct device *fme_dev = pobj->fme_dev;
-	struct feature_platform_data *pdata = dev_get_platdata(fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	struct fme_perf_accum *acc = fme->acc_cache[channel][event];
+	u8 *evsel = &fme->perf_evsel[FPGA_FME_PERF_BLOCK_CACHE];
 	struct feature_fme_iperf *iperf;
 	struct feature_fme_ifpmon_ch_ctl ctl;
 	struct feature_fme_ifpmon_ch_ctr ctr0, ctr1;
-	u64 counter;
 
-	mutex_lock(&pdata->lock);
 	iperf = get_feature_ioaddr_by_index(fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
 
-	/* set channel access type and cache event code. */
+	/* the recorded select is only trusted if the registers agree. */
 	ctl.csr = readq(&iperf->ch_ctl);
-	ctl.cci_chsel = channel;
-	ctl.cache_event = event;
-	writeq(ctl.csr, &iperf->ch_ctl);
+	ctr0.csr = readq(&iperf->ch_ctr0);
+	ctr1.csr = readq(&iperf->ch_ctr1);
+	if (*evsel != FME_PERF_EVSEL_CACHE(channel, event) ||
+	    ctl.cci_chsel != channel || ctl.cache_event != event ||
+	    ctr0.event_code != event || ctr1.event_code != event) {
+		/* set channel access type and cache event code. */
+		ctl.cci_chsel = channel;
+		ctl.cache_event = event;
+		writeq(ctl.csr, &iperf->ch_ctl);
+		*evsel = FME_PERF_EVSEL_NONE;
+
+		/* check the event type in the counter registers */
+		ctr0.event_code = event;
+
+		if (fpga_wait_register_field(event_code, ctr0,
+					     &iperf->ch_ctr0,
+					     IPERF_TIMEOUT, 1)) {
+			dev_err(fme_dev, "timeout, unmatched cache event type in counter registers.\n");
+			return -ETIMEDOUT;
+		}
+
+		*evsel = FME_PERF_EVSEL_CACHE(channel, event);
+		ctr0.csr = readq(&iperf->ch_ctr0);
+		ctr1.csr = readq(&iperf->ch_ctr1);
+	}
 
-	/* check the event type in the counter registers */
-	ctr0.event_code = event;
+	*counter = fme_perf_accumulate(&acc[0], ctr0.cache_counter,
+				       FME_PERF_CACHE_WIDTH) +
+		   fme_perf_accumulate(&acc[1], ctr1.cache_counter,
+				       FME_PERF_CACHE_WIDTH);
 
-	if (fpga_wait_register_field(event_code, ctr0,
-				     &iperf->ch_ctr0, IPERF_TIMEOUT, 1)) {
-		dev_err(fme_dev, "timeout, unmatched cache event type in counter registers.\n");
-		mutex_unlock(&pdata->lock);
-		return -ETIMEDOUT;
+	return 0;
+}
+
+/* the channel a cache event is counted on */
+u8 fme_iperf_cache_channel(u8 event)
+{
+	switch (event) {
+	case IPERF_CACHE_WR_HIT:
+	case IPERF_CACHE_WR_MISS:
+	case IPERF_CACHE_DATA_WR_PORT_CONTEN:
+	case IPERF_CACHE_TAG_WR_PORT_CONTEN:
+		return CACHE_CHANNEL_WR;
 	}
 
-	ctr0.csr = readq(&iperf->ch_ctr0);
-	ctr1.csr = readq(&iperf->ch_ctr1);
-	counter = ctr0.cache_counter + ctr1.cache_counter;
-	mutex_unlock(&pdata->lock);
+	return CACHE_CHANNEL_RD;
+}
+
+static ssize_t read_cache_counter(struct perf_object *pobj, char *buf,
+				  u8 channel, enum iperf_cache_events event)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
+	u64 counter;
+	int ret;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	ret = fme_iperf_read_cache(pobj->fme_dev, channel, event, &counter);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+	if (ret)
+		return ret;
 
 	return scnprintf(buf, PAGE_SIZE, "0x%llx\n", counter);
 }
@@ -189,6 +242,16 @@ CACHE_SHOW(data_write_port_contention, CACHE_CHANNEL_WR,
 CACHE_SHOW(tag_write_port_contention, CACHE_CHANNEL_WR,
 	   IPERF_CACHE_TAG_WR_PORT_CONTEN);
 
+#define METRIC_SHOW(name, metric)					\
+static ssize_t name##_show(struct perf_object *pobj, char *buf)		\
+{									\
+	return fme_perf_metric_show(pobj, metric, buf);			\
+}									\
+static PERF_OBJ_ATTR_RO(name)
+
+METRIC_SHOW(read_hit_ratio, FME_PERF_CACHE_READ_HIT_RATIO);
+METRIC_SHOW(write_hit_ratio, FME_PERF_CACHE_WRITE_HIT_RATIO);
+
 static struct attribute *cache_attrs[] = {
 	&perf_obj_attr_read_hit.attr,
 	&perf_obj_attr_read_miss.attr,
@@ -200,6 +263,8 @@ static struct attribute *cache_attrs[] = {
 	&perf_obj_attr_tx_req_stall.attr,
 	&perf_obj_attr_rx_req_stall.attr,
 	&perf_obj_attr_rx_eviction.attr,
+	&perf_obj_attr_read_hit_ratio.attr,
+	&perf_obj_attr_write_hit_ratio.attr,
 	&perf_obj_attr_freeze.attr,
 	NULL,
 };
@@ -228,22 +293,22 @@ ssize_t vtd_freeze_show(struct perf_object *pobj, char *buf)
 
 ssize_t vtd_freeze_store(struct perf_object *pobj, const char *buf, size_t n)
 {
-	struct feature_platform_data *pdata;
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
 	struct feature_fme_ifpmon_vtd_ctl ctl;
 	struct feature_fme_iperf *iperf;
+	unsigned long flags;
 	bool state;
 
 	if (strtobool(buf, &state))
 		return -EINVAL;
 
-	pdata = dev_get_platdata(pobj->fme_dev);
-	mutex_lock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
 	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
 	ctl.csr = readq(&iperf->vtd_ctl);
 	ctl.freeze = state;
 	writeq(ctl.csr, &iperf->vtd_ctl);
-	mutex_unlock(&pdata->lock);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
 
 	return n;
 }
@@ -259,36 +324,58 @@ static struct attribute_group iommu_top_attr_group = {
 	.attrs = iommu_top_attrs,
 };
 
-static ssize_t read_iommu_sip_counter(struct perf_object *pobj,
-				      enum iperf_vtd_sip_events event,
-				      char *buf)
+int fme_iperf_read_vtd_sip(struct device *fme_dev, u8 event, u64 *counter)
 {
-	struct feature_platform_data *pdata;
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	u8 *evsel = &fme->perf_evsel[FPGA_FME_PERF_BLOCK_VTD_SIP];
 	struct feature_fme_ifpmon_vtd_sip_ctl sip_ctl;
 	struct feature_fme_ifpmon_vtd_sip_ctr sip_ctr;
 	struct feature_fme_iperf *iperf;
-	u64 counter;
 
-	pdata = dev_get_platdata(pobj->fme_dev);
-	mutex_lock(&pdata->lock);
-	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
+	iperf = get_feature_ioaddr_by_index(fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
-	sip_ctl.csr = readq(&iperf->vtd_sip_ctl);
-	sip_ctl.vtd_evtcode = event;
-	writeq(sip_ctl.csr, &iperf->vtd_sip_ctl);
-
-	sip_ctr.event_code = event;
 
-	if (fpga_wait_register_field(event_code, sip_ctr,
-				     &iperf->vtd_sip_ctr, IPERF_TIMEOUT, 1)) {
-		dev_err(pobj->fme_dev, "timeout, unmatched VTd SIP event type in counter registers\n");
-		mutex_unlock(&pdata->lock);
-		return -ETIMEDOUT;
+	/* the recorded select is only trusted if the counter agrees. */
+	sip_ctr.csr = readq(&iperf->vtd_sip_ctr);
+	if (*evsel != event || sip_ctr.event_code != event) {
+		sip_ctl.csr = readq(&iperf->vtd_sip_ctl);
+		sip_ctl.vtd_evtcode = event;
+		writeq(sip_ctl.csr, &iperf->vtd_sip_ctl);
+		*evsel = FME_PERF_EVSEL_NONE;
+
+		sip_ctr.event_code = event;
+
+		if (fpga_wait_register_field(event_code, sip_ctr,
+					     &iperf->vtd_sip_ctr,
+					     IPERF_TIMEOUT, 1)) {
+			dev_err(fme_dev, "timeout, unmatched VTd SIP event type in counter registers\n");
+			return -ETIMEDOUT;
+		}
+
+		*evsel = event;
+		sip_ctr.csr = readq(&iperf->vtd_sip_ctr);
 	}
 
-	sip_ctr.csr = readq(&iperf->vtd_sip_ctr);
-	counter = sip_ctr.vtd_counter;
-	mutex_unlock(&pdata->lock);
+	*counter = fme_perf_accumulate(&fme->acc_vtd_sip[event],
+				       sip_ctr.vtd_counter, FME_PERF_VTD_WIDTH);
+
+	return 0;
+}
+
+static ssize_t read_iommu_sip_counter(struct perf_object *pobj,
+				      enum iperf_vtd_sip_events event,
+				      char *buf)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
+	u64 counter;
+	int ret;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	ret = fme_iperf_read_vtd_sip(pobj->fme_dev, event, &counter);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+	if (ret)
+		return ret;
 
 	return scnprintf(buf, PAGE_SIZE, "0x%llx\n", counter);
 }
@@ -313,6 +400,10 @@ VTD_SIP_SHOW(slpwc_l3_miss, IPERF_VTD_SIP_SLPWC_L3_MISS);
 VTD_SIP_SHOW(slpwc_l4_miss, IPERF_VTD_SIP_SLPWC_L4_MISS);
 VTD_SIP_SHOW(rcc_miss, IPERF_VTD_SIP_RCC_MISS);
 
+METRIC_SHOW(iotlb_4k_hit_ratio, FME_PERF_IOTLB_4K_HIT_RATIO);
+METRIC_SHOW(iotlb_2m_hit_ratio, FME_PERF_IOTLB_2M_HIT_RATIO);
+METRIC_SHOW(iotlb_1g_hit_ratio, FME_PERF_IOTLB_1G_HIT_RATIO);
+
 static struct attribute *iommu_sip_attrs[] = {
 	&perf_obj_attr_iotlb_4k_hit.attr,
 	&perf_obj_attr_iotlb_2m_hit.attr,
@@ -326,6 +417,9 @@ static struct attribute *iommu_sip_attrs[] = {
 	&perf_obj_attr_slpwc_l3_miss.attr,
 	&perf_obj_attr_slpwc_l4_miss.attr,
 	&perf_obj_attr_rcc_miss.attr,
+	&perf_obj_attr_iotlb_4k_hit_ratio.attr,
+	&perf_obj_attr_iotlb_2m_hit_ratio.attr,
+	&perf_obj_attr_iotlb_1g_hit_ratio.attr,
 	NULL,
 };
 
@@ -339,36 +433,58 @@ static const struct attribute_group *iommu_top_attr_groups[] = {
 	NULL,
 };
 
-static ssize_t read_iommu_counter(struct perf_object *pobj,
-				  enum iperf_vtd_events base_event, char *buf)
+int fme_iperf_read_vtd(struct device *fme_dev, u8 event, u64 *counter)
 {
-	struct feature_platform_data *pdata;
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	u8 *evsel = &fme->perf_evsel[FPGA_FME_PERF_BLOCK_VTD];
 	struct feature_fme_ifpmon_vtd_ctl ctl;
 	struct feature_fme_ifpmon_vtd_ctr ctr;
 	struct feature_fme_iperf *iperf;
-	enum iperf_vtd_events event = base_event + pobj->id;
-	u64 counter;
 
-	pdata = dev_get_platdata(pobj->fme_dev);
-	mutex_lock(&pdata->lock);
-	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
+	iperf = get_feature_ioaddr_by_index(fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
-	ctl.csr = readq(&iperf->vtd_ctl);
-	ctl.vtd_evtcode = event;
-	writeq(ctl.csr, &iperf->vtd_ctl);
-
-	ctr.event_code = event;
 
-	if (fpga_wait_register_field(event_code, ctr,
-				     &iperf->vtd_ctr, IPERF_TIMEOUT, 1)) {
-		dev_err(pobj->fme_dev, "timeout, unmatched VTd event type in counter registers.\n");
-		mutex_unlock(&pdata->lock);
-		return -ETIMEDOUT;
+	/* the recorded select is only trusted if the counter agrees. */
+	ctr.csr = readq(&iperf->vtd_ctr);
+	if (*evsel != event || ctr.event_code != event) {
+		ctl.csr = readq(&iperf->vtd_ctl);
+		ctl.vtd_evtcode = event;
+		writeq(ctl.csr, &iperf->vtd_ctl);
+		*evsel = FME_PERF_EVSEL_NONE;
+
+		ctr.event_code = event;
+
+		if (fpga_wait_register_field(event_code, ctr,
+					     &iperf->vtd_ctr,
+					     IPERF_TIMEOUT, 1)) {
+			dev_err(fme_dev, "timeout, unmatched VTd event type in counter registers.\n");
+			return -ETIMEDOUT;
+		}
+
+		*evsel = event;
+		ctr.csr = readq(&iperf->vtd_ctr);
 	}
 
-	ctr.csr = readq(&iperf->vtd_ctr);
-	counter = ctr.vtd_counter;
-	mutex_unlock(&pdata->lock);
+	*counter = fme_perf_accumulate(&fme->acc_vtd[event], ctr.vtd_counter,
+				       FME_PERF_VTD_WIDTH);
+
+	return 0;
+}
+
+static ssize_t read_iommu_counter(struct perf_object *pobj,
+				  enum iperf_vtd_events base_event, char *buf)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	enum iperf_vtd_events event = base_event + pobj->id;
+	unsigned long flags;
+	u64 counter;
+	int ret;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	ret = fme_iperf_read_vtd(pobj->fme_dev, event, &counter);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+	if (ret)
+		return ret;
 
 	return scnprintf(buf, PAGE_SIZE, "0x%llx\n", counter);
 }
@@ -408,7 +524,7 @@ static const struct attribute_group *iommu_attr_groups[] = {
 	NULL,
 };
 
-static bool fabric_pobj_is_enabled(struct perf_object *pobj,
+static bool fabric_port_is_enabled(int port_id,
 				   struct feature_fme_iperf *iperf)
 {
 	struct feature_fme_ifpmon_fab_ctl ctl;
@@ -416,45 +532,103 @@ static bool fabric_pobj_is_enabled(struct perf_object *pobj,
 	ctl.csr = readq(&iperf->fab_ctl);
 
 	if (ctl.port_filter == FAB_DISABLE_FILTER)
-		return pobj->id == PERF_OBJ_ROOT_ID;
+		return port_id == PERF_OBJ_ROOT_ID;
 
-	return pobj->id == ctl.port_id;
+	return port_id == ctl.port_id;
 }
 
-static ssize_t read_fabric_counter(struct perf_object *pobj,
-				   enum iperf_fab_events fab_event, char *buf)
+/*
+ * Read a fabric counter for @port_id, PERF_OBJ_ROOT_ID for all ports. The
+ * counter only counts for the port selected by the port filter, -ENODATA
+ * is returned if that is another one. The total is still brought up to
+ * date then.
+ */
+int fme_iperf_read_fabric(struct device *fme_dev, int port_id, u8 event,
+			  u64 *counter)
 {
-	struct feature_platform_data *pdata = dev_get_platdata(pobj->fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	u8 *evsel = &fme->perf_evsel[FPGA_FME_PERF_BLOCK_FABRIC];
 	struct feature_fme_ifpmon_fab_ctl ctl;
 	struct feature_fme_ifpmon_fab_ctr ctr;
 	struct feature_fme_iperf *iperf;
-	u64 counter = 0;
 
-	mutex_lock(&pdata->lock);
-	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
+	iperf = get_feature_ioaddr_by_index(fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
 
-	/* if it is disabled, force the counter to return zero. */
-	if (!fabric_pobj_is_enabled(pobj, iperf))
-		goto exit;
+	/* the recorded select is only trusted if the counter agrees. */
+	ctr.csr = readq(&iperf->fab_ctr);
+	if (*evsel != event || ctr.event_code != event) {
+		ctl.csr = readq(&iperf->fab_ctl);
+		ctl.fab_evtcode = event;
+		writeq(ctl.csr, &iperf->fab_ctl);
+		*evsel = FME_PERF_EVSEL_NONE;
+
+		ctr.event_code = event;
+
+		if (fpga_wait_register_field(event_code, ctr,
+					     &iperf->fab_ctr,
+					     IPERF_TIMEOUT, 1)) {
+			dev_err(fme_dev, "timeout, unmatched VTd event type in counter registers.\n");
+			return -ETIMEDOUT;
+		}
+
+		*evsel = event;
+		ctr.csr = readq(&iperf->fab_ctr);
+	}
 
-	ctl.csr = readq(&iperf->fab_ctl);
-	ctl.fab_evtcode = fab_event;
-	writeq(ctl.csr, &iperf->fab_ctl);
+	*counter = fme_perf_accumulate(&fme->acc_fabric[event], ctr.fab_cnt,
+				       FME_PERF_FABRIC_WIDTH);
 
-	ctr.event_code = fab_event;
+	if (!fabric_port_is_enabled(port_id, iperf))
+		return -ENODATA;
 
-	if (fpga_wait_register_field(event_code, ctr,
-				     &iperf->fab_ctr, IPERF_TIMEOUT, 1)) {
-		dev_err(pobj->fme_dev, "timeout, unmatched VTd event type in counter registers.\n");
-		mutex_unlock(&pdata->lock);
-		return -ETIMEDOUT;
+	return 0;
+}
+
+/* count fabric events of @port_id only, PERF_OBJ_ROOT_ID for all ports. */
+void fme_iperf_set_fabric_port(struct device *fme_dev, int port_id)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	struct feature_fme_ifpmon_fab_ctl ctl;
+	struct feature_fme_iperf *iperf;
+	u64 old;
+
+	iperf = get_feature_ioaddr_by_index(fme_dev,
+					    FME_FEATURE_ID_GLOBAL_IPERF);
+
+	ctl.csr = old = readq(&iperf->fab_ctl);
+	if (port_id == PERF_OBJ_ROOT_ID)
+		ctl.port_filter = FAB_DISABLE_FILTER;
+	else {
+		ctl.port_filter = FAB_ENABLE_FILTER;
+		ctl.port_id = port_id;
 	}
 
-	ctr.csr = readq(&iperf->fab_ctr);
-	counter = ctr.fab_cnt;
-exit:
-	mutex_unlock(&pdata->lock);
+	if (ctl.csr != old)
+		fme->perf_fab_seq++;
+
+	writeq(ctl.csr, &iperf->fab_ctl);
+}
+
+static ssize_t read_fabric_counter(struct perf_object *pobj,
+				   enum iperf_fab_events fab_event, char *buf)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
+	u64 counter;
+	int ret;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	ret = fme_iperf_read_fabric(pobj->fme_dev, pobj->id, fab_event,
+				    &counter);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	/* if it is disabled, force the counter to return zero. */
+	if (ret == -ENODATA)
+		counter = 0;
+	else if (ret)
+		return ret;
+
 	return scnprintf(buf, PAGE_SIZE, "0x%llx\n", counter);
 }
 
@@ -474,6 +648,14 @@ FAB_SHOW(upi_write, IPERF_FAB_UPI_WR);
 FAB_SHOW(mmio_read, IPERF_FAB_MMIO_RD);
 FAB_SHOW(mmio_write, IPERF_FAB_MMIO_WR);
 
+/* bytes per second, for the port the fabric counters counted for */
+METRIC_SHOW(pcie0_read_bandwidth, FME_PERF_PCIE0_READ_BW);
+METRIC_SHOW(pcie0_write_bandwidth, FME_PERF_PCIE0_WRITE_BW);
+METRIC_SHOW(pcie1_read_bandwidth, FME_PERF_PCIE1_READ_BW);
+METRIC_SHOW(pcie1_write_bandwidth, FME_PERF_PCIE1_WRITE_BW);
+METRIC_SHOW(upi_read_bandwidth, FME_PERF_UPI_READ_BW);
+METRIC_SHOW(upi_write_bandwidth, FME_PERF_UPI_WRITE_BW);
+
 static ssize_t fab_enable_show(struct perf_object *pobj, char *buf)
 {
 	struct feature_fme_iperf *iperf;
@@ -482,7 +664,7 @@ static ssize_t fab_enable_show(struct perf_object *pobj, char *buf)
 	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
 
-	status = fabric_pobj_is_enabled(pobj, iperf);
+	status = fabric_port_is_enabled(pobj->id, iperf);
 	return scnprintf(buf, PAGE_SIZE, "%d\n", status);
 }
 
@@ -493,10 +675,10 @@ static ssize_t fab_enable_show(struct perf_object *pobj, char *buf)
 static ssize_t fab_enable_store(struct perf_object *pobj,
 				const char *buf, size_t n)
 {
-	struct feature_platform_data *pdata  = dev_get_platdata(pobj->fme_dev);
-	struct feature_fme_ifpmon_fab_ctl ctl;
-	struct feature_fme_iperf *iperf;
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
 	bool state;
+	int ret = 0;
 
 	if (strtobool(buf, &state))
 		return -EINVAL;
@@ -504,26 +686,18 @@ static ssize_t fab_enable_store(struct perf_object *pobj,
 	if (!state)
 		return -EINVAL;
 
-	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
-					    FME_FEATURE_ID_GLOBAL_IPERF);
-
-	/* if it is already enabled. */
-	if (fabric_pobj_is_enabled(pobj, iperf))
-		return n;
-
-	mutex_lock(&pdata->lock);
-	ctl.csr = readq(&iperf->fab_ctl);
-	if (pobj->id == PERF_OBJ_ROOT_ID)
-		ctl.port_filter = FAB_DISABLE_FILTER;
-	else {
-		ctl.port_filter = FAB_ENABLE_FILTER;
-		ctl.port_id = pobj->id;
-	}
-
-	writeq(ctl.csr, &iperf->fab_ctl);
-	mutex_unlock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	/*
+	 * perf fabric events are counting with the port filter they need,
+	 * or the multiplexer owns it.
+	 */
+	if (fme->perf_fab_users || fme->fab_mux)
+		ret = -EBUSY;
+	else
+		fme_iperf_set_fabric_port(pobj->fme_dev, pobj->id);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
 
-	return n;
+	return ret ? ret : n;
 }
 
 static PERF_OBJ_ATTR(fab_enable, enable, 0644, fab_enable_show,
@@ -538,6 +712,12 @@ static struct attribute *fabric_attrs[] = {
 	&perf_obj_attr_upi_write.attr,
 	&perf_obj_attr_mmio_read.attr,
 	&perf_obj_attr_mmio_write.attr,
+	&perf_obj_attr_pcie0_read_bandwidth.attr,
+	&perf_obj_attr_pcie0_write_bandwidth.attr,
+	&perf_obj_attr_pcie1_read_bandwidth.attr,
+	&perf_obj_attr_pcie1_write_bandwidth.attr,
+	&perf_obj_attr_upi_read_bandwidth.attr,
+	&perf_obj_attr_upi_write_bandwidth.attr,
 	&perf_obj_attr_fab_enable.attr,
 	NULL,
 };
@@ -565,21 +745,22 @@ static ssize_t fab_freeze_show(struct perf_object *pobj, char *buf)
 static ssize_t fab_freeze_store(struct perf_object *pobj,
 				const char *buf, size_t n)
 {
-	struct feature_platform_data *pdata = dev_get_platdata(pobj->fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
 	struct feature_fme_iperf *iperf;
 	struct feature_fme_ifpmon_fab_ctl ctl;
+	unsigned long flags;
 	bool state;
 
 	if (strtobool(buf, &state))
 		return -EINVAL;
 
-	mutex_lock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
 	iperf = get_feature_ioaddr_by_index(pobj->fme_dev,
 					    FME_FEATURE_ID_GLOBAL_IPERF);
 	ctl.csr = readq(&iperf->fab_ctl);
 	ctl.freeze = state;
 	writeq(ctl.csr, &iperf->fab_ctl);
-	mutex_unlock(&pdata->lock);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
 
 	return n;
 }
@@ -602,6 +783,168 @@ static const struct attribute_group *fabric_top_attr_groups[] = {
 	NULL,
 };
 
+#define IPERF_FREEZE_CACHE	BIT(0)
+#define IPERF_FREEZE_FABRIC	BIT(1)
+#define IPERF_FREEZE_VTD	BIT(2)
+#define IPERF_FREEZE_VTD_SIP	BIT(3)
+
+/*
+ * Set the freeze control of the counter blocks to @freeze, returns the
+ * previous freeze state. Called with fme->perf_lock held.
+ */
+static u8 iperf_freeze(struct feature_fme_iperf *iperf, u8 freeze)
+{
+	struct feature_fme_ifpmon_ch_ctl ch_ctl;
+	struct feature_fme_ifpmon_fab_ctl fab_ctl;
+	struct feature_fme_ifpmon_vtd_ctl vtd_ctl;
+	struct feature_fme_ifpmon_vtd_sip_ctl sip_ctl;
+	u8 old = 0;
+
+	ch_ctl.csr = readq(&iperf->ch_ctl);
+	if (ch_ctl.freeze)
+		old |= IPERF_FREEZE_CACHE;
+	ch_ctl.freeze = !!(freeze & IPERF_FREEZE_CACHE);
+	writeq(ch_ctl.csr, &iperf->ch_ctl);
+
+	fab_ctl.csr = readq(&iperf->fab_ctl);
+	if (fab_ctl.freeze)
+		old |= IPERF_FREEZE_FABRIC;
+	fab_ctl.freeze = !!(freeze & IPERF_FREEZE_FABRIC);
+	writeq(fab_ctl.csr, &iperf->fab_ctl);
+
+	vtd_ctl.csr = readq(&iperf->vtd_ctl);
+	if (vtd_ctl.freeze)
+		old |= IPERF_FREEZE_VTD;
+	vtd_ctl.freeze = !!(freeze & IPERF_FREEZE_VTD);
+	writeq(vtd_ctl.csr, &iperf->vtd_ctl);
+
+	sip_ctl.csr = readq(&iperf->vtd_sip_ctl);
+	if (sip_ctl.freeze)
+		old |= IPERF_FREEZE_VTD_SIP;
+	sip_ctl.freeze = !!(freeze & IPERF_FREEZE_VTD_SIP);
+	writeq(sip_ctl.csr, &iperf->vtd_sip_ctl);
+
+	return old;
+}
+
+/*
+ * Read every counter once with all counter blocks frozen. perf_lock is
+ * only held per counter, the freeze keeps the values consistent, and
+ * pdata->lock serializes snapshots so their freeze/restore don't nest.
+ */
+static int fme_iperf_snapshot(struct platform_device *pdev,
+			      struct fpga_fme_perf_snapshot *snap)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+	struct feature_fme_capability fme_capability;
+	struct feature_fme_ifpmon_fab_ctl fab_ctl;
+	struct feature_fme_header *fme_hdr;
+	struct feature_fme_iperf *iperf;
+	struct device *dev = &pdev->dev;
+	unsigned long flags;
+	int i, ret = 0;
+	u8 frozen;
+
+	fme_hdr = get_feature_ioaddr_by_index(dev, FME_FEATURE_ID_HEADER);
+	fme_capability.csr = readq(&fme_hdr->capability);
+	iperf = get_feature_ioaddr_by_index(dev, FME_FEATURE_ID_GLOBAL_IPERF);
+
+	snap->valid = FPGA_FME_PERF_SNAPSHOT_CACHE |
+		      FPGA_FME_PERF_SNAPSHOT_FABRIC;
+	if (fme_capability.iommu_support)
+		snap->valid |= FPGA_FME_PERF_SNAPSHOT_VTD;
+
+	mutex_lock(&pdata->lock);
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	frozen = iperf_freeze(iperf, IPERF_FREEZE_CACHE | IPERF_FREEZE_FABRIC |
+				     IPERF_FREEZE_VTD | IPERF_FREEZE_VTD_SIP);
+	snap->clock = readq(&iperf->clk);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	for (i = 0; !ret && i <= IPERF_CACHE_EVICTIONS; i++) {
+		if (i == IPERF_CACHE_RSVD)
+			continue;
+
+		spin_lock_irqsave(&fme->perf_lock, flags);
+		ret = fme_iperf_read_cache(dev, fme_iperf_cache_channel(i), i,
+					   &snap->cache[i]);
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+	}
+
+	/* one lock hold, so perf can't move the port filter meanwhile */
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	fab_ctl.csr = readq(&iperf->fab_ctl);
+	snap->fab_port = fab_ctl.port_filter == FAB_ENABLE_FILTER ?
+			 fab_ctl.port_id : -1;
+	for (i = 0; !ret && i <= IPERF_FAB_MMIO_WR; i++)
+		ret = fme_iperf_read_fabric(dev, snap->fab_port < 0 ?
+					    PERF_OBJ_ROOT_ID : snap->fab_port,
+					    i, &snap->fabric[i]);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	if (!(snap->valid & FPGA_FME_PERF_SNAPSHOT_VTD))
+		goto unfreeze;
+
+	for (i = 0; !ret && i <= IPERF_VTD_DEVTLB_1G_FILL; i++) {
+		spin_lock_irqsave(&fme->perf_lock, flags);
+		ret = fme_iperf_read_vtd(dev, i, &snap->vtd[i]);
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+	}
+
+	for (i = 0; !ret && i <= IPERF_VTD_SIP_RCC_MISS; i++) {
+		spin_lock_irqsave(&fme->perf_lock, flags);
+		ret = fme_iperf_read_vtd_sip(dev, i, &snap->vtd_sip[i]);
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+	}
+
+unfreeze:
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	iperf_freeze(iperf, frozen);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
+long fme_perf_snapshot_ioctl(struct platform_device *pdev, unsigned long arg,
+			     int (*snapshot)(struct platform_device *pdev,
+					struct fpga_fme_perf_snapshot *snap))
+{
+	struct fpga_fme_perf_snapshot *snap;
+	unsigned long minsz;
+	long ret;
+
+	minsz = offsetofend(struct fpga_fme_perf_snapshot, vtd_sip);
+
+	snap = kzalloc(minsz, GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	if (copy_from_user(snap, (void __user *)arg,
+			   offsetofend(struct fpga_fme_perf_snapshot, flags))) {
+		ret = -EFAULT;
+		goto free_exit;
+	}
+
+	if (snap->argsz < minsz || snap->flags) {
+		ret = -EINVAL;
+		goto free_exit;
+	}
+
+	snap->version = FPGA_FME_PERF_SNAPSHOT_VERSION;
+	ret = snapshot(pdev, snap);
+	if (ret)
+		goto free_exit;
+
+	if (copy_to_user((void __user *)arg, snap, minsz))
+		ret = -EFAULT;
+
+free_exit:
+	kfree(snap);
+	return ret;
+}
+
 static struct perf_object *
 create_perf_obj(struct device *fme_dev, struct kobject *parent, int id,
 		const struct attribute_group **groups, const char *name)
@@ -717,7 +1060,7 @@ static int create_perf_fabric_obj(struct perf_object *perf_dev)
 		list_add(&obj->node, &pobj->children);
 	}
 
-	return 0;
+	return fme_fab_mux_create_objs(pobj, create_perf_obj);
 }
 
 static struct perf_object *create_perf_dev(struct platform_device *pdev)
@@ -763,9 +1106,28 @@ fme_iperf_uinit(struct platform_device *pdev, struct feature *feature)
 	fme = fpga_pdata_get_private(pdata);
 	destroy_perf_obj(fme->iperf_dev);
 	fme->iperf_dev = NULL;
+	fme_fab_mux_uinit(pdev);
+}
+
+static long fme_iperf_ioctl(struct platform_device *pdev,
+			    struct feature *feature, unsigned int cmd,
+			    unsigned long arg)
+{
+	long ret;
+
+	switch (cmd) {
+	case FPGA_FME_PERF_SNAPSHOT:
+		ret = fme_perf_snapshot_ioctl(pdev, arg, fme_iperf_snapshot);
+		break;
+	default:
+		ret = -ENODEV;
+	}
+
+	return ret;
 }
 
 struct feature_ops global_iperf_ops = {
 	.init = fme_iperf_init,
 	.uinit = fme_iperf_uinit,
+	.ioctl = fme_iperf_ioctl,
 };
@@ -907,6 +907,7 @@ static int fme_ioctl_config_port(struct feature_platform_data *pdata,
 	struct platform_device *fme_pdev = pdata->dev;
 	struct feature_fme_header *fme_hdr;
 	struct feature_fme_capability capability;
+	int ret;
 
 	if (flags)
 		return -EINVAL;
@@ -918,7 +919,17 @@ static int fme_ioctl_config_port(struct feature_platform_data *pdata,
 	if (port_id >= capability.num_ports)
 		return -EINVAL;
 
-	return pdata->config_port(fme_pdev, port_id, is_release);
+	ret = pdata->config_port(fme_pdev, port_id, is_release);
+	if (ret)
+		return ret;
+
+	/* a released port runs a job out of sight, e.g. in a VM */
+	if (is_release)
+		fme_port_usage_release(fme_pdev, port_id);
+	else
+		fme_port_usage_assign(fme_pdev, port_id);
+
+	return 0;
 }
 
 static long fme_ioctl_release_port(struct feature_platform_data *pdata,
@@ -985,6 +996,8 @@ static int fme_release(struct inode *inode, struct file *filp)
 	struct platform_device *pdev = pdata->dev;
 
 	dev_dbg(&pdev->dev, "Device File Release\n");
+	fme_sampler_release(pdev, filp);
+
 	mutex_lock(&pdata->lock);
 	__feature_dev_use_end(pdata);
 
@@ -1017,6 +1030,10 @@ static long fme_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return fme_ioctl_release_port(pdata, (void __user *)arg);
 	case FPGA_FME_PORT_ASSIGN:
 		return fme_ioctl_assign_port(pdata, (void __user *)arg);
+	case FPGA_FME_PERF_SAMPLER_START:
+		return fme_sampler_start(pdev, filp, (void __user *)arg);
+	case FPGA_FME_PERF_SAMPLER_STOP:
+		return fme_sampler_stop(pdev, filp);
 	default:
 		/*
 		 * Let sub-feature's ioctl function to handle the cmd
@@ -1038,11 +1055,30 @@ static long fme_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return -EINVAL;
 }
 
+static unsigned int fme_poll(struct file *filp, poll_table *wait)
+{
+	struct feature_platform_data *pdata = filp->private_data;
+
+	if (!is_feature_present(&pdata->dev->dev, FME_FEATURE_ID_PR_MGMT))
+		return 0;
+
+	return fme_pr_poll(pdata, filp, wait);
+}
+
+static int fme_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct feature_platform_data *pdata = filp->private_data;
+
+	return fme_sampler_mmap(pdata->dev, vma);
+}
+
 static const struct file_operations fme_fops = {
 	.owner		= THIS_MODULE,
 	.open		= fme_open,
 	.release	= fme_release,
 	.unlocked_ioctl = fme_ioctl,
+	.poll		= fme_poll,
+	.mmap		= fme_mmap,
 };
 
 static int fme_dev_init(struct platform_device *pdev)
@@ -1055,6 +1091,8 @@ static int fme_dev_init(struct platform_device *pdev)
 		return -ENOMEM;
 
 	fme->pdata = pdata;
+	spin_lock_init(&fme->perf_lock);
+	memset(fme->perf_evsel, FME_PERF_EVSEL_NONE, sizeof(fme->perf_evsel));
 
 	mutex_lock(&pdata->lock);
 	fpga_pdata_set_private(pdata, fme);
@@ -1083,6 +1121,8 @@ static int fme_probe(struct platform_device *pdev)
 	if (ret)
 		goto exit;
 
+	fme_perf_metrics_init(pdev);
+
 	ret = fpga_dev_feature_init(pdev, fme_feature_drvs);
 	if (ret)
 		goto dev_destroy;
@@ -1091,9 +1131,20 @@ static int fme_probe(struct platform_device *pdev)
 	if (ret)
 		goto feature_uinit;
 
+	fme_perf_accum_init(pdev);
+
+	ret = fme_pmu_init(pdev);
+	if (ret)
+		goto accum_uinit;
+
+	fme_port_usage_init(pdev);
 	return 0;
 
+accum_uinit:
+	fme_perf_accum_uinit(pdev);
+	fpga_unregister_dev_ops(pdev);
 feature_uinit:
+	fme_perf_metrics_uinit(pdev);
 	fpga_dev_feature_uinit(pdev);
 dev_destroy:
 	fme_dev_destroy(pdev);
@@ -1103,6 +1154,11 @@ exit:
 
 static int fme_remove(struct platform_device *pdev)
 {
+	fme_port_usage_uinit(pdev);
+	fme_sampler_uinit(pdev);
+	fme_pmu_uinit(pdev);
+	fme_perf_accum_uinit(pdev);
+	fme_perf_metrics_uinit(pdev);
 	fpga_dev_feature_uinit(pdev);
 	fpga_unregister_dev_ops(pdev);
 	fme_dev_destroy(pdev);
@@ -1117,7 +1173,29 @@ static struct platform_driver fme_driver = {
 	.remove  = fme_remove,
 };
 
-module_platform_driver(fme_driver);
+static int __init fme_init(void)
+{
+	int ret;
+
+	ret = fme_pmu_hotplug_init();
+	if (ret)
+		return ret;
+
+	ret = platform_driver_register(&fme_driver);
+	if (ret)
+		fme_pmu_hotplug_uinit();
+
+	return ret;
+}
+
+static void __exit fme_exit(void)
+{
+	platform_driver_unregister(&fme_driver);
+	fme_pmu_hotplug_uinit();
+}
+
+module_init(fme_init);
+module_exit(fme_exit);
 
 MODULE_DESCRIPTION("FPGA Management Engine driver");
 MODULE_AUTHOR("Intel Corporation");
@@ -0,0 +1,257 @@
+/*
+ * Driver for FPGA Global Performance Derived Metrics
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/intel-fpga.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+/*
+ * The metrics are computed over the last period, between the last two
+ * windows. The windows are taken by a work every period, not by the
+ * readers, so the interval doesn't depend on who read last. The work
+ * starts with the first read and stops once the metrics are not read for
+ * METRICS_IDLE_PERIODS.
+ */
+#define METRICS_PERIOD		HZ
+#define METRICS_IDLE_PERIODS	10
+
+/* the fabric counters count cache lines */
+#define METRICS_FAB_LINE_SIZE	64
+
+#define METRIC_BW(_event)						\
+	{ .block = FPGA_FME_PERF_BLOCK_FABRIC, .event = _event }
+#define METRIC_RATIO(_block, _hit, _miss)				\
+	{ .block = _block, .event = _hit, .miss = _miss, .ratio = true }
+
+static const struct {
+	u8 block;
+	u8 event;	/* the event counting the cache lines or hits */
+	u8 miss;	/* the event counting the misses, for a ratio */
+	bool ratio;
+} fme_perf_metrics[FME_PERF_METRIC_MAX] = {
+	[FME_PERF_CACHE_READ_HIT_RATIO] = METRIC_RATIO(
+		FPGA_FME_PERF_BLOCK_CACHE, IPERF_CACHE_RD_HIT,
+		IPERF_CACHE_RD_MISS),
+	[FME_PERF_CACHE_WRITE_HIT_RATIO] = METRIC_RATIO(
+		FPGA_FME_PERF_BLOCK_CACHE, IPERF_CACHE_WR_HIT,
+		IPERF_CACHE_WR_MISS),
+	[FME_PERF_PCIE0_READ_BW] = METRIC_BW(IPERF_FAB_PCIE0_RD),
+	[FME_PERF_PCIE0_WRITE_BW] = METRIC_BW(IPERF_FAB_PCIE0_WR),
+	[FME_PERF_PCIE1_READ_BW] = METRIC_BW(IPERF_FAB_PCIE1_RD),
+	[FME_PERF_PCIE1_WRITE_BW] = METRIC_BW(IPERF_FAB_PCIE1_WR),
+	[FME_PERF_UPI_READ_BW] = METRIC_BW(IPERF_FAB_UPI_RD),
+	[FME_PERF_UPI_WRITE_BW] = METRIC_BW(IPERF_FAB_UPI_WR),
+	[FME_PERF_IOTLB_4K_HIT_RATIO] = METRIC_RATIO(
+		FPGA_FME_PERF_BLOCK_VTD_SIP, IPERF_VTD_SIP_IOTLB_4K_HIT,
+		IPERF_VTD_SIP_IOTLB_4K_MISS),
+	[FME_PERF_IOTLB_2M_HIT_RATIO] = METRIC_RATIO(
+		FPGA_FME_PERF_BLOCK_VTD_SIP, IPERF_VTD_SIP_IOTLB_2M_HIT,
+		IPERF_VTD_SIP_IOTLB_2M_MISS),
+	[FME_PERF_IOTLB_1G_HIT_RATIO] = METRIC_RATIO(
+		FPGA_FME_PERF_BLOCK_VTD_SIP, IPERF_VTD_SIP_IOTLB_1G_HIT,
+		IPERF_VTD_SIP_IOTLB_1G_MISS),
+};
+
+/* the counters of a window, indexed by block and event */
+static u64 *fme_perf_window_counters(struct fme_perf_window *w, u8 block)
+{
+	switch (block) {
+	case FPGA_FME_PERF_BLOCK_CACHE:
+		return w->cache;
+	case FPGA_FME_PERF_BLOCK_FABRIC:
+		return w->fabric;
+	}
+
+	return w->vtd_sip;
+}
+
+/* fme->perf_lock held. */
+static void fme_perf_window_read_event(struct device *fme_dev, u8 block,
+				       u8 event, u64 *counters)
+{
+	u64 config = FPGA_FME_PERF_CONFIG(block, event);
+
+	/* a fabric counter of another port is still read, see -ENODATA. */
+	if (fme_perf_config_valid(fme_dev, config))
+		fme_perf_read_config(fme_dev, config, &counters[event]);
+}
+
+/*
+ * Read the counters of all metrics into @w. perf_lock is held per block,
+ * the fabric one is read together with the port filter it counted for.
+ */
+static void fme_perf_window_read(struct device *fme_dev,
+				 struct fme_perf_window *w)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	unsigned long flags;
+	u64 *counters;
+	int i, block;
+
+	w->time_ns = ktime_get_ns();
+
+	for (block = FPGA_FME_PERF_BLOCK_CACHE;
+	     block <= FPGA_FME_PERF_BLOCK_VTD_SIP; block++) {
+		counters = fme_perf_window_counters(w, block);
+
+		spin_lock_irqsave(&fme->perf_lock, flags);
+		if (block == FPGA_FME_PERF_BLOCK_FABRIC)
+			w->fab_port = fme_perf_get_fabric_port(fme_dev);
+
+		for (i = 0; i < FME_PERF_METRIC_MAX; i++) {
+			if (fme_perf_metrics[i].block != block)
+				continue;
+
+			fme_perf_window_read_event(fme_dev, block,
+						   fme_perf_metrics[i].event,
+						   counters);
+			if (fme_perf_metrics[i].ratio)
+				fme_perf_window_read_event(fme_dev, block,
+						fme_perf_metrics[i].miss,
+						counters);
+		}
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+	}
+}
+
+/* @value * @mult / @div, losing low bits rather than overflowing */
+static u64 fme_perf_scale(u64 value, u64 mult, u64 div)
+{
+	while (value > div64_u64(U64_MAX, mult)) {
+		value >>= 1;
+		div >>= 1;
+	}
+
+	return div ? div64_u64(value * mult, div) : 0;
+}
+
+static void fme_perf_metrics_work(struct work_struct *work)
+{
+	struct fpga_fme *fme = container_of(to_delayed_work(work),
+					    struct fpga_fme, metrics_work);
+	struct feature_platform_data *pdata = fme->pdata;
+	bool idle;
+
+	mutex_lock(&pdata->lock);
+	idle = time_after(jiffies, fme->metrics_read +
+			  METRICS_IDLE_PERIODS * METRICS_PERIOD);
+	if (idle || fme->metrics_dying) {
+		memset(fme->metrics, 0, sizeof(fme->metrics));
+		fme->metrics_on = false;
+	} else {
+		fme->metrics[0] = fme->metrics[1];
+		fme_perf_window_read(&pdata->dev->dev, &fme->metrics[1]);
+		schedule_delayed_work(&fme->metrics_work, METRICS_PERIOD);
+	}
+	mutex_unlock(&pdata->lock);
+}
+
+/*
+ * The bandwidth of @event from the rates of the multiplexer, false if it
+ * is off. The root object gets the sum over the ports.
+ */
+static bool fme_perf_metric_mux_bw(struct perf_object *pobj, u8 event,
+				   u64 *value)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	unsigned long flags;
+	bool running;
+	u64 rate;
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	running = fme_fab_mux_read_rate(fme, pobj->id, event, &rate);
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	if (running)
+		*value = rate * METRICS_FAB_LINE_SIZE;
+	return running;
+}
+
+ssize_t fme_perf_metric_show(struct perf_object *pobj, int metric, char *buf)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(pobj->fme_dev);
+	struct fpga_fme *fme = fme_perf_get_fme(pobj->fme_dev);
+	u8 block = fme_perf_metrics[metric].block;
+	u8 event = fme_perf_metrics[metric].event;
+	u8 miss = fme_perf_metrics[metric].miss;
+	struct fme_perf_window *prev, *cur;
+	u64 value = 0, delta, *c, *p;
+
+	/* the filter moves all the time, the windows can't tell. */
+	if (!fme_perf_metrics[metric].ratio &&
+	    fme_perf_metric_mux_bw(pobj, event, &value))
+		goto print;
+
+	mutex_lock(&pdata->lock);
+	fme->metrics_read = jiffies;
+	prev = &fme->metrics[0];
+	cur = &fme->metrics[1];
+
+	if (!fme->metrics_on && !fme->metrics_dying) {
+		fme_perf_window_read(pobj->fme_dev, cur);
+		fme->metrics_on = true;
+		schedule_delayed_work(&fme->metrics_work, METRICS_PERIOD);
+	}
+
+	/* nothing to compute before the first period ended. */
+	if (!prev->time_ns)
+		goto unlock;
+
+	c = fme_perf_window_counters(cur, block);
+	p = fme_perf_window_counters(prev, block);
+	delta = c[event] - p[event];
+
+	if (fme_perf_metrics[metric].ratio) {
+		/* in hundredths of a percent */
+		value = fme_perf_scale(delta, 10000,
+				       delta + c[miss] - p[miss]);
+	} else if (prev->fab_port == pobj->id && cur->fab_port == pobj->id) {
+		/* the filter stayed on this object during the interval */
+		value = fme_perf_scale(delta * METRICS_FAB_LINE_SIZE,
+				       NSEC_PER_SEC,
+				       cur->time_ns - prev->time_ns);
+	}
+
+unlock:
+	mutex_unlock(&pdata->lock);
+
+print:
+	if (fme_perf_metrics[metric].ratio)
+		return scnprintf(buf, PAGE_SIZE, "%llu.%02llu\n",
+				 value / 100, value % 100);
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", value);
+}
+
+void fme_perf_metrics_init(struct platform_device *pdev)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+
+	INIT_DELAYED_WORK(&fme->metrics_work, fme_perf_metrics_work);
+}
+
+void fme_perf_metrics_uinit(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+
+	/* no read restarts the work once it is cancelled. */
+	mutex_lock(&pdata->lock);
+	fme->metrics_dying = true;
+	mutex_unlock(&pdata->lock);
+
+	cancel_delayed_work_sync(&fme->metrics_work);
+}
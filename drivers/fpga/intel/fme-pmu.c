@@ -0,0 +1,681 @@
+/*
+ * Driver for FPGA Global Performance Counters in perf
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/perf_event.h>
+#include <linux/workqueue.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+/*
+ * The FME counters are free running, the event selected in the control
+ * register of a counter block is only what its counter register shows. So
+ * all events of a block count at the same time and perf reads them one by
+ * one, reprogramming the event select under fme->perf_lock. The fabric
+ * port filter is the exception: it is global to the block, so fabric
+ * events asking for another filter than the one in use can't be added
+ * and perf multiplexes them in turn.
+ */
+struct fme_pmu {
+	struct pmu pmu;
+	struct device *fme_dev;
+	struct fpga_fme *fme;
+	/* the cpu perf counts on, moved away when it goes offline */
+	int cpu;
+	struct hlist_node node;
+	char name[32];
+};
+
+#define to_fme_pmu(_pmu)	container_of(_pmu, struct fme_pmu, pmu)
+
+/* whether the FME has the counter of @config, see FPGA_FME_PERF_CONFIG */
+bool fme_perf_config_valid(struct device *fme_dev, u64 config)
+{
+	struct feature_fme_capability fme_capability;
+	struct feature_fme_header *fme_hdr;
+	u8 event = FME_PERF_EVENT(config);
+	bool iperf, vtd;
+
+	if (config & ~FME_PERF_CONFIG_MASK)
+		return false;
+
+	iperf = is_feature_present(fme_dev, FME_FEATURE_ID_GLOBAL_IPERF);
+	if (iperf) {
+		fme_hdr = get_feature_ioaddr_by_index(fme_dev,
+						      FME_FEATURE_ID_HEADER);
+		fme_capability.csr = readq(&fme_hdr->capability);
+		vtd = fme_capability.iommu_support;
+	} else {
+		vtd = false;
+	}
+
+	switch (FME_PERF_BLOCK(config)) {
+	case FPGA_FME_PERF_BLOCK_CACHE:
+		return iperf && event != IPERF_CACHE_RSVD &&
+		       event <= IPERF_CACHE_EVICTIONS;
+	case FPGA_FME_PERF_BLOCK_FABRIC:
+		if (iperf)
+			return event <= IPERF_FAB_MMIO_WR;
+		return is_feature_present(fme_dev,
+					  FME_FEATURE_ID_GLOBAL_DPERF) &&
+		       (event <= DPERF_FAB_PCIE0_WR ||
+			event == DPERF_FAB_MMIO_RD ||
+			event == DPERF_FAB_MMIO_WR);
+	case FPGA_FME_PERF_BLOCK_VTD:
+		return vtd && event <= IPERF_VTD_DEVTLB_1G_FILL;
+	case FPGA_FME_PERF_BLOCK_VTD_SIP:
+		return vtd && event <= IPERF_VTD_SIP_RCC_MISS;
+	}
+
+	return false;
+}
+
+/* read the counter of a valid @config, fme->perf_lock held. */
+int fme_perf_read_config(struct device *fme_dev, u64 config, u64 *counter)
+{
+	u8 event = FME_PERF_EVENT(config);
+	int port_id;
+
+	switch (FME_PERF_BLOCK(config)) {
+	case FPGA_FME_PERF_BLOCK_CACHE:
+		return fme_iperf_read_cache(fme_dev,
+					    fme_iperf_cache_channel(event),
+					    event, counter);
+	case FPGA_FME_PERF_BLOCK_FABRIC:
+		port_id = FME_PERF_FILTER(config) ? FME_PERF_PORTID(config) :
+						    PERF_OBJ_ROOT_ID;
+		if (is_feature_present(fme_dev, FME_FEATURE_ID_GLOBAL_IPERF))
+			return fme_iperf_read_fabric(fme_dev, port_id, event,
+						     counter);
+		return fme_dperf_read_fabric(fme_dev, port_id, event, counter);
+	case FPGA_FME_PERF_BLOCK_VTD:
+		return fme_iperf_read_vtd(fme_dev, event, counter);
+	case FPGA_FME_PERF_BLOCK_VTD_SIP:
+		return fme_iperf_read_vtd_sip(fme_dev, event, counter);
+	}
+
+	return -EINVAL;
+}
+
+/* set the fabric port filter of the iperf or dperf feature */
+void fme_perf_set_fabric_port(struct device *fme_dev, int port_id)
+{
+	if (is_feature_present(fme_dev, FME_FEATURE_ID_GLOBAL_IPERF))
+		fme_iperf_set_fabric_port(fme_dev, port_id);
+	else
+		fme_dperf_set_fabric_port(fme_dev, port_id);
+}
+
+/* the port the fabric counters count for, PERF_OBJ_ROOT_ID for all */
+int fme_perf_get_fabric_port(struct device *fme_dev)
+{
+	struct feature_fme_ifpmon_fab_ctl ictl;
+	struct feature_fme_dfpmon_fab_ctl dctl;
+	struct feature_fme_iperf *iperf;
+	struct feature_fme_dperf *dperf;
+
+	if (is_feature_present(fme_dev, FME_FEATURE_ID_GLOBAL_IPERF)) {
+		iperf = get_feature_ioaddr_by_index(fme_dev,
+						FME_FEATURE_ID_GLOBAL_IPERF);
+		ictl.csr = readq(&iperf->fab_ctl);
+		return ictl.port_filter == FAB_ENABLE_FILTER ?
+		       ictl.port_id : PERF_OBJ_ROOT_ID;
+	}
+
+	dperf = get_feature_ioaddr_by_index(fme_dev,
+					    FME_FEATURE_ID_GLOBAL_DPERF);
+	dctl.csr = readq(&dperf->fab_ctl);
+	return dctl.port_filter == DCP_FAB_ENABLE_FILTER ?
+	       dctl.port_id : PERF_OBJ_ROOT_ID;
+}
+
+/* the FPGA clock counter of the iperf or dperf feature */
+u64 fme_perf_read_clock(struct device *fme_dev)
+{
+	struct feature_fme_iperf *iperf;
+	struct feature_fme_dperf *dperf;
+
+	if (is_feature_present(fme_dev, FME_FEATURE_ID_GLOBAL_IPERF)) {
+		iperf = get_feature_ioaddr_by_index(fme_dev,
+						FME_FEATURE_ID_GLOBAL_IPERF);
+		return readq(&iperf->clk);
+	}
+
+	dperf = get_feature_ioaddr_by_index(fme_dev,
+					    FME_FEATURE_ID_GLOBAL_DPERF);
+	return readq(&dperf->clk);
+}
+
+/*
+ * The narrowest counters are 48 bits wide, even counting at 1 GHz they
+ * wrap after more than three days. Polling every ten minutes keeps the
+ * 64-bit totals exact with a wide margin, at a negligible cost, and lets
+ * fme_perf_accumulate() tell a counter reset from a wrap.
+ */
+#define FME_PERF_ACCUM_POLL	(600 * HZ)
+
+/* read every counter, which folds it into its 64-bit total */
+static void fme_perf_accum_poll(struct work_struct *work)
+{
+	struct fpga_fme *fme = container_of(to_delayed_work(work),
+					    struct fpga_fme, acc_poll);
+	struct device *fme_dev = &fme->pdata->dev->dev;
+	unsigned long flags;
+	u64 config, counter;
+	int block, event;
+
+	for (block = FPGA_FME_PERF_BLOCK_CACHE;
+	     block <= FPGA_FME_PERF_BLOCK_VTD_SIP; block++) {
+		for (event = 0; event < FME_PERF_EVENTS; event++) {
+			config = FPGA_FME_PERF_CONFIG(block, event);
+			if (!fme_perf_config_valid(fme_dev, config))
+				continue;
+
+			spin_lock_irqsave(&fme->perf_lock, flags);
+			fme_perf_read_config(fme_dev, config, &counter);
+			spin_unlock_irqrestore(&fme->perf_lock, flags);
+		}
+	}
+
+	schedule_delayed_work(&fme->acc_poll, FME_PERF_ACCUM_POLL);
+}
+
+void fme_perf_accum_init(struct platform_device *pdev)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+
+	INIT_DELAYED_WORK(&fme->acc_poll, fme_perf_accum_poll);
+
+	if (is_feature_present(&pdev->dev, FME_FEATURE_ID_GLOBAL_IPERF) ||
+	    is_feature_present(&pdev->dev, FME_FEATURE_ID_GLOBAL_DPERF))
+		schedule_delayed_work(&fme->acc_poll, FME_PERF_ACCUM_POLL);
+}
+
+void fme_perf_accum_uinit(struct platform_device *pdev)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+
+	cancel_delayed_work_sync(&fme->acc_poll);
+}
+
+static ssize_t cpumask_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct pmu *pmu = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", to_fme_pmu(pmu)->cpu);
+}
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *fme_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static struct attribute_group fme_pmu_cpumask_group = {
+	.attrs = fme_pmu_cpumask_attrs,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-3");
+PMU_FORMAT_ATTR(block, "config:4-7");
+PMU_FORMAT_ATTR(portid, "config:8-9");
+PMU_FORMAT_ATTR(port_filter, "config:10");
+
+static struct attribute *fme_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	&format_attr_block.attr,
+	&format_attr_portid.attr,
+	&format_attr_port_filter.attr,
+	NULL,
+};
+
+static struct attribute_group fme_pmu_format_group = {
+	.name = "format",
+	.attrs = fme_pmu_format_attrs,
+};
+
+static ssize_t fme_pmu_event_show(struct device *dev,
+				  struct device_attribute *attr, char *page)
+{
+	struct perf_pmu_events_attr *pattr;
+
+	pattr = container_of(attr, struct perf_pmu_events_attr, attr);
+
+	return scnprintf(page, PAGE_SIZE, "block=%u,event=0x%x\n",
+			 (unsigned int)FME_PERF_BLOCK(pattr->id),
+			 FME_PERF_EVENT(pattr->id));
+}
+
+#define FME_PMU_EVENT_ATTR(_name, _block, _event)			\
+	PMU_EVENT_ATTR(_name, event_attr_##_name,			\
+		       FPGA_FME_PERF_CONFIG(_block, _event), fme_pmu_event_show)
+
+FME_PMU_EVENT_ATTR(cache_read_hit, 0, 0x0);
+FME_PMU_EVENT_ATTR(cache_write_hit, 0, 0x1);
+FME_PMU_EVENT_ATTR(cache_read_miss, 0, 0x2);
+FME_PMU_EVENT_ATTR(cache_write_miss, 0, 0x3);
+FME_PMU_EVENT_ATTR(cache_hold_request, 0, 0x5);
+FME_PMU_EVENT_ATTR(cache_data_write_port_contention, 0, 0x6);
+FME_PMU_EVENT_ATTR(cache_tag_write_port_contention, 0, 0x7);
+FME_PMU_EVENT_ATTR(cache_tx_req_stall, 0, 0x8);
+FME_PMU_EVENT_ATTR(cache_rx_req_stall, 0, 0x9);
+FME_PMU_EVENT_ATTR(cache_rx_eviction, 0, 0xa);
+FME_PMU_EVENT_ATTR(fab_pcie0_read, 1, 0x0);
+FME_PMU_EVENT_ATTR(fab_pcie0_write, 1, 0x1);
+FME_PMU_EVENT_ATTR(fab_pcie1_read, 1, 0x2);
+FME_PMU_EVENT_ATTR(fab_pcie1_write, 1, 0x3);
+FME_PMU_EVENT_ATTR(fab_upi_read, 1, 0x4);
+FME_PMU_EVENT_ATTR(fab_upi_write, 1, 0x5);
+FME_PMU_EVENT_ATTR(fab_mmio_read, 1, 0x6);
+FME_PMU_EVENT_ATTR(fab_mmio_write, 1, 0x7);
+FME_PMU_EVENT_ATTR(vtd_read_transaction, 2, 0x0);
+FME_PMU_EVENT_ATTR(vtd_write_transaction, 2, 0x1);
+FME_PMU_EVENT_ATTR(vtd_devtlb_read_hit, 2, 0x2);
+FME_PMU_EVENT_ATTR(vtd_devtlb_write_hit, 2, 0x3);
+FME_PMU_EVENT_ATTR(vtd_devtlb_4k_fill, 2, 0x4);
+FME_PMU_EVENT_ATTR(vtd_devtlb_2m_fill, 2, 0x5);
+FME_PMU_EVENT_ATTR(vtd_devtlb_1g_fill, 2, 0x6);
+FME_PMU_EVENT_ATTR(vtd_iotlb_4k_hit, 3, 0x0);
+FME_PMU_EVENT_ATTR(vtd_iotlb_2m_hit, 3, 0x1);
+FME_PMU_EVENT_ATTR(vtd_iotlb_1g_hit, 3, 0x2);
+FME_PMU_EVENT_ATTR(vtd_slpwc_l3_hit, 3, 0x3);
+FME_PMU_EVENT_ATTR(vtd_slpwc_l4_hit, 3, 0x4);
+FME_PMU_EVENT_ATTR(vtd_rcc_hit, 3, 0x5);
+FME_PMU_EVENT_ATTR(vtd_iotlb_4k_miss, 3, 0x6);
+FME_PMU_EVENT_ATTR(vtd_iotlb_2m_miss, 3, 0x7);
+FME_PMU_EVENT_ATTR(vtd_iotlb_1g_miss, 3, 0x8);
+FME_PMU_EVENT_ATTR(vtd_slpwc_l3_miss, 3, 0x9);
+FME_PMU_EVENT_ATTR(vtd_slpwc_l4_miss, 3, 0xa);
+FME_PMU_EVENT_ATTR(vtd_rcc_miss, 3, 0xb);
+
+static struct attribute *fme_pmu_event_attrs[] = {
+	&event_attr_cache_read_hit.attr.attr,
+	&event_attr_cache_write_hit.attr.attr,
+	&event_attr_cache_read_miss.attr.attr,
+	&event_attr_cache_write_miss.attr.attr,
+	&event_attr_cache_hold_request.attr.attr,
+	&event_attr_cache_data_write_port_contention.attr.attr,
+	&event_attr_cache_tag_write_port_contention.attr.attr,
+	&event_attr_cache_tx_req_stall.attr.attr,
+	&event_attr_cache_rx_req_stall.attr.attr,
+	&event_attr_cache_rx_eviction.attr.attr,
+	&event_attr_fab_pcie0_read.attr.attr,
+	&event_attr_fab_pcie0_write.attr.attr,
+	&event_attr_fab_pcie1_read.attr.attr,
+	&event_attr_fab_pcie1_write.attr.attr,
+	&event_attr_fab_upi_read.attr.attr,
+	&event_attr_fab_upi_write.attr.attr,
+	&event_attr_fab_mmio_read.attr.attr,
+	&event_attr_fab_mmio_write.attr.attr,
+	&event_attr_vtd_read_transaction.attr.attr,
+	&event_attr_vtd_write_transaction.attr.attr,
+	&event_attr_vtd_devtlb_read_hit.attr.attr,
+	&event_attr_vtd_devtlb_write_hit.attr.attr,
+	&event_attr_vtd_devtlb_4k_fill.attr.attr,
+	&event_attr_vtd_devtlb_2m_fill.attr.attr,
+	&event_attr_vtd_devtlb_1g_fill.attr.attr,
+	&event_attr_vtd_iotlb_4k_hit.attr.attr,
+	&event_attr_vtd_iotlb_2m_hit.attr.attr,
+	&event_attr_vtd_iotlb_1g_hit.attr.attr,
+	&event_attr_vtd_slpwc_l3_hit.attr.attr,
+	&event_attr_vtd_slpwc_l4_hit.attr.attr,
+	&event_attr_vtd_rcc_hit.attr.attr,
+	&event_attr_vtd_iotlb_4k_miss.attr.attr,
+	&event_attr_vtd_iotlb_2m_miss.attr.attr,
+	&event_attr_vtd_iotlb_1g_miss.attr.attr,
+	&event_attr_vtd_slpwc_l3_miss.attr.attr,
+	&event_attr_vtd_slpwc_l4_miss.attr.attr,
+	&event_attr_vtd_rcc_miss.attr.attr,
+	NULL,
+};
+
+/* hide the events the counter features of this FME don't have */
+static umode_t fme_pmu_event_is_visible(struct kobject *kobj,
+					struct attribute *attr, int n)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct fme_pmu *fpmu = to_fme_pmu(dev_get_drvdata(dev));
+	struct perf_pmu_events_attr *pattr;
+
+	pattr = container_of(attr, struct perf_pmu_events_attr, attr.attr);
+
+	return fme_perf_config_valid(fpmu->fme_dev, pattr->id) ? attr->mode : 0;
+}
+
+static struct attribute_group fme_pmu_events_group = {
+	.name = "events",
+	.attrs = fme_pmu_event_attrs,
+	.is_visible = fme_pmu_event_is_visible,
+};
+
+static const struct attribute_group *fme_pmu_attr_groups[] = {
+	&fme_pmu_format_group,
+	&fme_pmu_events_group,
+	&fme_pmu_cpumask_group,
+	NULL,
+};
+
+static bool fme_pmu_is_fabric(struct perf_event *event)
+{
+	return FME_PERF_BLOCK(event->attr.config) == FPGA_FME_PERF_BLOCK_FABRIC;
+}
+
+/* the port a fabric event counts, PERF_OBJ_ROOT_ID for all ports */
+static int fme_pmu_fabric_port(struct perf_event *event)
+{
+	u64 config = event->attr.config;
+
+	return FME_PERF_FILTER(config) ? FME_PERF_PORTID(config) :
+					 PERF_OBJ_ROOT_ID;
+}
+
+/* whether @a and @b can count at the same time */
+static bool fme_pmu_compatible(struct perf_event *a, struct perf_event *b)
+{
+	if (a->pmu != b->pmu || !fme_pmu_is_fabric(a) || !fme_pmu_is_fabric(b))
+		return true;
+
+	return fme_pmu_fabric_port(a) == fme_pmu_fabric_port(b);
+}
+
+static int fme_pmu_event_init(struct perf_event *event)
+{
+	struct fme_pmu *fpmu = to_fme_pmu(event->pmu);
+	struct perf_event *leader = event->group_leader;
+	struct perf_event *sibling;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	/* counting only, the counters don't interrupt */
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
+		return -EOPNOTSUPP;
+
+	if (event->cpu < 0)
+		return -EINVAL;
+
+	if (!fme_perf_config_valid(fpmu->fme_dev, event->attr.config))
+		return -EINVAL;
+
+	/* a group must be able to count at once */
+	if (!fme_pmu_compatible(leader, event))
+		return -EINVAL;
+
+	for_each_sibling_event(sibling, leader)
+		if (!fme_pmu_compatible(sibling, event))
+			return -EINVAL;
+
+	event->cpu = fpmu->cpu;
+	return 0;
+}
+
+static void fme_pmu_event_update(struct perf_event *event)
+{
+	struct fme_pmu *fpmu = to_fme_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	unsigned long flags;
+	u64 prev, now;
+	int ret;
+
+	spin_lock_irqsave(&fpmu->fme->perf_lock, flags);
+	ret = fme_perf_read_config(fpmu->fme_dev, event->attr.config, &now);
+	spin_unlock_irqrestore(&fpmu->fme->perf_lock, flags);
+	if (ret)
+		return;
+
+	prev = local64_xchg(&hwc->prev_count, now);
+	local64_add(now - prev, &event->count);
+}
+
+static void fme_pmu_event_start(struct perf_event *event, int flags)
+{
+	struct fme_pmu *fpmu = to_fme_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	unsigned long lock_flags;
+	u64 now;
+	int ret;
+
+	spin_lock_irqsave(&fpmu->fme->perf_lock, lock_flags);
+	ret = fme_perf_read_config(fpmu->fme_dev, event->attr.config, &now);
+	spin_unlock_irqrestore(&fpmu->fme->perf_lock, lock_flags);
+
+	/* without a start value nothing can be counted, stay stopped. */
+	if (ret) {
+		hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+		return;
+	}
+
+	local64_set(&hwc->prev_count, now);
+	hwc->state = 0;
+}
+
+static void fme_pmu_event_stop(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (hwc->state & PERF_HES_STOPPED)
+		return;
+
+	fme_pmu_event_update(event);
+	hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int fme_pmu_event_add(struct perf_event *event, int flags)
+{
+	struct fme_pmu *fpmu = to_fme_pmu(event->pmu);
+	struct fpga_fme *fme = fpmu->fme;
+	unsigned long lock_flags;
+	int port, ret = 0;
+
+	if (fme_pmu_is_fabric(event)) {
+		port = fme_pmu_fabric_port(event);
+
+		spin_lock_irqsave(&fme->perf_lock, lock_flags);
+		if (!fme->perf_fab_users && !fme->fab_mux) {
+			fme_perf_set_fabric_port(fpmu->fme_dev, port);
+			fme->perf_fab_port = port;
+		}
+
+		/*
+		 * another filter is in use, let perf rotate the events. The
+		 * multiplexer moves the filter, nothing can count meanwhile.
+		 */
+		if (fme->fab_mux || fme->perf_fab_port != port)
+			ret = -EAGAIN;
+		else
+			fme->perf_fab_users++;
+		spin_unlock_irqrestore(&fme->perf_lock, lock_flags);
+
+		if (ret)
+			return ret;
+	}
+
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+
+	if (flags & PERF_EF_START)
+		fme_pmu_event_start(event, PERF_EF_RELOAD);
+
+	return 0;
+}
+
+static void fme_pmu_event_del(struct perf_event *event, int flags)
+{
+	struct fme_pmu *fpmu = to_fme_pmu(event->pmu);
+	struct fpga_fme *fme = fpmu->fme;
+	unsigned long lock_flags;
+
+	fme_pmu_event_stop(event, PERF_EF_UPDATE);
+
+	if (fme_pmu_is_fabric(event)) {
+		spin_lock_irqsave(&fme->perf_lock, lock_flags);
+		fme->perf_fab_users--;
+		spin_unlock_irqrestore(&fme->perf_lock, lock_flags);
+	}
+}
+
+static void fme_pmu_event_read(struct perf_event *event)
+{
+	fme_pmu_event_update(event);
+}
+
+/*
+ * The counters are global to the device, perf counts on one cpu, the
+ * first one of the device node. The events move to another cpu of the
+ * node, or any other cpu if none, when it goes offline.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#include <linux/cpuhotplug.h>
+
+static enum cpuhp_state fme_pmu_cpuhp_state;
+
+static int fme_pmu_offline_cpu(unsigned int cpu, struct hlist_node *node)
+{
+	struct fme_pmu *fpmu = hlist_entry_safe(node, struct fme_pmu, node);
+	int nid = dev_to_node(fpmu->fme_dev);
+	unsigned int target;
+
+	if (cpu != fpmu->cpu)
+		return 0;
+
+	/* the cpu going offline is still in cpu_online_mask. */
+	target = nr_cpu_ids;
+	if (nid != NUMA_NO_NODE)
+		for_each_cpu_and(target, cpumask_of_node(nid), cpu_online_mask)
+			if (target != cpu)
+				break;
+	if (target >= nr_cpu_ids)
+		target = cpumask_any_but(cpu_online_mask, cpu);
+	if (target >= nr_cpu_ids)
+		return 0;
+
+	perf_pmu_migrate_context(&fpmu->pmu, cpu, target);
+	fpmu->cpu = target;
+	return 0;
+}
+
+int fme_pmu_hotplug_init(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN,
+				      "fpga/intel_fpga_fme:online", NULL,
+				      fme_pmu_offline_cpu);
+	if (ret < 0)
+		return ret;
+
+	fme_pmu_cpuhp_state = ret;
+	return 0;
+}
+
+void fme_pmu_hotplug_uinit(void)
+{
+	cpuhp_remove_multi_state(fme_pmu_cpuhp_state);
+}
+
+static int fme_pmu_hotplug_add(struct fme_pmu *fpmu)
+{
+	return cpuhp_state_add_instance_nocalls(fme_pmu_cpuhp_state,
+						&fpmu->node);
+}
+
+static void fme_pmu_hotplug_remove(struct fme_pmu *fpmu)
+{
+	cpuhp_state_remove_instance_nocalls(fme_pmu_cpuhp_state, &fpmu->node);
+}
+#else
+/* no cpu hotplug states, the events stay on their cpu. */
+int fme_pmu_hotplug_init(void)
+{
+	return 0;
+}
+
+void fme_pmu_hotplug_uinit(void)
+{
+}
+
+static int fme_pmu_hotplug_add(struct fme_pmu *fpmu)
+{
+	return 0;
+}
+
+static void fme_pmu_hotplug_remove(struct fme_pmu *fpmu)
+{
+}
+#endif /* LINUX_VERSION_CODE */
+
+int fme_pmu_init(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme = fpga_pdata_get_private(pdata);
+	struct fme_pmu *fpmu;
+	int ret;
+
+	if (!is_feature_present(&pdev->dev, FME_FEATURE_ID_GLOBAL_IPERF) &&
+	    !is_feature_present(&pdev->dev, FME_FEATURE_ID_GLOBAL_DPERF))
+		return 0;
+
+	fpmu = kzalloc(sizeof(*fpmu), GFP_KERNEL);
+	if (!fpmu)
+		return -ENOMEM;
+
+	fpmu->fme_dev = &pdev->dev;
+	fpmu->fme = fme;
+	fpmu->cpu = cpumask_local_spread(0, dev_to_node(&pdev->dev));
+	fpmu->pmu = (struct pmu) {
+		.module		= THIS_MODULE,
+		.task_ctx_nr	= perf_invalid_context,
+		.attr_groups	= fme_pmu_attr_groups,
+		.event_init	= fme_pmu_event_init,
+		.add		= fme_pmu_event_add,
+		.del		= fme_pmu_event_del,
+		.start		= fme_pmu_event_start,
+		.stop		= fme_pmu_event_stop,
+		.read		= fme_pmu_event_read,
+	};
+
+	snprintf(fpmu->name, sizeof(fpmu->name), "intel_fpga_fme%d", pdev->id);
+
+	ret = fme_pmu_hotplug_add(fpmu);
+	if (ret)
+		goto free_exit;
+
+	ret = perf_pmu_register(&fpmu->pmu, fpmu->name, -1);
+	if (ret)
+		goto hotplug_remove;
+
+	fme->pmu = fpmu;
+	return 0;
+
+hotplug_remove:
+	fme_pmu_hotplug_remove(fpmu);
+free_exit:
+	kfree(fpmu);
+	return ret;
+}
+
+void fme_pmu_uinit(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme = fpga_pdata_get_private(pdata);
+	struct fme_pmu *fpmu = fme->pmu;
+
+	if (!fpmu)
+		return;
+
+	fme->pmu = NULL;
+	fme_pmu_hotplug_remove(fpmu);
+	perf_pmu_unregister(&fpmu->pmu);
+	kfree(fpmu);
+}
@@ -0,0 +1,384 @@
+/*
+ * Driver for FPGA Partial Reconfiguration Bitstream Cache
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include <linux/uaccess.h>
+#include <crypto/hash.h>
+#include <linux/stddef.h> /* offsetofend */
+#include <linux/vfio.h> /* offsetofend in pre-4.1.0 kernels */
+#include <linux/intel-fpga.h>
+#include <linux/fpga/fpga-mgr_mod.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+/* bounds of the bitstream cache of one FME */
+#define PR_CACHE_MAX_IMAGES	16
+#define PR_CACHE_MAX_SIZE	(256 << 20)
+
+/*
+ * A cached bitstream lives in kernel pages, ready to be handed over to
+ * fpga_mgr_buf_load_sg() as a scatterlist, so a PR from the cache
+ * doesn't touch userspace at all.
+ */
+struct fme_pr_image {
+	struct list_head node;
+	struct kref kref;
+	u8 id[FPGA_FME_PR_CACHE_ID_SIZE];
+	struct fme_pr_gbs gbs;	/* the GBS header is stripped */
+	size_t size;
+	struct page **pages;
+	int npages;
+	struct sg_table sgt;
+};
+
+struct fme_pr_cache {
+	/* protect the LRU list and the accounting below */
+	struct mutex lock;
+	struct list_head lru;	/* most recently used first */
+	int nr_images;
+	size_t size;
+	struct crypto_shash *tfm;
+};
+
+static void fme_pr_image_release(struct kref *kref)
+{
+	struct fme_pr_image *img = container_of(kref, struct fme_pr_image,
+						kref);
+
+	sg_free_table(&img->sgt);
+	while (img->npages > 0)
+		__free_page(img->pages[--img->npages]);
+	kfree(img->pages);
+	kfree(img);
+}
+
+static void fme_pr_image_put(struct fme_pr_image *img)
+{
+	kref_put(&img->kref, fme_pr_image_release);
+}
+
+static int fme_pr_image_hash(struct fme_pr_cache *cache,
+			     struct fme_pr_image *img)
+{
+	SHASH_DESC_ON_STACK(desc, cache->tfm);
+	size_t offset;
+	int i, ret;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->tfm = cache->tfm;
+
+	ret = crypto_shash_init(desc);
+	for (i = 0, offset = 0; !ret && i < img->npages; i++) {
+		ret = crypto_shash_update(desc, page_address(img->pages[i]),
+				min_t(size_t, img->size - offset, PAGE_SIZE));
+		offset += PAGE_SIZE;
+	}
+
+	if (!ret)
+		ret = crypto_shash_final(desc, img->id);
+
+	return ret;
+}
+
+/* copy the bitstream at @addr into a new image and compute its ID. */
+static struct fme_pr_image *
+fme_pr_image_create(struct fme_pr_cache *cache, u64 addr, size_t size)
+{
+	void __user *uaddr = (void __user *)(unsigned long)addr;
+	struct fme_pr_image *img;
+	int npages, ret;
+	size_t offset;
+
+	img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (!img)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&img->kref);
+	INIT_LIST_HEAD(&img->node);
+	img->size = size;
+
+	npages = DIV_ROUND_UP(size, PAGE_SIZE);
+	img->pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+	if (!img->pages) {
+		kfree(img);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (offset = 0; img->npages < npages; offset += PAGE_SIZE) {
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (!page) {
+			ret = -ENOMEM;
+			goto put_exit;
+		}
+
+		img->pages[img->npages++] = page;
+
+		if (copy_from_user(page_address(page), uaddr + offset,
+				   min_t(size_t, size - offset, PAGE_SIZE))) {
+			ret = -EFAULT;
+			goto put_exit;
+		}
+	}
+
+	ret = sg_alloc_table_from_pages(&img->sgt, img->pages, npages, 0,
+					size, GFP_KERNEL);
+	if (ret)
+		goto put_exit;
+
+	ret = fme_pr_image_hash(cache, img);
+	if (ret)
+		goto put_exit;
+
+	return img;
+
+put_exit:
+	fme_pr_image_put(img);
+	return ERR_PTR(ret);
+}
+
+/* look up an image and mark it most recently used, cache lock held. */
+static struct fme_pr_image *
+fme_pr_cache_find(struct fme_pr_cache *cache, const u8 *id)
+{
+	struct fme_pr_image *img;
+
+	list_for_each_entry(img, &cache->lru, node) {
+		if (!memcmp(img->id, id, FPGA_FME_PR_CACHE_ID_SIZE)) {
+			list_move(&img->node, &cache->lru);
+			return img;
+		}
+	}
+
+	return NULL;
+}
+
+static void fme_pr_cache_evict(struct fme_pr_cache *cache,
+			       struct fme_pr_image *img)
+{
+	list_del(&img->node);
+	cache->nr_images--;
+	cache->size -= img->size;
+
+	/* a PR in progress may still hold a reference. */
+	fme_pr_image_put(img);
+}
+
+/* evict least recently used images until the cache is within bounds. */
+static void fme_pr_cache_shrink(struct fme_pr_cache *cache)
+{
+	struct fme_pr_image *img;
+
+	while (cache->nr_images > PR_CACHE_MAX_IMAGES ||
+	       cache->size > PR_CACHE_MAX_SIZE) {
+		img = list_last_entry(&cache->lru, struct fme_pr_image, node);
+		/* never evict the most recently used image. */
+		if (img->node.prev == &cache->lru)
+			break;
+
+		fme_pr_cache_evict(cache, img);
+	}
+}
+
+int fme_pr_cache_add(struct platform_device *pdev, unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme_pr_cache_add cache_add;
+	struct fme_pr_image *img, *cached;
+	struct fme_pr_cache *cache;
+	struct fme_pr_gbs gbs;
+	struct fpga_fme *fme;
+	unsigned long minsz;
+	int ret;
+
+	minsz = offsetofend(struct fpga_fme_pr_cache_add, id);
+
+	if (copy_from_user(&cache_add, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (cache_add.argsz < minsz || cache_add.flags ||
+	    !cache_add.buffer_size)
+		return -EINVAL;
+
+	if (cache_add.buffer_size > PR_CACHE_MAX_SIZE)
+		return -EFBIG;
+
+	ret = fme_pr_gbs_parse_user(cache_add.buffer_address,
+				    cache_add.buffer_size, &gbs);
+	if (ret)
+		return ret;
+
+	if (!gbs.size)
+		return -EINVAL;
+
+	/* the cache is freed with the FME, pin it while in use. */
+	fme = fme_pr_get(pdata);
+	if (!fme)
+		return -EINVAL;
+
+	cache = fme->pr_cache;
+	if (!cache) {
+		ret = -EOPNOTSUPP;
+		goto put_fme;
+	}
+
+	img = fme_pr_image_create(cache, cache_add.buffer_address + gbs.offset,
+				  gbs.size);
+	if (IS_ERR(img)) {
+		ret = PTR_ERR(img);
+		goto put_fme;
+	}
+
+	img->gbs = gbs;
+	img->gbs.offset = 0;
+
+	memcpy(cache_add.id, img->id, FPGA_FME_PR_CACHE_ID_SIZE);
+
+	mutex_lock(&cache->lock);
+	cached = fme_pr_cache_find(cache, img->id);
+	if (!cached) {
+		list_add(&img->node, &cache->lru);
+		cache->nr_images++;
+		cache->size += img->size;
+		fme_pr_cache_shrink(cache);
+		img = NULL;
+	}
+	mutex_unlock(&cache->lock);
+
+	/* the same bitstream is cached already, drop the copy. */
+	if (img)
+		fme_pr_image_put(img);
+
+	if (copy_to_user((void __user *)arg, &cache_add, minsz))
+		ret = -EFAULT;
+put_fme:
+	fme_pr_put(pdata, fme);
+	return ret;
+}
+
+static int fme_pr_image_load(struct fpga_manager *mgr,
+			     struct fpga_image_info *info, void *priv)
+{
+	struct fme_pr_image *img = priv;
+
+	return fpga_mgr_buf_load_sg(mgr, info, &img->sgt);
+}
+
+int fme_pr_cache_program(struct platform_device *pdev, unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme_port_pr_cached port_pr;
+	struct fme_pr_image *img;
+	struct fme_pr_cache *cache;
+	struct fpga_fme *fme;
+	unsigned long minsz;
+	int ret;
+
+	minsz = offsetofend(struct fpga_fme_port_pr_cached, status);
+
+	if (copy_from_user(&port_pr, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (port_pr.argsz < minsz || port_pr.flags)
+		return -EINVAL;
+
+	ret = fme_pr_check_port(pdev, port_pr.port_id);
+	if (ret)
+		return ret;
+
+	/* fme device has been unregistered. */
+	fme = fme_pr_get(pdata);
+	if (!fme)
+		return -EINVAL;
+
+	cache = fme->pr_cache;
+	if (!cache) {
+		ret = -EOPNOTSUPP;
+		goto put_fme;
+	}
+
+	mutex_lock(&cache->lock);
+	img = fme_pr_cache_find(cache, port_pr.id);
+	if (img)
+		kref_get(&img->kref);
+	mutex_unlock(&cache->lock);
+
+	if (!img) {
+		ret = -ENOENT;
+		goto put_fme;
+	}
+
+	ret = fme_pr_program(pdev, fme, port_pr.port_id, &img->gbs,
+			     fme_pr_image_load, img, &port_pr.status);
+	fme_pr_image_put(img);
+	fme_pr_put(pdata, fme);
+
+	if (copy_to_user((void __user *)arg, &port_pr, minsz))
+		return -EFAULT;
+	return ret;
+
+put_fme:
+	fme_pr_put(pdata, fme);
+	return ret;
+}
+
+int fme_pr_cache_init(struct fpga_fme *fme)
+{
+	struct device *dev = &fme->pdata->dev->dev;
+	struct fme_pr_cache *cache;
+	struct crypto_shash *tfm;
+
+	tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(tfm)) {
+		/* PR still works without the cache. */
+		dev_dbg(dev, "no sha256, bitstream cache disabled\n");
+		return 0;
+	}
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		crypto_free_shash(tfm);
+		return -ENOMEM;
+	}
+
+	mutex_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->tfm = tfm;
+	fme->pr_cache = cache;
+
+	return 0;
+}
+
+/* the PRs pinning the FME are done, see fme_pr_get(). */
+void fme_pr_cache_uinit(struct fpga_fme *fme)
+{
+	struct fme_pr_cache *cache = fme->pr_cache;
+	struct fme_pr_image *img, *tmp;
+
+	if (!cache)
+		return;
+
+	fme->pr_cache = NULL;
+
+	list_for_each_entry_safe(img, tmp, &cache->lru, node)
+		fme_pr_cache_evict(cache, img);
+
+	crypto_free_shash(cache->tfm);
+	kfree(cache);
+}
@@ -0,0 +1,470 @@
+/*
+ * Driver for FPGA Partial Reconfiguration Bitstream Decompression
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/scatterlist.h>
+#include <linux/intel-fpga.h>
+#include <asm/unaligned.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+#if IS_ENABLED(CONFIG_ZSTD_DECOMPRESS) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+#define PR_HAVE_ZSTD
+#include <linux/zstd.h>
+#endif
+
+#if IS_ENABLED(CONFIG_LZ4_DECOMPRESS) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define PR_HAVE_LZ4
+#include <linux/lz4.h>
+#endif
+
+/* decompressed bitstream is handed over to the push loop in chunks */
+#define PR_DECOMP_CHUNK		(1 << 20)
+
+/*
+ * largest zstd window accepted, it decides the workspace size. zstd uses
+ * up to 8MB windows below its ultra levels.
+ */
+#define PR_ZSTD_WINDOW_MAX	(1 << 23)
+
+#define LZ4_FRAME_MAGIC		0x184D2204
+#define LZ4_FLG_VERSION_MASK	0xc0
+#define LZ4_FLG_VERSION		0x40
+#define LZ4_FLG_BLOCK_INDEP	0x20
+#define LZ4_FLG_BLOCK_CSUM	0x10
+#define LZ4_FLG_CONTENT_SIZE	0x08
+#define LZ4_FLG_DICT_ID		0x01
+#define LZ4_BLOCK_UNCOMPRESSED	0x80000000
+
+/*
+ * The compressed image is pulled chunk by chunk from the input stream and
+ * decompressed into a buffer of a few chunks, which is handed over to
+ * fpga_mgr_stream_load() as a scatterlist. The full decompressed image is
+ * never held in memory.
+ */
+struct fme_pr_decomp {
+	int (*decompress)(struct fme_pr_decomp *d);
+
+	/* compressed input */
+	int (*next)(void *priv, struct sg_table **sgt);
+	void *priv;
+	struct sg_mapping_iter miter;
+	bool miter_active;
+	bool in_eof;
+	const u8 *src;
+	size_t src_len;
+
+	/* decompressed output */
+	u8 *out;
+	size_t out_size;
+	struct page **out_pages;
+	size_t out_start;	/* first byte not handed over yet */
+	size_t out_len;		/* bytes decompressed into out */
+	struct sg_table sgt;
+	bool sgt_valid;
+	bool done;		/* end of the compressed frame */
+
+#ifdef PR_HAVE_ZSTD
+	void *zstd_wksp;
+	ZSTD_DStream *zds;
+#endif
+	/* LZ4 frame */
+	u8 *block;
+	size_t block_max;
+	bool block_csum;
+};
+
+/* make the next piece of compressed input available, none at the end. */
+static int fme_pr_decomp_fill(struct fme_pr_decomp *d)
+{
+	struct sg_table *sgt;
+	int ret;
+
+	while (!d->src_len) {
+		if (d->miter_active) {
+			if (sg_miter_next(&d->miter)) {
+				d->src = d->miter.addr;
+				d->src_len = d->miter.length;
+				continue;
+			}
+
+			sg_miter_stop(&d->miter);
+			d->miter_active = false;
+		}
+
+		if (d->in_eof)
+			return 0;
+
+		ret = d->next(d->priv, &sgt);
+		if (ret)
+			return ret;
+
+		if (!sgt) {
+			d->in_eof = true;
+			return 0;
+		}
+
+		sg_miter_start(&d->miter, sgt->sgl, sgt->nents,
+			       SG_MITER_FROM_SG);
+		d->miter_active = true;
+	}
+
+	return 0;
+}
+
+/* read exactly @len bytes of compressed input */
+static int fme_pr_decomp_read(struct fme_pr_decomp *d, void *buf, size_t len)
+{
+	size_t n;
+	int ret;
+
+	while (len) {
+		ret = fme_pr_decomp_fill(d);
+		if (ret)
+			return ret;
+
+		/* truncated image */
+		if (!d->src_len)
+			return -EINVAL;
+
+		n = min(len, d->src_len);
+		memcpy(buf, d->src, n);
+		d->src += n;
+		d->src_len -= n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+#ifdef PR_HAVE_ZSTD
+static int fme_pr_zstd_decompress(struct fme_pr_decomp *d)
+{
+	ZSTD_outBuffer out = { d->out, d->out_size, 0 };
+	ZSTD_inBuffer in;
+	size_t ret;
+	int err;
+
+	while (out.pos < out.size && !d->done) {
+		err = fme_pr_decomp_fill(d);
+		if (err)
+			return err;
+
+		/* truncated frame */
+		if (!d->src_len)
+			return -EINVAL;
+
+		in.src = d->src;
+		in.size = d->src_len;
+		in.pos = 0;
+
+		ret = ZSTD_decompressStream(d->zds, &out, &in);
+		if (ZSTD_isError(ret))
+			return -EINVAL;
+
+		d->src += in.pos;
+		d->src_len -= in.pos;
+
+		/* the frame is fully decoded and flushed */
+		if (!ret)
+			d->done = true;
+	}
+
+	d->out_len = out.pos;
+	return 0;
+}
+
+static int fme_pr_zstd_init(struct fme_pr_decomp *d)
+{
+	size_t window, wksp_size;
+	ZSTD_frameParams params;
+	int ret;
+
+	ret = fme_pr_decomp_fill(d);
+	if (ret)
+		return ret;
+
+	/*
+	 * size the workspace by the frame window, a frame which doesn't
+	 * declare it in a header at hand is rejected.
+	 */
+	if (ZSTD_getFrameParams(&params, d->src, d->src_len) ||
+	    !params.windowSize || params.windowSize > PR_ZSTD_WINDOW_MAX)
+		return -EINVAL;
+	window = params.windowSize;
+
+	wksp_size = ZSTD_DStreamWorkspaceBound(window);
+	d->zstd_wksp = vmalloc(wksp_size);
+	if (!d->zstd_wksp)
+		return -ENOMEM;
+
+	d->zds = ZSTD_initDStream(window, d->zstd_wksp, wksp_size);
+	if (!d->zds)
+		return -EINVAL;
+
+	d->out_size = PR_DECOMP_CHUNK;
+	d->decompress = fme_pr_zstd_decompress;
+	return 0;
+}
+#else
+static int fme_pr_zstd_init(struct fme_pr_decomp *d)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+#ifdef PR_HAVE_LZ4
+/* decompress whole blocks as long as one more fits into the buffer */
+static int fme_pr_lz4_decompress(struct fme_pr_decomp *d)
+{
+	size_t pos = 0;
+	u32 size, len;
+	__le32 val;
+	int ret;
+
+	while (!d->done && d->out_size - pos >= d->block_max) {
+		ret = fme_pr_decomp_read(d, &val, sizeof(val));
+		if (ret)
+			return ret;
+
+		size = le32_to_cpu(val);
+		/* end mark, the content checksum is not checked */
+		if (!size) {
+			d->done = true;
+			break;
+		}
+
+		len = size & ~LZ4_BLOCK_UNCOMPRESSED;
+		if (len > d->block_max)
+			return -EINVAL;
+
+		if (size & LZ4_BLOCK_UNCOMPRESSED) {
+			ret = fme_pr_decomp_read(d, d->out + pos, len);
+			if (ret)
+				return ret;
+		} else {
+			ret = fme_pr_decomp_read(d, d->block, len);
+			if (ret)
+				return ret;
+
+			ret = LZ4_decompress_safe((const char *)d->block,
+						  (char *)d->out + pos, len,
+						  d->block_max);
+			if (ret < 0)
+				return -EINVAL;
+			len = ret;
+		}
+		pos += len;
+
+		/* block checksum is not checked either */
+		if (d->block_csum) {
+			ret = fme_pr_decomp_read(d, &val, sizeof(val));
+			if (ret)
+				return ret;
+		}
+	}
+
+	d->out_len = pos;
+	return 0;
+}
+
+static int fme_pr_lz4_init(struct fme_pr_decomp *d)
+{
+	u8 hdr[6], skip[9];
+	int ret, bsize;
+
+	/* magic, FLG and BD */
+	ret = fme_pr_decomp_read(d, hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+
+	if (get_unaligned_le32(hdr) != LZ4_FRAME_MAGIC ||
+	    (hdr[4] & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION)
+		return -EINVAL;
+
+	/* only independent blocks without dictionary are supported */
+	if (!(hdr[4] & LZ4_FLG_BLOCK_INDEP) || (hdr[4] & LZ4_FLG_DICT_ID))
+		return -EOPNOTSUPP;
+
+	bsize = (hdr[5] >> 4) & 0x7;
+	if (bsize < 4)
+		return -EINVAL;
+
+	/* optional content size and the header checksum */
+	ret = fme_pr_decomp_read(d, skip,
+				 hdr[4] & LZ4_FLG_CONTENT_SIZE ? 9 : 1);
+	if (ret)
+		return ret;
+
+	/* 64KB, 256KB, 1MB or 4MB */
+	d->block_max = 1 << (8 + 2 * bsize);
+	d->block_csum = hdr[4] & LZ4_FLG_BLOCK_CSUM;
+	d->block = vmalloc(d->block_max);
+	if (!d->block)
+		return -ENOMEM;
+
+	d->out_size = max_t(size_t, PR_DECOMP_CHUNK, d->block_max);
+	d->decompress = fme_pr_lz4_decompress;
+	return 0;
+}
+#else
+static int fme_pr_lz4_init(struct fme_pr_decomp *d)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* decompress the next output chunk once the current one is handed over */
+static int fme_pr_decomp_produce(struct fme_pr_decomp *d)
+{
+	if (d->out_start < d->out_len || d->done)
+		return 0;
+
+	d->out_start = 0;
+	d->out_len = 0;
+	return d->decompress(d);
+}
+
+/* fpga_mgr_stream_load() callback, hands over the decompressed data. */
+int fme_pr_decomp_next(void *priv, struct sg_table **sgt)
+{
+	struct fme_pr_decomp *d = priv;
+	size_t first, last, len;
+	int ret;
+
+	if (d->sgt_valid) {
+		sg_free_table(&d->sgt);
+		d->sgt_valid = false;
+	}
+
+	ret = fme_pr_decomp_produce(d);
+	if (ret)
+		return ret;
+
+	len = d->out_len - d->out_start;
+	if (!len) {
+		*sgt = NULL;
+		return 0;
+	}
+
+	first = d->out_start >> PAGE_SHIFT;
+	last = (d->out_len - 1) >> PAGE_SHIFT;
+	ret = sg_alloc_table_from_pages(&d->sgt, d->out_pages + first,
+					last - first + 1,
+					offset_in_page(d->out_start), len,
+					GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	d->sgt_valid = true;
+	d->out_start = d->out_len;
+	*sgt = &d->sgt;
+	return 0;
+}
+
+/*
+ * Decompress the head of the image without handing it over, so the GBS
+ * header can be checked before PR starts.
+ */
+int fme_pr_decomp_peek(struct fme_pr_decomp *d, const void **buf,
+		       size_t *len)
+{
+	int ret;
+
+	ret = fme_pr_decomp_produce(d);
+	if (ret)
+		return ret;
+
+	*buf = d->out + d->out_start;
+	*len = d->out_len - d->out_start;
+	return 0;
+}
+
+/* drop @len bytes of the peeked data, e.g. the GBS header */
+void fme_pr_decomp_skip(struct fme_pr_decomp *d, size_t len)
+{
+	d->out_start += min(len, d->out_len - d->out_start);
+}
+
+void fme_pr_decomp_destroy(struct fme_pr_decomp *d)
+{
+	if (d->miter_active)
+		sg_miter_stop(&d->miter);
+	if (d->sgt_valid)
+		sg_free_table(&d->sgt);
+
+#ifdef PR_HAVE_ZSTD
+	vfree(d->zstd_wksp);
+#endif
+	vfree(d->block);
+	kfree(d->out_pages);
+	vfree(d->out);
+	kfree(d);
+}
+
+/*
+ * Create a decompressor of @format (FPGA_FME_PR_COMPRESS_*) for the image
+ * which @next returns chunk by chunk.
+ */
+struct fme_pr_decomp *
+fme_pr_decomp_create(u32 format, int (*next)(void *priv, struct sg_table **sgt),
+		     void *priv)
+{
+	struct fme_pr_decomp *d;
+	int i, npages, ret;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return ERR_PTR(-ENOMEM);
+
+	d->next = next;
+	d->priv = priv;
+
+	switch (format) {
+	case FPGA_FME_PR_COMPRESS_ZSTD:
+		ret = fme_pr_zstd_init(d);
+		break;
+	case FPGA_FME_PR_COMPRESS_LZ4:
+		ret = fme_pr_lz4_init(d);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	if (ret)
+		goto destroy_exit;
+
+	d->out = vmalloc(d->out_size);
+	npages = DIV_ROUND_UP(d->out_size, PAGE_SIZE);
+	d->out_pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+	if (!d->out || !d->out_pages) {
+		ret = -ENOMEM;
+		goto destroy_exit;
+	}
+
+	for (i = 0; i < npages; i++)
+		d->out_pages[i] = vmalloc_to_page(d->out + i * PAGE_SIZE);
+
+	return d;
+
+destroy_exit:
+	fme_pr_decomp_destroy(d);
+	return ERR_PTR(ret);
+}
@@ -21,37 +21,100 @@
 #include <linux/types.h>
 #include <linux/device.h>
 #include <linux/delay.h>
-#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/firmware.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/mmu_context.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>
 #include <linux/uaccess.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
 #include <linux/stddef.h> /* offsetofend */
 #include <linux/vfio.h> /* offsetofend in pre-4.1.0 kernels */
 #include <linux/intel-fpga.h>
 #include <linux/fpga/fpga-mgr_mod.h>
+#include <asm/unaligned.h>
 #include "backport.h"
 
 #include "feature-dev.h"
 #include "fme.h"
 
+#define CREATE_TRACE_POINTS
+#include "fme-pr-trace.h"
+
 #define PR_WAIT_TIMEOUT		8000000
 
+/*
+ * While waiting for PR credits, poll busily for PR_CREDIT_SPIN_NS first,
+ * then sleep between polls.
+ */
+#define PR_CREDIT_SPIN_NS	(20 * NSEC_PER_USEC)
+#define PR_CREDIT_SLEEP_MIN	10	/* us */
+#define PR_CREDIT_SLEEP_MAX	20	/* us */
+
+/* bitstream is pinned and pushed in chunks of this size */
+#define PR_CHUNK_SIZE		(1 << 20)
+
 #define PR_HOST_STATUS_IDLE	0
 
+/*
+ * A GBS file starts with the GBS GUID and the length of the JSON metadata
+ * which follows, the raw bitstream comes after the metadata.
+ */
+#define GBS_GUID		"XeonFPGA\xb7GBSv001"
+#define GBS_GUID_LEN		16
+#define GBS_HEADER_LEN		(GBS_GUID_LEN + sizeof(u32))
+#define GBS_METADATA_MAX	(64 << 10)
+
 DEFINE_FPGA_PR_ERR_MSG(pr_err_msg);
 
+/*
+ * 512-bit PR data push, a single non-temporal AVX-512 store so the data
+ * unit reaches the PR engine in one write and isn't pulled into the cache.
+ * The data registers share a page with the PR control registers, so they
+ * are mapped uncached and can't be mapped write-combining: narrower SIMD
+ * stores would split the unit. Without AVX-512 the PR engine is fed 32
+ * bits at a time instead.
+ */
+struct fme_pr_copy {
+	const char *name;
+	void (*copy)(const void *src, void __iomem *dst);
+};
+
 #if defined(CONFIG_X86) && defined(CONFIG_AS_AVX512)
 
+#include <asm/cpufeature.h>
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
 #include <asm/i387.h>
 #else
 #include <asm/fpu/api.h>
 #endif
 
-static inline void copy512(void *src, void *dst)
+static void pr_copy_avx512(const void *src, void __iomem *dst)
 {
 	asm volatile("vmovdqu64 (%0), %%zmm0;"
 		     "vmovntdq %%zmm0, (%1);"
 		     :
-		     : "r"(src), "r"(dst));
+		     : "r"(src), "r"(dst)
+		     : "memory");
+}
+
+static const struct fme_pr_copy fme_pr_copy_avx512 = {
+	.name = "avx512",
+	.copy = pr_copy_avx512,
+};
+
+static const struct fme_pr_copy *fme_pr_select_copy(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX512F) ? &fme_pr_copy_avx512 : NULL;
 }
 #else
 static inline void kernel_fpu_begin(void)
@@ -62,9 +125,9 @@ static inline void kernel_fpu_end(void)
 {
 }
 
-static inline void copy512(void *src, void *dst)
+static const struct fme_pr_copy *fme_pr_select_copy(void)
 {
-	WARN_ON_ONCE(1);
+	return NULL;
 }
 #endif
 
@@ -98,9 +161,71 @@ static ssize_t interface_id_show(struct device *dev,
 
 static DEVICE_ATTR_RO(interface_id);
 
+/*
+ * push throughput of the last PR in MB/s, from the history as the fields
+ * of struct fpga_fme are reset when the next PR starts.
+ */
+static ssize_t throughput_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct fpga_fme *fme = fpga_pdata_get_private(dev_get_platdata(dev));
+	struct fme_pr_record *rec;
+	u64 mbps = 0;
+
+	spin_lock(&fme->pr_history_lock);
+	if (fme->pr_history_count) {
+		rec = &fme->pr_history[(fme->pr_history_count - 1) %
+				       PR_HISTORY_SIZE];
+		if (rec->phase_ns[FME_PR_PHASE_PUSH])
+			mbps = div64_u64(rec->bytes * 1000,
+					 rec->phase_ns[FME_PR_PHASE_PUSH]);
+	}
+	spin_unlock(&fme->pr_history_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)mbps);
+}
+
+static DEVICE_ATTR_RO(throughput);
+
+static int fme_pr_firmware(struct platform_device *pdev, u32 port_id,
+			   const char *image_name, u64 *status);
+
+/* "<port id> <image name>" reconfigures the port from the firmware path */
+static ssize_t firmware_load_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	char *args, *image_name;
+	u32 port_id;
+	u64 status = 0;
+	int ret;
+
+	args = kstrndup(buf, count, GFP_KERNEL);
+	if (!args)
+		return -ENOMEM;
+
+	image_name = strim(args);
+	ret = kstrtou32(strsep(&image_name, " "), 0, &port_id);
+	if (!ret && !image_name)
+		ret = -EINVAL;
+	if (!ret)
+		ret = fme_pr_firmware(to_platform_device(dev), port_id,
+				      skip_spaces(image_name), &status);
+	if (ret == -EIO)
+		dev_err(dev, "PR of port %u failed, error code 0x%llx\n",
+			port_id, (unsigned long long)status);
+
+	kfree(args);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_WO(firmware_load);
+
 static struct attribute *pr_mgmt_attrs[] = {
 	&dev_attr_revision.attr,
 	&dev_attr_interface_id.attr,
+	&dev_attr_throughput.attr,
+	&dev_attr_firmware_load.attr,
 	NULL,
 };
 
@@ -128,6 +253,18 @@ pr_err_handle(struct platform_device *pdev, struct feature_fme_pr *fme_pr)
 	return fme_pr_error;
 }
 
+/* end the current PR phase, the next one starts right away */
+static void fme_pr_phase_end(struct fpga_fme *fme, int phase)
+{
+	ktime_t now = ktime_get();
+
+	fme->pr_phase_ns[phase] = ktime_to_ns(ktime_sub(now,
+							fme->pr_phase_start));
+	fme->pr_phase_start = now;
+
+	trace_fme_pr_phase(fme->port_id, phase, fme->pr_phase_ns[phase]);
+}
+
 static int fme_pr_write_init(struct fpga_manager *mgr,
 		struct fpga_image_info *info, const char *buf, size_t count)
 {
@@ -146,6 +283,8 @@ static int fme_pr_write_init(struct fpga_manager *mgr,
 	if (WARN_ON(info->flags != FPGA_MGR_PARTIAL_RECONFIG))
 		return -EINVAL;
 
+	fme->pr_phase_start = ktime_get();
+
 	dev_dbg(&pdev->dev, "resetting PR before initiated PR\n");
 
 	fme_pr_ctl.csr = readq(&fme_pr->ccip_fme_pr_control);
@@ -163,6 +302,7 @@ static int fme_pr_write_init(struct fpga_manager *mgr,
 	fme_pr_ctl.csr = readq(&fme_pr->ccip_fme_pr_control);
 	fme_pr_ctl.pr_reset = 0;
 	writeq(fme_pr_ctl.csr, &fme_pr->ccip_fme_pr_control);
+	fme_pr_phase_end(fme, FME_PR_PHASE_RESET);
 
 	dev_dbg(&pdev->dev,
 		"waiting for PR resource in HW to be initialized and ready\n");
@@ -177,23 +317,6 @@ static int fme_pr_write_init(struct fpga_manager *mgr,
 
 	dev_dbg(&pdev->dev, "check if have any previous PR error\n");
 	pr_err_handle(pdev, fme_pr);
-	return 0;
-}
-
-static int fme_pr_write(struct fpga_manager *mgr,
-			const char *buf, size_t count)
-{
-	struct fpga_fme *fme = mgr->priv;
-	struct platform_device *pdev;
-	struct feature_fme_pr *fme_pr;
-	struct feature_fme_pr_ctl fme_pr_ctl;
-	struct feature_fme_pr_status fme_pr_status;
-	struct feature_fme_pr_data fme_pr_data;
-	int ret = 0, delay = 0, pr_credit;
-
-	pdev = fme->pdata->dev;
-	fme_pr = get_feature_ioaddr_by_index(&pdev->dev,
-				FME_FEATURE_ID_PR_MGMT);
 
 	dev_dbg(&pdev->dev, "set PR port ID and start request\n");
 
@@ -202,30 +325,77 @@ static int fme_pr_write(struct fpga_manager *mgr,
 	fme_pr_ctl.pr_start_req = 1;
 	writeq(fme_pr_ctl.csr, &fme_pr->ccip_fme_pr_control);
 
-	dev_dbg(&pdev->dev, "pushing data from bitstream to HW\n");
+	fme->pr_tail_len = 0;
+	fme_pr_phase_end(fme, FME_PR_PHASE_INIT);
+	return 0;
+}
 
-	fme_pr_status.csr = readq(&fme_pr->ccip_fme_pr_status);
-	pr_credit = fme_pr_status.pr_credit;
+/*
+ * Push @units data units of pr_bandwidth bytes each from @buf to HW. Every
+ * status read tells how many credits HW has, all but one are used before
+ * the status is read again: the last credit is left to HW, as the push
+ * always did. When HW runs out of credits, poll busily for a short while
+ * and then back off to sleeping between polls.
+ */
+static int fme_pr_push_units(struct fpga_fme *fme,
+			     struct feature_fme_pr *fme_pr,
+			     const char *buf, size_t units)
+{
+	struct platform_device *pdev = fme->pdata->dev;
+	struct feature_fme_pr_status fme_pr_status;
+	struct feature_fme_pr_data fme_pr_data;
+	bool fpu = false;
+	u64 stall = 0, waited;
+	size_t credits;
+	int ret = 0;
 
-	if (fme->pr_avx512)
-		kernel_fpu_begin();
+	while (units > 0) {
+		fme_pr_status.csr = readq(&fme_pr->ccip_fme_pr_status);
+		credits = 0;
+		if (fme_pr_status.pr_credit > 1)
+			credits = min_t(size_t, fme_pr_status.pr_credit - 1,
+					units);
+
+		if (!credits) {
+			if (!stall) {
+				stall = ktime_to_ns(ktime_get());
+				fme->pr_credit_stalls++;
+				continue;
+			}
 
-	while (count > 0) {
-		while (pr_credit <= 1) {
-			if (delay++ > PR_WAIT_TIMEOUT) {
+			waited = ktime_to_ns(ktime_get()) - stall;
+			if (waited > (u64)PR_WAIT_TIMEOUT * NSEC_PER_USEC) {
 				dev_err(&pdev->dev, "maximum try\n");
 
 				fme->pr_err = pr_err_handle(pdev, fme_pr);
 				ret = fme->pr_err ? -EIO : -ETIMEDOUT;
 				goto done;
 			}
-			udelay(1);
 
-			fme_pr_status.csr = readq(&fme_pr->ccip_fme_pr_status);
-			pr_credit = fme_pr_status.pr_credit;
-		};
+			if (waited < PR_CREDIT_SPIN_NS) {
+				cpu_relax();
+				continue;
+			}
+
+			/* can't sleep with the FPU in use */
+			if (fpu) {
+				kernel_fpu_end();
+				fpu = false;
+			}
+			usleep_range(PR_CREDIT_SLEEP_MIN, PR_CREDIT_SLEEP_MAX);
+			continue;
+		}
+		stall = 0;
+
+		if (fme->pr_copy && !fpu) {
+			kernel_fpu_begin();
+			fpu = true;
+		}
+
+		fme->pr_push_bytes += credits * fme->pr_bandwidth;
+		units -= credits;
 
-		if (count >= fme->pr_bandwidth) {
+		while (credits--) {
 			switch (fme->pr_bandwidth) {
 			case 4:
 				fme_pr_data.rsvd = 0;
@@ -234,7 +404,7 @@ static int fme_pr_write(struct fpga_manager *mgr,
 				       &fme_pr->ccip_fme_pr_data);
 				break;
 			case 64:
-				copy512((void *)buf, &fme_pr->fme_pr_data1);
+				fme->pr_copy->copy(buf, &fme_pr->fme_pr_data1);
 				break;
 			default:
 				ret = -EFAULT;
@@ -242,22 +412,79 @@ static int fme_pr_write(struct fpga_manager *mgr,
 			}
 
 			buf += fme->pr_bandwidth;
-			count -= fme->pr_bandwidth;
-			pr_credit--;
-		} else {
-			WARN_ON(1);
-			ret = -EINVAL;
-			goto done;
 		}
 	}
 
 done:
-	if (fme->pr_avx512)
+	if (fpu)
 		kernel_fpu_end();
 
 	return ret;
 }
 
+/*
+ * Push @count bytes of bitstream to HW. The image may be handed over in
+ * pieces of any size, a partial data unit at the end of a piece is kept in
+ * fme->pr_tail and completed with the head of the next one.
+ */
+static int fme_pr_push(struct fpga_fme *fme, struct feature_fme_pr *fme_pr,
+		       const char *buf, size_t count)
+{
+	size_t n, bw = fme->pr_bandwidth;
+	int ret;
+
+	if (fme->pr_tail_len) {
+		n = min(count, bw - fme->pr_tail_len);
+		memcpy(fme->pr_tail + fme->pr_tail_len, buf, n);
+		fme->pr_tail_len += n;
+		buf += n;
+		count -= n;
+
+		if (fme->pr_tail_len < bw)
+			return 0;
+
+		fme->pr_tail_len = 0;
+		ret = fme_pr_push_units(fme, fme_pr, fme->pr_tail, 1);
+		if (ret)
+			return ret;
+	}
+
+	ret = fme_pr_push_units(fme, fme_pr, buf, count / bw);
+	if (ret)
+		return ret;
+
+	n = count % bw;
+	memcpy(fme->pr_tail, buf + count - n, n);
+	fme->pr_tail_len = n;
+
+	return 0;
+}
+
+static int fme_pr_write_sg(struct fpga_manager *mgr, struct sg_table *sgt)
+{
+	struct fpga_fme *fme = mgr->priv;
+	struct platform_device *pdev;
+	struct feature_fme_pr *fme_pr;
+	struct sg_mapping_iter miter;
+	int ret = 0;
+
+	pdev = fme->pdata->dev;
+	fme_pr = get_feature_ioaddr_by_index(&pdev->dev,
+				FME_FEATURE_ID_PR_MGMT);
+
+	dev_dbg(&pdev->dev, "pushing data from bitstream to HW\n");
+
+	sg_miter_start(&miter, sgt->sgl, sgt->nents, SG_MITER_FROM_SG);
+	while (sg_miter_next(&miter)) {
+		ret = fme_pr_push(fme, fme_pr, miter.addr, miter.length);
+		if (ret)
+			break;
+	}
+	sg_miter_stop(&miter);
+
+	return ret;
+}
+
 static int fme_pr_write_complete(struct fpga_manager *mgr,
 			struct fpga_image_info *info)
 {
@@ -265,11 +492,31 @@ static int fme_pr_write_complete(struct fpga_manager *mgr,
 	struct platform_device *pdev;
 	struct feature_fme_pr *fme_pr;
 	struct feature_fme_pr_ctl fme_pr_ctl;
+	int ret;
 
 	pdev = fme->pdata->dev;
 	fme_pr = get_feature_ioaddr_by_index(&pdev->dev,
 				FME_FEATURE_ID_PR_MGMT);
 
+	/*
+	 * Padding extra zeros to align the last data unit with PR bandwidth,
+	 * HW will ignore these zeros automatically.
+	 */
+	if (fme->pr_tail_len) {
+		memset(fme->pr_tail + fme->pr_tail_len, 0,
+		       fme->pr_bandwidth - fme->pr_tail_len);
+		fme->pr_tail_len = 0;
+
+		ret = fme_pr_push_units(fme, fme_pr, fme->pr_tail, 1);
+		if (ret)
+			return ret;
+	}
+
+	fme_pr_phase_end(fme, FME_PR_PHASE_PUSH);
+	trace_fme_pr_push(fme->port_id, fme->pr_push_bytes,
+			  fme->pr_credit_stalls,
+			  fme->pr_phase_ns[FME_PR_PHASE_PUSH]);
+
 	fme_pr_ctl.csr = readq(&fme_pr->ccip_fme_pr_control);
 	fme_pr_ctl.pr_push_complete = 1;
 	writeq(fme_pr_ctl.csr, &fme_pr->ccip_fme_pr_control);
@@ -279,8 +526,10 @@ static int fme_pr_write_complete(struct fpga_manager *mgr,
 
 	fme_pr_ctl.pr_start_req = 0;
 
-	if (fpga_wait_register_field(pr_start_req, fme_pr_ctl,
-		&fme_pr->ccip_fme_pr_control, PR_WAIT_TIMEOUT, 1)) {
+	ret = fpga_wait_register_field(pr_start_req, fme_pr_ctl,
+		&fme_pr->ccip_fme_pr_control, PR_WAIT_TIMEOUT, 1);
+	fme_pr_phase_end(fme, FME_PR_PHASE_COMPLETE);
+	if (ret) {
 		dev_err(&pdev->dev, "maximum try.\n");
 		return -ETIMEDOUT;
 	}
@@ -301,182 +550,1277 @@ static enum fpga_mgr_states fme_pr_state(struct fpga_manager *mgr)
 
 static const struct fpga_manager_ops fme_pr_ops = {
 	.write_init = fme_pr_write_init,
-	.write = fme_pr_write,
+	.write_sg = fme_pr_write_sg,
 	.write_complete = fme_pr_write_complete,
 	.state = fme_pr_state,
 };
 
-static int fme_pr(struct platform_device *pdev, unsigned long arg)
+/*
+ * Pin the user buffer holding the bitstream and describe it with a
+ * scatterlist, so it can be pushed to HW without an intermediate copy.
+ * The buffer is at most a chunk, see fme_pr_stream_fetch().
+ */
+static int fme_pr_pin_buffer(u64 addr, size_t size, struct page ***ppages,
+			     size_t *pnpages, struct sg_table *sgt)
 {
-	void __user *argp = (void __user *)arg;
-	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
-	struct fpga_fme *fme;
-	struct fpga_manager *mgr;
-	struct feature_fme_header *fme_hdr;
-	struct feature_fme_capability fme_capability;
-	struct fpga_image_info info;
-	struct fpga_fme_port_pr port_pr;
-	struct platform_device *port;
-	unsigned long minsz;
-	void *buf = NULL;
-	size_t length;
-	int ret = 0;
-
-	minsz = offsetofend(struct fpga_fme_port_pr, status);
-
-	if (copy_from_user(&port_pr, argp, minsz))
-		return -EFAULT;
+	struct page **pages;
+	size_t npages;
+	long pinned;
+	int ret;
 
-	if (port_pr.argsz < minsz || port_pr.flags)
+	if (!size || size > PR_CHUNK_SIZE)
 		return -EINVAL;
 
-	/* get fme header region */
-	fme_hdr = get_feature_ioaddr_by_index(&pdev->dev,
-					FME_FEATURE_ID_HEADER);
-	if (WARN_ON(!fme_hdr))
-		return -EINVAL;
+	npages = DIV_ROUND_UP(offset_in_page(addr) + size, PAGE_SIZE);
+	pages = kvmalloc_array(npages, sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
 
-	/* check port id */
-	fme_capability.csr = readq(&fme_hdr->capability);
-	if (port_pr.port_id >= fme_capability.num_ports) {
-		dev_dbg(&pdev->dev, "port number more than maximum\n");
-		return -EINVAL;
+	pinned = get_user_pages_fast(addr & PAGE_MASK, npages, 0, pages);
+	if (pinned != (long)npages) {
+		ret = pinned < 0 ? pinned : -EFAULT;
+		goto put_pages;
 	}
 
-	if (!access_ok(VERIFY_READ, port_pr.buffer_address,
-				    port_pr.buffer_size))
-		return -EFAULT;
-
-	mutex_lock(&pdata->lock);
-	fme = fpga_pdata_get_private(pdata);
-	/* fme device has been unregistered. */
-	if (!fme) {
-		ret = -EINVAL;
-		goto unlock_exit;
-	}
+	ret = sg_alloc_table_from_pages(sgt, pages, npages,
+					offset_in_page(addr), size,
+					GFP_KERNEL);
+	if (ret)
+		goto put_pages;
 
-	/*
-	 * Padding extra zeros to align PR buffer with PR bandwidth, HW will
-	 * ignore these zeros automatically.
-	 */
-	length = ALIGN(port_pr.buffer_size, fme->pr_bandwidth);
+	*ppages = pages;
+	*pnpages = npages;
+	return 0;
 
-	buf = vzalloc(length);
-	if (!buf) {
-		ret = -ENOMEM;
-		goto unlock_exit;
-	}
+put_pages:
+	while (pinned > 0)
+		put_page(pages[--pinned]);
+	kvfree(pages);
+	return ret;
+}
 
-	if (copy_from_user(buf, (void __user *)port_pr.buffer_address,
-					       port_pr.buffer_size)) {
-		ret = -EFAULT;
-		goto free_exit;
-	}
+/*
+ * The user bitstream is pinned and pushed in PR_CHUNK_SIZE chunks, double
+ * buffered: while one chunk is pushed to HW, the next one is pinned (and
+ * faulted in from page cache if needed) by a worker running on the
+ * caller's mm, so the push loop doesn't wait for page faults.
+ */
+struct fme_pr_chunk {
+	u64 addr;
+	size_t size;
+	struct page **pages;
+	size_t npages;
+	struct sg_table sgt;
+	int ret;
+};
 
-	memset(&info, 0, sizeof(struct fpga_image_info));
-	info.flags = FPGA_MGR_PARTIAL_RECONFIG;
+struct fme_pr_stream {
+	struct mm_struct *mm;
+	u64 addr;		/* start of the part not fetched yet */
+	size_t remain;		/* size of the part not fetched yet */
+	struct fme_pr_chunk chunk[2];
+	int cur;		/* chunk being pushed */
+	int fill;		/* chunk being fetched */
+	bool fetching;
+	struct work_struct work;
+	struct completion fetched;
+};
 
-	mgr = fpga_mgr_get(&pdev->dev);
-	if (IS_ERR(mgr)) {
-		ret = PTR_ERR(mgr);
-		goto free_exit;
-	}
+static void fme_pr_chunk_put(struct fme_pr_chunk *chunk)
+{
+	if (!chunk->pages)
+		return;
+
+	sg_free_table(&chunk->sgt);
+	while (chunk->npages > 0)
+		put_page(chunk->pages[--chunk->npages]);
+	kvfree(chunk->pages);
+	chunk->pages = NULL;
+}
 
-	fme->pr_err = 0;
-	fme->port_id = port_pr.port_id;
+static void fme_pr_stream_work(struct work_struct *work)
+{
+	struct fme_pr_stream *s = container_of(work, struct fme_pr_stream,
+					       work);
+	struct fme_pr_chunk *chunk = &s->chunk[s->fill];
 
-	/* Find and get port device by index */
-	port = pdata->fpga_for_each_port(pdev, &fme->port_id,
-					 fpga_port_check_id);
-	WARN_ON(!port);
+	use_mm(s->mm);
+	chunk->ret = fme_pr_pin_buffer(chunk->addr, chunk->size,
+				       &chunk->pages, &chunk->npages,
+				       &chunk->sgt);
+	unuse_mm(s->mm);
 
-	/* Disable Port before PR */
-	fpga_port_disable(port);
+	complete(&s->fetched);
+}
 
-	ret = fpga_mgr_buf_load(mgr, &info, buf, length);
-	port_pr.status = fme->pr_err;
+/* start fetching the next chunk into the buffer which is not pushed. */
+static void fme_pr_stream_fetch(struct fme_pr_stream *s)
+{
+	struct fme_pr_chunk *chunk;
 
-	/* Re-enable Port after PR finished */
-	fpga_port_enable(port);
+	s->fill = !s->cur;
+	chunk = &s->chunk[s->fill];
+	chunk->addr = s->addr;
+	chunk->size = min_t(size_t, s->remain, PR_CHUNK_SIZE);
 
-	put_device(&port->dev);
+	s->addr += chunk->size;
+	s->remain -= chunk->size;
 
-	fpga_mgr_put(mgr);
-free_exit:
-	vfree(buf);
-unlock_exit:
-	mutex_unlock(&pdata->lock);
-	if (copy_to_user((void __user *)arg, &port_pr, minsz))
-		return -EFAULT;
-	return ret;
+	s->fetching = true;
+	reinit_completion(&s->fetched);
+	queue_work(system_unbound_wq, &s->work);
 }
 
-static int fpga_fme_pr_probe(struct platform_device *pdev)
+/* fpga_mgr_stream_load() callback, hands over the prefetched chunk. */
+static int fme_pr_stream_next(void *priv, struct sg_table **sgt)
 {
-	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
-	struct feature_fme_pr *fme_pr;
-	struct feature_header fme_pr_header;
-	struct fpga_fme *priv;
-	int ret;
-
-	mutex_lock(&pdata->lock);
-	priv = fpga_pdata_get_private(pdata);
+	struct fme_pr_stream *s = priv;
+	struct fme_pr_chunk *chunk;
 
-	fme_pr = get_feature_ioaddr_by_index(&pdev->dev,
-				FME_FEATURE_ID_PR_MGMT);
+	/* the chunk returned last time has been pushed, release it. */
+	fme_pr_chunk_put(&s->chunk[s->cur]);
 
-	fme_pr_header.csr = readq(&fme_pr->header);
-	if (fme_pr_header.revision == 2) {
-		dev_dbg(&pdev->dev, "using 512-bit PR\n");
-		priv->pr_bandwidth = 64;
-		priv->pr_avx512 = true;
-	} else {
-		dev_dbg(&pdev->dev, "using 32-bit PR\n");
-		priv->pr_bandwidth = 4;
+	if (!s->fetching) {
+		*sgt = NULL;
+		return 0;
 	}
 
-	ret = fpga_mgr_register(&pdata->dev->dev,
-		"Intel FPGA Manager", &fme_pr_ops, priv);
-	mutex_unlock(&pdata->lock);
+	wait_for_completion(&s->fetched);
+	s->fetching = false;
+	s->cur = s->fill;
 
-	return ret;
-}
+	chunk = &s->chunk[s->cur];
+	if (chunk->ret)
+		return chunk->ret;
 
-static int fpga_fme_pr_remove(struct platform_device *pdev)
-{
-	fpga_mgr_unregister(&pdev->dev);
+	if (s->remain)
+		fme_pr_stream_fetch(s);
+
+	*sgt = &chunk->sgt;
 	return 0;
 }
 
-static int pr_mgmt_init(struct platform_device *pdev, struct feature *feature)
+/* must be called in the context of the process owning the buffer */
+static int fme_pr_stream_init(struct fme_pr_stream *s, u64 addr, size_t size)
 {
-	int ret;
+	memset(s, 0, sizeof(*s));
 
-	ret = fpga_fme_pr_probe(pdev);
-	if (ret)
-		return ret;
+	s->mm = get_task_mm(current);
+	if (!s->mm)
+		return -EFAULT;
 
-	ret = sysfs_create_group(&pdev->dev.kobj, &pr_mgmt_attr_group);
-	if (ret)
-		fpga_fme_pr_remove(pdev);
+	s->addr = addr;
+	s->remain = size;
+	s->cur = 1;
+	INIT_WORK(&s->work, fme_pr_stream_work);
+	init_completion(&s->fetched);
 
-	return ret;
+	/* start fetching the first chunk right away. */
+	fme_pr_stream_fetch(s);
+	return 0;
 }
 
-static void pr_mgmt_uinit(struct platform_device *pdev, struct feature *feature)
+static void fme_pr_stream_fini(struct fme_pr_stream *s)
 {
-	sysfs_remove_group(&pdev->dev.kobj, &pr_mgmt_attr_group);
-	fpga_fme_pr_remove(pdev);
+	if (s->fetching)
+		wait_for_completion(&s->fetched);
+
+	fme_pr_chunk_put(&s->chunk[0]);
+	fme_pr_chunk_put(&s->chunk[1]);
+	mmput(s->mm);
 }
 
-static long fme_pr_ioctl(struct platform_device *pdev, struct feature *feature,
-	unsigned int cmd, unsigned long arg)
+int fme_pr_check_port(struct platform_device *pdev, u32 port_id)
 {
-	long ret;
+	struct feature_fme_header *fme_hdr;
+	struct feature_fme_capability fme_capability;
 
-	switch (cmd) {
-	case FPGA_FME_PORT_PR:
-		ret = fme_pr(pdev, arg);
+	/* get fme header region */
+	fme_hdr = get_feature_ioaddr_by_index(&pdev->dev,
+					FME_FEATURE_ID_HEADER);
+	if (WARN_ON(!fme_hdr))
+		return -EINVAL;
+
+	/* check port id */
+	fme_capability.csr = readq(&fme_hdr->capability);
+	if (port_id >= fme_capability.num_ports) {
+		dev_dbg(&pdev->dev, "port number more than maximum\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the interface id in the GBS metadata, e.g.
+ * "afu-image": { "interface-uuid": "01234567-89ab-cdef-0123-456789abcdef" }
+ * Metadata without interface id is accepted, there is nothing to check.
+ */
+static int fme_pr_gbs_parse_metadata(const char *json, size_t len,
+				     struct fme_pr_gbs *gbs)
+{
+	static const char key[] = "\"interface-uuid\"";
+	const char *p, *end = json + len;
+	char hex[32];
+	u8 id[16];
+	int n = 0;
+
+	p = strnstr(json, key, len);
+	if (!p)
+		return 0;
+
+	p += sizeof(key) - 1;
+	while (p < end && isspace(*p))
+		p++;
+	if (p >= end || *p++ != ':')
+		return -EINVAL;
+	while (p < end && isspace(*p))
+		p++;
+	if (p >= end || *p++ != '"')
+		return -EINVAL;
+
+	for (; p < end && *p != '"' && n < sizeof(hex); p++)
+		if (*p != '-')
+			hex[n++] = *p;
+
+	if (n != sizeof(hex) || p >= end || *p != '"' ||
+	    hex2bin(id, hex, sizeof(id)))
+		return -EINVAL;
+
+	gbs->intfc_id_h = get_unaligned_be64(id);
+	gbs->intfc_id_l = get_unaligned_be64(id + 8);
+	gbs->has_intfc_id = true;
+	return 0;
+}
+
+/* length of the metadata if @hdr is a GBS header, -ENOENT otherwise */
+static int fme_pr_gbs_metadata_len(const u8 *hdr, size_t size)
+{
+	u32 len;
+
+	if (size < GBS_HEADER_LEN || memcmp(hdr, GBS_GUID, GBS_GUID_LEN))
+		return -ENOENT;
+
+	len = get_unaligned_le32(hdr + GBS_GUID_LEN);
+	if (len > GBS_METADATA_MAX || len > size - GBS_HEADER_LEN)
+		return -EINVAL;
+
+	return len;
+}
+
+/*
+ * Parse the bitstream of @size bytes at @buf. It is either a GBS file, or
+ * a raw bitstream which is programmed as is.
+ */
+int fme_pr_gbs_parse(const void *buf, size_t size, struct fme_pr_gbs *gbs)
+{
+	int len;
+
+	memset(gbs, 0, sizeof(*gbs));
+	gbs->size = size;
+
+	len = fme_pr_gbs_metadata_len(buf, size);
+	if (len == -ENOENT)
+		return 0;
+	if (len < 0)
+		return len;
+
+	gbs->offset = GBS_HEADER_LEN + len;
+	gbs->size = size - gbs->offset;
+
+	return fme_pr_gbs_parse_metadata(buf + GBS_HEADER_LEN, len, gbs);
+}
+
+/* same as fme_pr_gbs_parse(), for a bitstream in user memory */
+int fme_pr_gbs_parse_user(u64 addr, size_t size, struct fme_pr_gbs *gbs)
+{
+	void __user *uaddr = (void __user *)(unsigned long)addr;
+	u8 hdr[GBS_HEADER_LEN];
+	char *metadata;
+	int len, ret;
+
+	memset(gbs, 0, sizeof(*gbs));
+	gbs->size = size;
+
+	if (size < GBS_HEADER_LEN)
+		return 0;
+
+	if (copy_from_user(hdr, uaddr, GBS_HEADER_LEN))
+		return -EFAULT;
+
+	len = fme_pr_gbs_metadata_len(hdr, size);
+	if (len == -ENOENT)
+		return 0;
+	if (len < 0)
+		return len;
+
+	metadata = memdup_user(uaddr + GBS_HEADER_LEN, len);
+	if (IS_ERR(metadata))
+		return PTR_ERR(metadata);
+
+	gbs->offset = GBS_HEADER_LEN + len;
+	gbs->size = size - gbs->offset;
+
+	ret = fme_pr_gbs_parse_metadata(metadata, len, gbs);
+	kfree(metadata);
+
+	return ret;
+}
+
+/* a bitstream in user memory, optionally compressed */
+struct fme_pr_user {
+	struct fme_pr_stream stream;
+	struct fme_pr_decomp *decomp;	/* NULL if not compressed */
+	struct fme_pr_gbs gbs;
+};
+
+static void fme_pr_user_fini(struct fme_pr_user *img)
+{
+	if (img->decomp)
+		fme_pr_decomp_destroy(img->decomp);
+	fme_pr_stream_fini(&img->stream);
+}
+
+/*
+ * Validate a PR request from userspace and start streaming the image,
+ * must be called in the context of the process owning the buffer.
+ */
+static int fme_pr_user_init(struct platform_device *pdev,
+			    struct fme_pr_user *img, u32 port_id,
+			    u64 addr, u32 size, u32 flags)
+{
+	const void *head;
+	size_t len;
+	int ret;
+
+	if (!size)
+		return -EINVAL;
+
+	ret = fme_pr_check_port(pdev, port_id);
+	if (ret)
+		return ret;
+
+	if (!access_ok(VERIFY_READ, addr, size))
+		return -EFAULT;
+
+	img->decomp = NULL;
+
+	if (!flags) {
+		ret = fme_pr_gbs_parse_user(addr, size, &img->gbs);
+		if (ret)
+			return ret;
+
+		if (!img->gbs.size)
+			return -EINVAL;
+
+		return fme_pr_stream_init(&img->stream,
+					  addr + img->gbs.offset,
+					  img->gbs.size);
+	}
+
+	ret = fme_pr_stream_init(&img->stream, addr, size);
+	if (ret)
+		return ret;
+
+	img->decomp = fme_pr_decomp_create(flags, fme_pr_stream_next,
+					   &img->stream);
+	if (IS_ERR(img->decomp)) {
+		ret = PTR_ERR(img->decomp);
+		img->decomp = NULL;
+		goto fini_exit;
+	}
+
+	/* the GBS header, if any, is at the head of the decompressed data */
+	ret = fme_pr_decomp_peek(img->decomp, &head, &len);
+	if (!ret && !len)
+		ret = -EINVAL;
+	if (!ret)
+		ret = fme_pr_gbs_parse(head, len, &img->gbs);
+	if (ret)
+		goto fini_exit;
+
+	fme_pr_decomp_skip(img->decomp, img->gbs.offset);
+
+	/* the decompressed size is only known at the end */
+	img->gbs.offset = 0;
+	img->gbs.size = 0;
+	return 0;
+
+fini_exit:
+	fme_pr_user_fini(img);
+	return ret;
+}
+
+static int fme_pr_user_load(struct fpga_manager *mgr,
+			    struct fpga_image_info *info, void *priv)
+{
+	struct fme_pr_user *img = priv;
+
+	if (img->decomp)
+		return fpga_mgr_stream_load(mgr, info, fme_pr_decomp_next,
+					    img->decomp);
+
+	return fpga_mgr_stream_load(mgr, info, fme_pr_stream_next,
+				    &img->stream);
+}
+
+/*
+ * Check the bitstream against the FME before the port is disabled, so a
+ * wrong image costs no port downtime. Only a GBS file has an interface id
+ * to check, a raw bitstream is taken as it is, and its size needn't be a
+ * multiple of the PR data unit: the last unit is padded with zeros.
+ */
+static int fme_pr_preflight(struct platform_device *pdev,
+			    const struct fme_pr_gbs *gbs)
+{
+	struct feature_fme_pr *fme_pr;
+	u64 intfc_id_l, intfc_id_h;
+
+	if (!gbs->has_intfc_id)
+		return 0;
+
+	fme_pr = get_feature_ioaddr_by_index(&pdev->dev,
+				FME_FEATURE_ID_PR_MGMT);
+	intfc_id_l = readq(&fme_pr->fme_pr_intfc_id_l);
+	intfc_id_h = readq(&fme_pr->fme_pr_intfc_id_h);
+
+	if (gbs->intfc_id_l != intfc_id_l || gbs->intfc_id_h != intfc_id_h) {
+		dev_dbg(&pdev->dev,
+			"bitstream interface id %016llx%016llx mismatch\n",
+			gbs->intfc_id_h, gbs->intfc_id_l);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* add the PR which has just finished to the history */
+static void fme_pr_record(struct fpga_fme *fme, int result, u64 total_ns)
+{
+	struct fme_pr_record *rec;
+
+	trace_fme_pr_end(fme->port_id, result, fme->pr_err, total_ns);
+
+	spin_lock(&fme->pr_history_lock);
+	rec = &fme->pr_history[fme->pr_history_count++ % PR_HISTORY_SIZE];
+	rec->time = ktime_get_real_seconds();
+	rec->port_id = fme->port_id;
+	rec->result = result;
+	rec->pr_err = fme->pr_err;
+	rec->bytes = fme->pr_push_bytes;
+	rec->credit_stalls = fme->pr_credit_stalls;
+	rec->total_ns = total_ns;
+	memcpy(rec->phase_ns, fme->pr_phase_ns, sizeof(rec->phase_ns));
+	spin_unlock(&fme->pr_history_lock);
+}
+
+static int fme_pr_history_show(struct seq_file *m, void *v)
+{
+	static const char * const phase_name[FME_PR_PHASE_MAX] = {
+		[FME_PR_PHASE_RESET] = "reset:",
+		[FME_PR_PHASE_INIT] = "init:",
+		[FME_PR_PHASE_PUSH] = "push:",
+		[FME_PR_PHASE_COMPLETE] = "complete:",
+	};
+	struct fpga_fme *fme = m->private;
+	struct fme_pr_record rec;
+	unsigned int i, count;
+	u64 mbps;
+	int j;
+
+	spin_lock(&fme->pr_history_lock);
+	count = fme->pr_history_count;
+	spin_unlock(&fme->pr_history_lock);
+
+	/* the most recent PR first */
+	for (i = 0; i < min_t(unsigned int, count, PR_HISTORY_SIZE); i++) {
+		spin_lock(&fme->pr_history_lock);
+		rec = fme->pr_history[(count - 1 - i) % PR_HISTORY_SIZE];
+		spin_unlock(&fme->pr_history_lock);
+
+		mbps = 0;
+		if (rec.phase_ns[FME_PR_PHASE_PUSH])
+			mbps = div64_u64(rec.bytes * 1000,
+					 rec.phase_ns[FME_PR_PHASE_PUSH]);
+
+		seq_printf(m, "time %lld port %u result %d error 0x%llx\n",
+			   (long long)rec.time, rec.port_id, rec.result,
+			   (unsigned long long)rec.pr_err);
+		seq_printf(m, "  total:    %llu ns\n",
+			   (unsigned long long)rec.total_ns);
+		for (j = 0; j < FME_PR_PHASE_MAX; j++)
+			seq_printf(m, "  %-9s %llu ns\n", phase_name[j],
+				   (unsigned long long)rec.phase_ns[j]);
+		seq_printf(m, "  bytes:    %llu (%llu MB/s), %u credit stalls\n",
+			   (unsigned long long)rec.bytes,
+			   (unsigned long long)mbps, rec.credit_stalls);
+	}
+
+	return 0;
+}
+
+static int fme_pr_history_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fme_pr_history_show, inode->i_private);
+}
+
+static const struct file_operations fme_pr_history_fops = {
+	.owner = THIS_MODULE,
+	.open = fme_pr_history_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Pin the FME for a PR which runs without pdata->lock, the FME is not
+ * removed until fme_pr_put(). NULL if the FME has gone or is going away.
+ */
+struct fpga_fme *fme_pr_get(struct feature_platform_data *pdata)
+{
+	struct fpga_fme *fme;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (fme && fme->pr_dying)
+		fme = NULL;
+	if (fme)
+		fme->pr_users++;
+	mutex_unlock(&pdata->lock);
+
+	return fme;
+}
+
+void fme_pr_put(struct feature_platform_data *pdata, struct fpga_fme *fme)
+{
+	mutex_lock(&pdata->lock);
+	if (!--fme->pr_users)
+		wake_up(&fme->pr_users_wq);
+	mutex_unlock(&pdata->lock);
+}
+
+/* find and get the port device by index */
+static struct platform_device *
+fme_pr_get_port(struct platform_device *pdev, u32 port_id)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	int id = port_id;
+
+	return pdata->fpga_for_each_port(pdev, &id, fpga_port_check_id);
+}
+
+/*
+ * Program one disabled port, the caller holds fme->pr_lock and the FPGA
+ * manager.
+ */
+static int fme_pr_load_port(struct fpga_fme *fme, struct fpga_manager *mgr,
+			    u32 port_id, fme_pr_load_t load, void *priv,
+			    u64 *status)
+{
+	struct fpga_image_info info;
+	ktime_t start;
+	int ret;
+
+	memset(&info, 0, sizeof(struct fpga_image_info));
+	info.flags = FPGA_MGR_PARTIAL_RECONFIG;
+
+	fme->pr_err = 0;
+	fme->port_id = port_id;
+	fme->pr_push_bytes = 0;
+	fme->pr_credit_stalls = 0;
+	memset(fme->pr_phase_ns, 0, sizeof(fme->pr_phase_ns));
+	start = ktime_get();
+	trace_fme_pr_begin(port_id);
+
+	ret = load(mgr, &info, priv);
+	*status = fme->pr_err;
+
+	fme_pr_record(fme, ret, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return ret;
+}
+
+/*
+ * Program the port @port_id with the bitstream @gbs which @load writes to
+ * the FPGA manager, HW error code is returned in @status. PRs on the FME are
+ * serialized by fme->pr_lock only, so the caller must not hold pdata->lock
+ * and telemetry or error handling on the FME is not blocked by the PR.
+ */
+int fme_pr_program(struct platform_device *pdev, struct fpga_fme *fme,
+		   u32 port_id, const struct fme_pr_gbs *gbs,
+		   fme_pr_load_t load, void *priv, u64 *status)
+{
+	struct fpga_manager *mgr;
+	struct platform_device *port;
+	int ret;
+
+	ret = fme_pr_preflight(pdev, gbs);
+	if (ret)
+		return ret;
+
+	mutex_lock(&fme->pr_lock);
+	mgr = fpga_mgr_get(&pdev->dev);
+	if (IS_ERR(mgr)) {
+		ret = PTR_ERR(mgr);
+		goto unlock_exit;
+	}
+
+	port = fme_pr_get_port(pdev, port_id);
+	if (WARN_ON(!port)) {
+		ret = -ENODEV;
+		goto put_mgr;
+	}
+
+	/* Disable Port before PR */
+	fpga_port_disable(port);
+
+	ret = fme_pr_load_port(fme, mgr, port_id, load, priv, status);
+
+	/* Re-enable Port after PR finished */
+	fpga_port_enable(port);
+
+	put_device(&port->dev);
+put_mgr:
+	fpga_mgr_put(mgr);
+unlock_exit:
+	mutex_unlock(&fme->pr_lock);
+	return ret;
+}
+
+static int fme_pr(struct platform_device *pdev, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme;
+	struct fpga_fme_port_pr port_pr;
+	struct fme_pr_user img;
+	unsigned long minsz;
+	int ret = 0;
+
+	minsz = offsetofend(struct fpga_fme_port_pr, status);
+
+	if (copy_from_user(&port_pr, argp, minsz))
+		return -EFAULT;
+
+	if (port_pr.argsz < minsz || port_pr.flags & ~FPGA_FME_PR_COMPRESS_MASK)
+		return -EINVAL;
+
+	/* fme device has been unregistered. */
+	fme = fme_pr_get(pdata);
+	if (!fme)
+		return -EINVAL;
+
+	ret = fme_pr_user_init(pdev, &img, port_pr.port_id,
+			       port_pr.buffer_address, port_pr.buffer_size,
+			       port_pr.flags);
+	if (ret) {
+		fme_pr_put(pdata, fme);
+		return ret;
+	}
+
+	ret = fme_pr_program(pdev, fme, port_pr.port_id, &img.gbs,
+			     fme_pr_user_load, &img, &port_pr.status);
+
+	fme_pr_user_fini(&img);
+	fme_pr_put(pdata, fme);
+	if (copy_to_user((void __user *)arg, &port_pr, minsz))
+		return -EFAULT;
+	return ret;
+}
+
+struct fme_pr_batch_port {
+	struct platform_device *port;
+	bool ready;
+	bool wait;	/* soft reset asserted by this batch */
+};
+
+/*
+ * A batch quiesces all its ports at once, so the draining of outstanding
+ * requests overlaps, and hands each port back as soon as it is programmed.
+ * Smaller images go first, which keeps the summed port downtime minimal.
+ * The images are validated before any port is touched, but only the one
+ * being programmed is streamed, so a batch holds one image at a time.
+ */
+static void fme_pr_batch_order(struct fpga_fme_port_pr_entry *entries,
+			       int *order, u32 count)
+{
+	int i, j, tmp;
+
+	for (i = 0; i < count; i++)
+		order[i] = i;
+
+	for (i = 1; i < count; i++)
+		for (j = i; j > 0 && entries[order[j - 1]].buffer_size >
+				     entries[order[j]].buffer_size; j--) {
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+}
+
+static int fme_pr_batch_check(struct platform_device *pdev,
+			      struct fpga_fme_port_pr_entry *entries, u32 i,
+			      struct fme_pr_user *img)
+{
+	struct fpga_fme_port_pr_entry *e = &entries[i];
+	u32 j;
+	int ret;
+
+	if (e->flags & ~FPGA_FME_PR_COMPRESS_MASK)
+		return -EINVAL;
+
+	for (j = 0; j < i; j++)
+		if (entries[j].port_id == e->port_id)
+			return -EINVAL;
+
+	ret = fme_pr_user_init(pdev, img, e->port_id, e->buffer_address,
+			       e->buffer_size, e->flags);
+	if (ret)
+		return ret;
+
+	ret = fme_pr_preflight(pdev, &img->gbs);
+	if (ret)
+		fme_pr_user_fini(img);
+
+	return ret;
+}
+
+static int fme_pr_batch(struct platform_device *pdev, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme_port_pr_entry *entries, *e;
+	struct fpga_fme_port_pr_batch batch;
+	struct fme_pr_batch_port *ports;
+	int order[MAX_FPGA_PORT_NUM];
+	struct fme_pr_user img;
+	struct fpga_manager *mgr;
+	struct fpga_fme *fme;
+	unsigned long minsz;
+	size_t size;
+	u32 i;
+	int ret;
+
+	minsz = offsetofend(struct fpga_fme_port_pr_batch, padding);
+
+	if (copy_from_user(&batch, argp, minsz))
+		return -EFAULT;
+
+	if (batch.argsz < minsz || batch.flags || !batch.count ||
+	    batch.count > MAX_FPGA_PORT_NUM)
+		return -EINVAL;
+
+	size = batch.count * sizeof(*entries);
+	if (batch.argsz < minsz + size)
+		return -EINVAL;
+
+	/* fme device has been unregistered. */
+	fme = fme_pr_get(pdata);
+	if (!fme)
+		return -EINVAL;
+
+	entries = memdup_user(argp + minsz, size);
+	if (IS_ERR(entries)) {
+		ret = PTR_ERR(entries);
+		goto put_fme;
+	}
+
+	ports = kcalloc(batch.count, sizeof(*ports), GFP_KERNEL);
+	if (!ports) {
+		ret = -ENOMEM;
+		goto free_entries;
+	}
+
+	/* validate every image before any port is touched */
+	for (i = 0; i < batch.count; i++) {
+		e = &entries[i];
+		e->status = 0;
+		e->result = fme_pr_batch_check(pdev, entries, i, &img);
+		if (!e->result)
+			fme_pr_user_fini(&img);
+		ports[i].ready = !e->result;
+	}
+
+	fme_pr_batch_order(entries, order, batch.count);
+
+	mutex_lock(&fme->pr_lock);
+	mgr = fpga_mgr_get(&pdev->dev);
+
+	for (i = 0; i < batch.count; i++) {
+		if (!ports[i].ready)
+			continue;
+
+		if (IS_ERR(mgr)) {
+			entries[i].result = PTR_ERR(mgr);
+		} else {
+			ports[i].port = fme_pr_get_port(pdev,
+							entries[i].port_id);
+			if (WARN_ON(!ports[i].port))
+				entries[i].result = -ENODEV;
+		}
+
+		if (entries[i].result) {
+			ports[i].ready = false;
+			continue;
+		}
+
+		/* Disable Port before PR, the acks are collected below */
+		ports[i].wait = fpga_port_disable_begin(ports[i].port);
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (!ports[i].ready || !ports[i].wait)
+			continue;
+
+		/* the port didn't drain, don't program it. */
+		entries[i].result = fpga_port_disable_wait(ports[i].port);
+		if (entries[i].result) {
+			fpga_port_enable(ports[i].port);
+			put_device(&ports[i].port->dev);
+			ports[i].ready = false;
+		}
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		struct fme_pr_batch_port *p = &ports[order[i]];
+
+		if (!p->ready)
+			continue;
+
+		/* stream the image only now, it may have changed meanwhile. */
+		e = &entries[order[i]];
+		e->result = fme_pr_batch_check(pdev, entries, order[i], &img);
+		if (!e->result) {
+			e->result = fme_pr_load_port(fme, mgr, e->port_id,
+						     fme_pr_user_load, &img,
+						     &e->status);
+			fme_pr_user_fini(&img);
+		}
+
+		/* Re-enable Port after PR finished */
+		fpga_port_enable(p->port);
+		put_device(&p->port->dev);
+	}
+
+	if (!IS_ERR(mgr))
+		fpga_mgr_put(mgr);
+	mutex_unlock(&fme->pr_lock);
+
+	ret = 0;
+	if (copy_to_user(argp + minsz, entries, size))
+		ret = -EFAULT;
+
+	kfree(ports);
+free_entries:
+	kfree(entries);
+put_fme:
+	fme_pr_put(pdata, fme);
+	return ret;
+}
+
+struct fme_pr_firmware {
+	const struct firmware *fw;
+	struct fme_pr_gbs gbs;
+};
+
+static int fme_pr_firmware_load(struct fpga_manager *mgr,
+				struct fpga_image_info *info, void *priv)
+{
+	struct fme_pr_firmware *image = priv;
+	const char *data = (const char *)image->fw->data;
+
+	return fpga_mgr_buf_load(mgr, info, data + image->gbs.offset,
+				 image->gbs.size);
+}
+
+/* reconfigure a port from an image on the firmware search path */
+static int fme_pr_firmware(struct platform_device *pdev, u32 port_id,
+			   const char *image_name, u64 *status)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fme_pr_firmware image;
+	struct fpga_fme *fme;
+	int ret;
+
+	/* only plain names relative to the firmware search path. */
+	if (!*image_name || strstr(image_name, ".."))
+		return -EINVAL;
+
+	ret = fme_pr_check_port(pdev, port_id);
+	if (ret)
+		return ret;
+
+	/* fme device has been unregistered. */
+	fme = fme_pr_get(pdata);
+	if (!fme)
+		return -EINVAL;
+
+	/* the image is read before the port is disabled, to check it. */
+	ret = request_firmware(&image.fw, image_name, &pdev->dev);
+	if (ret)
+		goto put_fme;
+
+	ret = fme_pr_gbs_parse(image.fw->data, image.fw->size, &image.gbs);
+	if (!ret && !image.gbs.size)
+		ret = -EINVAL;
+	if (!ret)
+		ret = fme_pr_program(pdev, fme, port_id, &image.gbs,
+				     fme_pr_firmware_load, &image, status);
+
+	release_firmware(image.fw);
+put_fme:
+	fme_pr_put(pdata, fme);
+	return ret;
+}
+
+static int fme_pr_firmware_ioctl(struct platform_device *pdev,
+				 unsigned long arg)
+{
+	struct fpga_fme_port_pr_firmware port_pr;
+	unsigned long minsz;
+	char *image_name;
+	int ret;
+
+	minsz = offsetofend(struct fpga_fme_port_pr_firmware, status);
+
+	if (copy_from_user(&port_pr, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (port_pr.argsz < minsz || port_pr.flags)
+		return -EINVAL;
+
+	image_name = strndup_user((const char __user *)(unsigned long)
+				  port_pr.image_name, PATH_MAX);
+	if (IS_ERR(image_name))
+		return PTR_ERR(image_name);
+
+	port_pr.status = 0;
+	ret = fme_pr_firmware(pdev, port_pr.port_id, image_name,
+			      &port_pr.status);
+	kfree(image_name);
+
+	if (copy_to_user((void __user *)arg, &port_pr, minsz))
+		return -EFAULT;
+	return ret;
+}
+
+/*
+ * Asynchronous PR: the ioctl only validates the request and starts the
+ * stream on the caller's mm, the PR itself runs on a worker which doesn't
+ * hold pdata->lock, so other FME ioctls are not blocked during the PR.
+ */
+struct fme_pr_async {
+	struct fpga_fme *fme;
+	struct work_struct work;
+	struct fme_pr_user img;
+	struct eventfd_ctx *trigger;
+	u32 port_id;
+
+	/* protect the state, result and status below */
+	spinlock_t lock;
+	u32 state;
+	int result;
+	u64 status;
+	wait_queue_head_t wq;
+};
+
+static void fme_pr_async_work(struct work_struct *work)
+{
+	struct fme_pr_async *async = container_of(work, struct fme_pr_async,
+						  work);
+	struct fpga_fme *fme = async->fme;
+	struct eventfd_ctx *trigger;
+	u64 status = 0;
+	int ret;
+
+	ret = fme_pr_program(fme->pdata->dev, fme, async->port_id,
+			     &async->img.gbs, fme_pr_user_load, &async->img,
+			     &status);
+	fme_pr_user_fini(&async->img);
+
+	/* a new request may be queued as soon as the state is DONE. */
+	trigger = async->trigger;
+	async->trigger = NULL;
+
+	spin_lock_irq(&async->lock);
+	async->result = ret;
+	async->status = status;
+	async->state = FPGA_FME_PR_STATE_DONE;
+	spin_unlock_irq(&async->lock);
+
+	if (trigger) {
+		eventfd_signal(trigger, 1);
+		eventfd_ctx_put(trigger);
+	}
+
+	wake_up_interruptible(&async->wq);
+}
+
+static int fme_pr_async(struct platform_device *pdev, unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme_port_pr_async port_pr;
+	struct eventfd_ctx *trigger = NULL;
+	struct fme_pr_async *async;
+	struct fpga_fme *fme;
+	unsigned long minsz;
+	int ret = 0;
+
+	minsz = offsetofend(struct fpga_fme_port_pr_async, evtfd);
+
+	if (copy_from_user(&port_pr, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (port_pr.argsz < minsz || port_pr.flags & ~FPGA_FME_PR_COMPRESS_MASK)
+		return -EINVAL;
+
+	if (port_pr.evtfd >= 0) {
+		trigger = eventfd_ctx_fdget(port_pr.evtfd);
+		if (IS_ERR(trigger))
+			return PTR_ERR(trigger);
+	}
+
+	/* fme device has been unregistered. */
+	fme = fme_pr_get(pdata);
+	if (!fme) {
+		ret = -EINVAL;
+		goto put_trigger;
+	}
+
+	/* the BUSY state reserves the request for this caller. */
+	async = fme->pr_async;
+	spin_lock_irq(&async->lock);
+	if (async->state == FPGA_FME_PR_STATE_BUSY)
+		ret = -EBUSY;
+	else
+		async->state = FPGA_FME_PR_STATE_BUSY;
+	spin_unlock_irq(&async->lock);
+	if (ret)
+		goto put_fme;
+
+	/*
+	 * the worker has no mm, grab the caller's one here. This may
+	 * decompress the head of the image, so pdata->lock isn't held.
+	 */
+	ret = fme_pr_user_init(pdev, &async->img, port_pr.port_id,
+			       port_pr.buffer_address, port_pr.buffer_size,
+			       port_pr.flags);
+	if (ret) {
+		spin_lock_irq(&async->lock);
+		async->state = FPGA_FME_PR_STATE_IDLE;
+		spin_unlock_irq(&async->lock);
+		goto put_fme;
+	}
+
+	async->trigger = trigger;
+	async->port_id = port_pr.port_id;
+	queue_work(system_unbound_wq, &async->work);
+	trigger = NULL;
+put_fme:
+	fme_pr_put(pdata, fme);
+put_trigger:
+	if (trigger)
+		eventfd_ctx_put(trigger);
+	return ret;
+}
+
+static int fme_pr_async_status(struct platform_device *pdev,
+			       unsigned long arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme_port_pr_status pr_status;
+	struct fme_pr_async *async;
+	struct fpga_fme *fme;
+	unsigned long minsz;
+
+	minsz = offsetofend(struct fpga_fme_port_pr_status, status);
+
+	if (copy_from_user(&pr_status, (void __user *)arg, minsz))
+		return -EFAULT;
+
+	if (pr_status.argsz < minsz || pr_status.flags)
+		return -EINVAL;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	/* fme device has been unregistered. */
+	if (!fme) {
+		mutex_unlock(&pdata->lock);
+		return -EINVAL;
+	}
+
+	async = fme->pr_async;
+	spin_lock_irq(&async->lock);
+	pr_status.state = async->state;
+	pr_status.port_id = async->port_id;
+	pr_status.result = async->result;
+	pr_status.status = async->status;
+	/* the result is reported only once. */
+	if (async->state == FPGA_FME_PR_STATE_DONE)
+		async->state = FPGA_FME_PR_STATE_IDLE;
+	spin_unlock_irq(&async->lock);
+	mutex_unlock(&pdata->lock);
+
+	if (copy_to_user((void __user *)arg, &pr_status, minsz))
+		return -EFAULT;
+
+	return 0;
+}
+
+unsigned int fme_pr_poll(struct feature_platform_data *pdata,
+			 struct file *filp, poll_table *wait)
+{
+	struct fme_pr_async *async;
+	struct fpga_fme *fme;
+	unsigned int mask = 0;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	async = fme ? fme->pr_async : NULL;
+	mutex_unlock(&pdata->lock);
+
+	if (!async)
+		return POLLERR;
+
+	poll_wait(filp, &async->wq, wait);
+
+	spin_lock_irq(&async->lock);
+	if (async->state == FPGA_FME_PR_STATE_DONE)
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock_irq(&async->lock);
+
+	return mask;
+}
+
+static int fpga_fme_pr_probe(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct feature_fme_pr *fme_pr;
+	struct feature_header fme_pr_header;
+	struct fme_pr_async *async;
+	struct fpga_fme *priv;
+	int ret;
+
+	async = devm_kzalloc(&pdev->dev, sizeof(*async), GFP_KERNEL);
+	if (!async)
+		return -ENOMEM;
+
+	mutex_lock(&pdata->lock);
+	priv = fpga_pdata_get_private(pdata);
+
+	mutex_init(&priv->pr_lock);
+	init_waitqueue_head(&priv->pr_users_wq);
+	spin_lock_init(&priv->pr_history_lock);
+
+	async->fme = priv;
+	INIT_WORK(&async->work, fme_pr_async_work);
+	spin_lock_init(&async->lock);
+	init_waitqueue_head(&async->wq);
+	priv->pr_async = async;
+
+	fme_pr = get_feature_ioaddr_by_index(&pdev->dev,
+				FME_FEATURE_ID_PR_MGMT);
+
+	fme_pr_header.csr = readq(&fme_pr->header);
+	if (fme_pr_header.revision == 2)
+		priv->pr_copy = fme_pr_select_copy();
+
+	if (priv->pr_copy) {
+		dev_dbg(&pdev->dev, "using 512-bit PR (%s)\n",
+			priv->pr_copy->name);
+		priv->pr_bandwidth = 64;
+	} else {
+		dev_dbg(&pdev->dev, "using 32-bit PR\n");
+		priv->pr_bandwidth = 4;
+	}
+
+	ret = fme_pr_cache_init(priv);
+	if (ret)
+		goto unlock_exit;
+
+	ret = fpga_mgr_register(&pdata->dev->dev,
+		"Intel FPGA Manager", &fme_pr_ops, priv);
+	if (ret)
+		fme_pr_cache_uinit(priv);
+unlock_exit:
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
+static int fpga_fme_pr_remove(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *priv = fpga_pdata_get_private(pdata);
+
+	/* no new PR from now on, wait for those running without the lock. */
+	mutex_lock(&pdata->lock);
+	priv->pr_dying = true;
+	mutex_unlock(&pdata->lock);
+	wait_event(priv->pr_users_wq, !READ_ONCE(priv->pr_users));
+
+	/* wait for the asynchronous PR, it uses the FPGA manager. */
+	flush_work(&priv->pr_async->work);
+	fpga_mgr_unregister(&pdev->dev);
+	fme_pr_cache_uinit(priv);
+	return 0;
+}
+
+static int pr_mgmt_init(struct platform_device *pdev, struct feature *feature)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	int ret;
+
+	ret = fpga_fme_pr_probe(pdev);
+	if (ret)
+		return ret;
+
+	ret = sysfs_create_group(&pdev->dev.kobj, &pr_mgmt_attr_group);
+	if (ret) {
+		fpga_fme_pr_remove(pdev);
+		return ret;
+	}
+
+	/* removed with the device debugfs directory */
+	if (!IS_ERR_OR_NULL(pdata->debugfs))
+		debugfs_create_file("pr_history", 0400, pdata->debugfs,
+				    fpga_pdata_get_private(pdata),
+				    &fme_pr_history_fops);
+
+	return 0;
+}
+
+static void pr_mgmt_uinit(struct platform_device *pdev, struct feature *feature)
+{
+	sysfs_remove_group(&pdev->dev.kobj, &pr_mgmt_attr_group);
+	fpga_fme_pr_remove(pdev);
+}
+
+static long fme_pr_ioctl(struct platform_device *pdev, struct feature *feature,
+	unsigned int cmd, unsigned long arg)
+{
+	long ret;
+
+	switch (cmd) {
+	case FPGA_FME_PORT_PR:
+		ret = fme_pr(pdev, arg);
+		break;
+	case FPGA_FME_PORT_PR_ASYNC:
+		ret = fme_pr_async(pdev, arg);
+		break;
+	case FPGA_FME_PORT_PR_STATUS:
+		ret = fme_pr_async_status(pdev, arg);
+		break;
+	case FPGA_FME_PR_CACHE_ADD:
+		ret = fme_pr_cache_add(pdev, arg);
+		break;
+	case FPGA_FME_PORT_PR_CACHED:
+		ret = fme_pr_cache_program(pdev, arg);
+		break;
+	case FPGA_FME_PORT_PR_FIRMWARE:
+		ret = fme_pr_firmware_ioctl(pdev, arg);
+		break;
+	case FPGA_FME_PORT_PR_BATCH:
+		ret = fme_pr_batch(pdev, arg);
 		break;
 	default:
 		ret = -ENODEV;
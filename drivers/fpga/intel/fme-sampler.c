@@ -0,0 +1,332 @@
+/*
+ * Driver for FPGA Global Performance Counter Sampling
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+#include <linux/stddef.h> /* offsetofend */
+#include <linux/vfio.h> /* offsetofend in pre-4.1.0 kernels */
+#include <linux/intel-fpga.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+/* bounds of the sampler configuration */
+#define SAMPLER_MIN_PERIOD_MS	1
+#define SAMPLER_MAX_RING_PAGES	1024
+
+/*
+ * The ring is refcounted, a mapping may outlive the sampler which filled
+ * it.
+ */
+struct fme_sampler_ring {
+	struct kref kref;
+	struct fpga_fme_perf_ring *hdr;	/* vmalloc_user(), whole ring */
+	size_t size;
+};
+
+struct fme_sampler {
+	struct hrtimer timer;
+	struct work_struct work;
+	ktime_t period;
+	struct device *fme_dev;
+	struct fpga_fme *fme;
+	struct file *owner;
+	struct fme_sampler_ring *ring;
+	bool reverse;			/* read the events backwards */
+	u32 nr_events;
+	u64 events[FPGA_FME_PERF_SAMPLER_EVENTS];
+};
+
+static void fme_sampler_ring_release(struct kref *kref)
+{
+	struct fme_sampler_ring *ring = container_of(kref,
+					struct fme_sampler_ring, kref);
+
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+static void fme_sampler_ring_put(struct fme_sampler_ring *ring)
+{
+	kref_put(&ring->kref, fme_sampler_ring_release);
+}
+
+/*
+ * Take one sample. The counter reads busy-wait for the event select to
+ * switch, so this runs in a work queued by the timer rather than in the
+ * timer itself, and perf_lock is only held for one event at a time.
+ */
+static void fme_sampler_work(struct work_struct *work)
+{
+	struct fme_sampler *s = container_of(work, struct fme_sampler, work);
+	struct fpga_fme_perf_ring *hdr = s->ring->hdr;
+	struct fpga_fme_perf_sample *sample;
+	unsigned long flags;
+	u64 head = hdr->head;
+	u32 n, i;
+
+	sample = (void *)hdr + hdr->data_offset +
+		 (size_t)do_div(head, hdr->nr_samples) * hdr->sample_size;
+
+	sample->time_ns = ktime_to_ns(ktime_get());
+	sample->valid = 0;
+
+	spin_lock_irqsave(&s->fme->perf_lock, flags);
+	sample->clock = fme_perf_read_clock(s->fme_dev);
+	spin_unlock_irqrestore(&s->fme->perf_lock, flags);
+
+	/*
+	 * Every other sample reads the events backwards. The event select
+	 * of a block is left on the last of its events read, which is then
+	 * read first and needs no switch.
+	 */
+	for (n = 0; n < s->nr_events; n++) {
+		i = s->reverse ? s->nr_events - 1 - n : n;
+		spin_lock_irqsave(&s->fme->perf_lock, flags);
+		if (!fme_perf_read_config(s->fme_dev, s->events[i],
+					  &sample->counters[i]))
+			sample->valid |= BIT(i);
+		spin_unlock_irqrestore(&s->fme->perf_lock, flags);
+	}
+	s->reverse = !s->reverse;
+
+	/* publish the sample before the head moves past it */
+	smp_wmb();
+	WRITE_ONCE(hdr->head, hdr->head + 1);
+}
+
+/* a tick is skipped if the previous sample is still being taken. */
+static enum hrtimer_restart fme_sampler_timer(struct hrtimer *timer)
+{
+	struct fme_sampler *s = container_of(timer, struct fme_sampler, timer);
+
+	queue_work(system_highpri_wq, &s->work);
+
+	hrtimer_forward_now(timer, s->period);
+	return HRTIMER_RESTART;
+}
+
+static struct fme_sampler_ring *
+fme_sampler_ring_create(struct fpga_fme_perf_sampler *cfg)
+{
+	struct fme_sampler_ring *ring;
+	struct fpga_fme_perf_ring *hdr;
+	size_t sample_size;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	ring->size = (size_t)cfg->ring_pages << PAGE_SHIFT;
+	hdr = vmalloc_user(ring->size);
+	if (!hdr) {
+		kfree(ring);
+		return NULL;
+	}
+
+	sample_size = sizeof(struct fpga_fme_perf_sample) +
+		      cfg->nr_events * sizeof(u64);
+
+	kref_init(&ring->kref);
+	hdr->data_offset = PAGE_SIZE;
+	hdr->sample_size = sample_size;
+	hdr->nr_samples = (ring->size - PAGE_SIZE) / sample_size;
+	hdr->nr_events = cfg->nr_events;
+	memcpy(hdr->events, cfg->events, cfg->nr_events * sizeof(u64));
+	ring->hdr = hdr;
+
+	return ring;
+}
+
+/* stop the sampler, pdata->lock held. */
+static void __fme_sampler_stop(struct fpga_fme *fme)
+{
+	struct fme_sampler *s = fme->sampler;
+
+	fme->sampler = NULL;
+	hrtimer_cancel(&s->timer);
+	cancel_work_sync(&s->work);
+	fme_sampler_ring_put(s->ring);
+	kfree(s);
+}
+
+int fme_sampler_start(struct platform_device *pdev, struct file *filp,
+		      void __user *arg)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme_perf_sampler cfg;
+	struct fme_sampler *s;
+	struct fpga_fme *fme;
+	unsigned long minsz;
+	int i, ret = 0;
+
+	minsz = offsetofend(struct fpga_fme_perf_sampler, events);
+
+	if (copy_from_user(&cfg, arg, minsz))
+		return -EFAULT;
+
+	if (cfg.argsz < minsz || cfg.flags ||
+	    cfg.period_ms < SAMPLER_MIN_PERIOD_MS ||
+	    !cfg.nr_events || cfg.nr_events > FPGA_FME_PERF_SAMPLER_EVENTS ||
+	    cfg.ring_pages < 2 || cfg.ring_pages > SAMPLER_MAX_RING_PAGES)
+		return -EINVAL;
+
+	for (i = 0; i < cfg.nr_events; i++)
+		if (!fme_perf_config_valid(&pdev->dev, cfg.events[i]))
+			return -EINVAL;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	s->ring = fme_sampler_ring_create(&cfg);
+	if (!s->ring) {
+		kfree(s);
+		return -ENOMEM;
+	}
+
+	s->fme_dev = &pdev->dev;
+	s->owner = filp;
+	s->period = ms_to_ktime(cfg.period_ms);
+	s->nr_events = cfg.nr_events;
+	memcpy(s->events, cfg.events, sizeof(s->events));
+	INIT_WORK(&s->work, fme_sampler_work);
+	hrtimer_init(&s->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	s->timer.function = fme_sampler_timer;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (fme->sampler) {
+		ret = -EBUSY;
+	} else {
+		s->fme = fme;
+		fme->sampler = s;
+		hrtimer_start(&s->timer, s->period, HRTIMER_MODE_REL);
+	}
+	mutex_unlock(&pdata->lock);
+
+	if (ret) {
+		fme_sampler_ring_put(s->ring);
+		kfree(s);
+	}
+
+	return ret;
+}
+
+int fme_sampler_stop(struct platform_device *pdev, struct file *filp)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme;
+	int ret = 0;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (!fme->sampler)
+		ret = -EINVAL;
+	else if (fme->sampler->owner != filp)
+		ret = -EPERM;
+	else
+		__fme_sampler_stop(fme);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
+/* the sampler goes with the file which started it. */
+void fme_sampler_release(struct platform_device *pdev, struct file *filp)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (fme && fme->sampler && fme->sampler->owner == filp)
+		__fme_sampler_stop(fme);
+	mutex_unlock(&pdata->lock);
+}
+
+void fme_sampler_uinit(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (fme->sampler)
+		__fme_sampler_stop(fme);
+	mutex_unlock(&pdata->lock);
+}
+
+static void fme_sampler_vm_open(struct vm_area_struct *vma)
+{
+	struct fme_sampler_ring *ring = vma->vm_private_data;
+
+	kref_get(&ring->kref);
+}
+
+static void fme_sampler_vm_close(struct vm_area_struct *vma)
+{
+	fme_sampler_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct fme_sampler_vm_ops = {
+	.open = fme_sampler_vm_open,
+	.close = fme_sampler_vm_close,
+};
+
+int fme_sampler_mmap(struct platform_device *pdev,
+		     struct vm_area_struct *vma)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fme_sampler_ring *ring = NULL;
+	struct fpga_fme *fme;
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_flags & VM_WRITE)
+		return -EINVAL;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (fme->sampler) {
+		ring = fme->sampler->ring;
+		kref_get(&ring->kref);
+	}
+	mutex_unlock(&pdata->lock);
+
+	if (!ring)
+		return -ENODEV;
+
+	if (vma->vm_end - vma->vm_start > ring->size) {
+		ret = -EINVAL;
+		goto put_exit;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	ret = remap_vmalloc_range(vma, ring->hdr, 0);
+	if (ret)
+		goto put_exit;
+
+	/* the reference taken above now belongs to the mapping */
+	vma->vm_private_data = ring;
+	vma->vm_ops = &fme_sampler_vm_ops;
+	return 0;
+
+put_exit:
+	fme_sampler_ring_put(ring);
+	return ret;
+}
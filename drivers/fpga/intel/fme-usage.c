@@ -0,0 +1,191 @@
+/*
+ * Driver for FPGA Global Performance Counter Usage Accounting
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/intel-fpga.h>
+#include "backport.h"
+
+#include "feature-dev.h"
+#include "fme.h"
+
+/*
+ * The counters of the FME are global, a port is only charged with what
+ * can be attributed to it: the fabric counters as long as they count for
+ * the port, see fme_read_port_usage(). The cache counters are shared by
+ * all ports and are not charged to any. The port files are accounted by
+ * the port driver through read_port_usage, the jobs run on a released
+ * port, e.g. in a VM through its VF, are accounted here between port
+ * release and assign.
+ */
+
+static int fme_usage_nr_ports(struct device *fme_dev)
+{
+	struct feature_fme_capability fme_capability;
+	struct feature_fme_header *fme_hdr;
+
+	fme_hdr = get_feature_ioaddr_by_index(fme_dev, FME_FEATURE_ID_HEADER);
+	fme_capability.csr = readq(&fme_hdr->capability);
+
+	return fme_capability.num_ports;
+}
+
+/*
+ * Read the fabric counters with the port filter @filter, which was in
+ * use with fme->perf_fab_seq @seq. perf_lock is only held for one event
+ * at a time, so irqs are not kept off for the whole snapshot; false if
+ * the filter changed meanwhile.
+ */
+static bool fme_usage_read_fabric(struct device *fme_dev, u64 filter,
+				  u32 seq, u64 *counter)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(fme_dev);
+	unsigned long flags;
+	bool same = true;
+	u64 config;
+	int event;
+
+	for (event = 0; same && event < FPGA_PORT_USAGE_EVENTS; event++) {
+		config = FPGA_FME_PERF_CONFIG(FPGA_FME_PERF_BLOCK_FABRIC,
+					      event);
+		if (!fme_perf_config_valid(fme_dev, config))
+			continue;
+
+		spin_lock_irqsave(&fme->perf_lock, flags);
+		same = fme->perf_fab_seq == seq;
+		if (same)
+			fme_perf_read_config(fme_dev, config | filter,
+					     &counter[event]);
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+	}
+
+	return same;
+}
+
+/*
+ * Snapshot the counters attributed to @port_id, pdata->lock held. The
+ * fabric counters are those of the multiplexer if it runs, or else those
+ * of the port filter if it is on the port. Without a filter they count
+ * for the port too if it is the only one.
+ */
+static int fme_read_port_usage(struct platform_device *pdev, int port_id,
+			       struct fpga_port_usage_snap *snap)
+{
+	struct fpga_fme *fme = fme_perf_get_fme(&pdev->dev);
+	struct fpga_port_usage *c = &snap->counters;
+	struct device *dev = &pdev->dev;
+	unsigned long flags;
+	u64 filter;
+	int fab_port;
+	u32 seq;
+
+	if (!is_feature_present(dev, FME_FEATURE_ID_GLOBAL_IPERF) &&
+	    !is_feature_present(dev, FME_FEATURE_ID_GLOBAL_DPERF))
+		return -ENODEV;
+
+	memset(snap, 0, sizeof(*snap));
+	c->time_ns = ktime_get_ns();
+
+	spin_lock_irqsave(&fme->perf_lock, flags);
+	if (fme_fab_mux_read_port(fme, port_id, c->fabric, &snap->fab_key)) {
+		spin_unlock_irqrestore(&fme->perf_lock, flags);
+		c->valid |= FPGA_PORT_USAGE_FABRIC;
+		return 0;
+	}
+
+	fab_port = fme_perf_get_fabric_port(dev);
+	seq = fme->perf_fab_seq;
+	spin_unlock_irqrestore(&fme->perf_lock, flags);
+
+	if (fab_port == port_id)
+		filter = FPGA_FME_PERF_PORT(port_id);
+	else if (fab_port == PERF_OBJ_ROOT_ID && fme_usage_nr_ports(dev) == 1)
+		filter = 0;
+	else
+		return 0;
+
+	if (fme_usage_read_fabric(dev, filter, seq, c->fabric)) {
+		snap->fab_key = seq;
+		c->valid |= FPGA_PORT_USAGE_FABRIC;
+	}
+
+	return 0;
+}
+
+/* @port_id was released, start accounting the job it runs meanwhile. */
+void fme_port_usage_release(struct platform_device *pdev, int port_id)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct fpga_fme *fme;
+
+	if (port_id >= MAX_FPGA_PORT_NUM)
+		return;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	if (!fme_read_port_usage(pdev, port_id, &fme->port_job[port_id]))
+		__set_bit(port_id, &fme->port_released);
+	mutex_unlock(&pdata->lock);
+}
+
+/* @port_id was assigned back, charge it with the job it ran. */
+void fme_port_usage_assign(struct platform_device *pdev, int port_id)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	struct feature_platform_data *port_pdata;
+	struct fpga_port_usage_snap end;
+	struct platform_device *port_dev;
+	struct fpga_port_usage delta;
+	struct fpga_fme *fme;
+	bool released;
+
+	mutex_lock(&pdata->lock);
+	fme = fpga_pdata_get_private(pdata);
+	released = __test_and_clear_bit(port_id, &fme->port_released);
+	if (released && !fme_read_port_usage(pdev, port_id, &end))
+		fpga_port_usage_delta(&fme->port_job[port_id], &end, &delta);
+	else
+		released = false;
+	mutex_unlock(&pdata->lock);
+
+	if (!released)
+		return;
+
+	port_dev = pdata->fpga_for_each_port(pdev, &port_id,
+					     fpga_port_check_id);
+	if (!port_dev)
+		return;
+
+	port_pdata = dev_get_platdata(&port_dev->dev);
+	mutex_lock(&port_pdata->lock);
+	fpga_port_usage_account(port_pdata, &delta, true);
+	mutex_unlock(&port_pdata->lock);
+
+	put_device(&port_dev->dev);
+}
+
+void fme_port_usage_init(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+
+	mutex_lock(&pdata->lock);
+	pdata->read_port_usage = fme_read_port_usage;
+	mutex_unlock(&pdata->lock);
+}
+
+void fme_port_usage_uinit(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+
+	mutex_lock(&pdata->lock);
+	pdata->read_port_usage = NULL;
+	mutex_unlock(&pdata->lock);
+}
@@ -353,6 +353,34 @@ exit:
 	return port_dev;
 }
 
+/*
+ * The FME counters are read by the FME driver, which may not be loaded,
+ * and there is no FME at all on a VF.
+ */
+static int
+port_read_usage(struct platform_device *pdev, struct fpga_port_usage_snap *snap)
+{
+	struct device *pci_dev = fpga_feature_dev_to_pcidev(pdev);
+	struct cci_drvdata *drvdata = dev_get_drvdata(pci_dev);
+	struct feature_platform_data *pdata;
+	struct platform_device *fme_pdev;
+	int port_id, ret = -ENODEV;
+
+	if (!drvdata->fme_dev)
+		return -ENODEV;
+
+	fme_pdev = to_platform_device(drvdata->fme_dev);
+	pdata = dev_get_platdata(&fme_pdev->dev);
+	port_id = fpga_port_id(pdev);
+
+	mutex_lock(&pdata->lock);
+	if (pdata->read_port_usage)
+		ret = pdata->read_port_usage(fme_pdev, port_id, snap);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
 static struct build_feature_devs_info *
 build_info_alloc_and_init(struct pci_dev *pdev)
 {
@@ -457,6 +485,8 @@ build_info_create_dev(struct build_feature_devs_info *binfo,
 	if (type == FME_ID) {
 		pdata->config_port = config_port;
 		pdata->fpga_for_each_port = fpga_for_each_port;
+	} else {
+		pdata->read_usage = port_read_usage;
 	}
 
 	/*
@@ -589,12 +619,21 @@ build_info_add_sub_feature(struct build_feature_devs_info *binfo,
 		if (!ctx)
 			return -ENOMEM;
 
-		for (i = 0; i < vec_cnt; i++)
+		for (i = 0; i < vec_cnt; i++) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
 			ctx[i].irq = msix_entries[vec_start + i].vector;
 #else
 			ctx[i].irq = pci_irq_vector(binfo->pdev, vec_start + i);
 #endif
+			/*
+			 * Spread the vectors over the cpus of the device's
+			 * numa node first, as PCI_IRQ_AFFINITY would do, but
+			 * leave them unmanaged so they can still be pinned.
+			 */
+			ctx[i].default_cpu = cpumask_local_spread(vec_start + i,
+					dev_to_node(&binfo->pdev->dev));
+			ctx[i].cpu = ctx[i].default_cpu;
+		}
 	}
 
 	feature_platform_data_add(pdata, feature_id, feature_name, feature_id,
@@ -1454,6 +1493,7 @@ static int __init ccidrv_init(void)
 	pr_info("Intel(R) FPGA PCIe Driver: Version %s\n", DRV_VERSION);
 
 	fpga_ids_init();
+	fpga_debugfs_init();
 
 	ret = fpga_chardev_init();
 	if (ret)
@@ -1471,6 +1511,7 @@ static int __init ccidrv_init(void)
 exit_chardev:
 		fpga_chardev_uinit();
 exit_ids:
+		fpga_debugfs_uinit();
 		fpga_ids_destroy();
 	}
 
@@ -1482,6 +1523,7 @@ static void __exit ccidrv_exit(void)
 	pci_unregister_driver(&cci_pci_driver);
 	class_destroy(fpga_class);
 	fpga_chardev_uinit();
+	fpga_debugfs_uinit();
 	fpga_ids_destroy();
 }
 
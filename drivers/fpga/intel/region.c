@@ -76,6 +76,24 @@ exit:
 	return ret;
 }
 
+void afu_region_remove(struct feature_platform_data *pdata, u32 region_index)
+{
+	struct fpga_afu_region *region;
+	struct fpga_afu *afu;
+
+	mutex_lock(&pdata->lock);
+	afu = fpga_pdata_get_private(pdata);
+	region = get_region_by_index(afu, region_index);
+	if (region) {
+		list_del(&region->node);
+		afu->num_regions--;
+	}
+	mutex_unlock(&pdata->lock);
+
+	if (region)
+		devm_kfree(&pdata->dev->dev, region);
+}
+
 void afu_region_destroy(struct feature_platform_data *pdata)
 {
 	struct fpga_afu_region *tmp, *region;
@@ -20,6 +20,8 @@
 #ifndef __INTEL_AFU_H
 #define __INTEL_AFU_H
 
+#include <linux/kref.h>
+
 #include "backport.h"
 #include "feature-dev.h"
 
@@ -41,6 +43,13 @@ struct fpga_afu_dma_region {
 	bool in_use;
 };
 
+/* UAFU interrupt status pages, also held by their user mappings */
+struct fpga_afu_uint_pages {
+	struct kref kref;
+	struct page *page;
+	unsigned int order;
+};
+
 struct fpga_afu {
 	u64 region_cur_offset;
 	u32 capability;
@@ -50,12 +59,26 @@ struct fpga_afu {
 	struct list_head regions;
 	struct rb_root dma_regions;
 
+	/* UAFU interrupt busy-poll status page and per-vector mode */
+	struct fpga_port_uint_status *uint_status;
+	struct fpga_afu_uint_pages *uint_pages;
+	dma_addr_t uint_status_iova;
+	u8 *uint_mode;
+
 	struct feature_platform_data *pdata;
 };
 
+/* an open port file */
+struct fpga_afu_file {
+	struct platform_device *pdev;
+	/* the FME counters when the file was opened */
+	struct fpga_port_usage_snap usage;
+};
+
 void afu_region_init(struct feature_platform_data *pdata);
 int afu_region_add(struct feature_platform_data *pdata, u32 region_index,
 		   u64 region_size, u64 phys, u32 flags);
+void afu_region_remove(struct feature_platform_data *pdata, u32 region_index);
 void afu_region_destroy(struct feature_platform_data *pdata);
 int afu_get_region_by_index(struct feature_platform_data *pdata,
 			    u32 region_index, struct fpga_afu_region *pregion);
@@ -71,6 +94,13 @@ long afu_dma_unmap_region(struct feature_platform_data *pdata, u64 iova);
 struct fpga_afu_dma_region *afu_dma_region_find(
 		struct feature_platform_data *pdata, u64 iova, u64 size);
 
+void afu_usage_read(struct platform_device *pdev,
+		    struct fpga_port_usage_snap *snap);
+long afu_ioctl_get_usage(struct fpga_afu_file *afile, void __user *arg);
+void afu_usage_release(struct fpga_afu_file *afile);
+int afu_usage_init(struct platform_device *pdev);
+void afu_usage_uinit(struct platform_device *pdev);
+
 int port_hdr_test(struct platform_device *pdev, struct feature *feature);
 int port_err_test(struct platform_device *pdev, struct feature *feature);
 int port_umsg_test(struct platform_device *pdev, struct feature *feature);
@@ -79,6 +79,70 @@ extern void sysfs_remove_groups(struct kobject *kobj,
 				const struct attribute_group **groups);
 #endif /* LINUX_VERSION_CODE */
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+
+/* pick the i-th cpu, preferring the cpus local to the given numa node */
+static inline unsigned int cpumask_local_spread(unsigned int i, int node)
+{
+	unsigned int cpu, n = i % num_online_cpus();
+
+	if (node != NUMA_NO_NODE) {
+		for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask)
+			if (n-- == 0)
+				return cpu;
+
+		for_each_online_cpu(cpu)
+			if (!cpumask_test_cpu(cpu, cpumask_of_node(node)) &&
+			    n-- == 0)
+				return cpu;
+	} else {
+		for_each_online_cpu(cpu)
+			if (n-- == 0)
+				return cpu;
+	}
+
+	return cpumask_first(cpu_online_mask);
+}
+#endif /* LINUX_VERSION_CODE */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+#define for_each_sibling_event(sibling, event)				 \
+	list_for_each_entry((sibling), &(event)->sibling_list, group_entry)
+#endif /* LINUX_VERSION_CODE */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+
+/* kmalloc, falling back to vmalloc for a large array */
+static inline void *kvmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	void *p;
+
+	if (size && n > SIZE_MAX / size)
+		return NULL;
+
+	p = kmalloc(n * size, flags | __GFP_NOWARN);
+	if (!p)
+		p = __vmalloc(n * size, flags, PAGE_KERNEL);
+
+	return p;
+}
+#endif /* LINUX_VERSION_CODE */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
+static inline void kvfree(const void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		vfree(addr);
+	else
+		kfree(addr);
+}
+#endif /* LINUX_VERSION_CODE */
+
 // TODO: Add external dependecy, introduced in recent kernel
 extern int uuid_le_to_bin(const char *uuid, uuid_le *u);
 
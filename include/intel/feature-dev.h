@@ -26,6 +26,7 @@
 #include <linux/intel-fpga.h>
 #include <linux/interrupt.h>
 #include <linux/eventfd.h>
+#include <linux/hrtimer.h>
 
 /* each FPGA device has 4 ports at most. */
 #define MAX_FPGA_PORT_NUM 4
@@ -1560,10 +1561,48 @@ struct feature_driver {
 	struct feature_ops *ops;
 };
 
+/* latency bucket n counts the latencies in [2^(n-1), 2^n) ns */
+#define FEATURE_IRQ_LAT_BUCKETS	32
+
+struct feature_irq_stats {
+	u64 fires;		/* interrupts received */
+	u64 signals;		/* eventfd signals */
+	u64 spurious;		/* interrupts without eventfd bound */
+	/* log2 histogram of handler entry to eventfd signal latency */
+	u64 latency[FEATURE_IRQ_LAT_BUCKETS];
+};
+
 struct feature_irq_ctx {
+	/* the irq is requested at feature init, trigger is swapped under lock */
 	struct eventfd_ctx *trigger;
 	char *name;
 	int irq;
+	/* cpu the vector is steered to, default spreads over local node */
+	int cpu;
+	int default_cpu;
+
+	/*
+	 * Interrupt moderation: events are accumulated in 'pending' and
+	 * signalled to trigger in one go once max_events are pending or
+	 * max_delay has elapsed since the first one. Moderation is off when
+	 * max_delay is zero. Protected by lock.
+	 */
+	spinlock_t lock;
+	struct hrtimer timer;
+	u32 max_events;
+	ktime_t max_delay;
+	u32 pending;
+	u64 pending_since;	/* handler entry of first pending event (ns) */
+
+	/*
+	 * Busy-poll mode: when poll_seq is set, interrupts only bump it and
+	 * are signalled to trigger if *poll_armed was set. Protected by lock.
+	 */
+	u64 *poll_seq;
+	u32 *poll_armed;
+
+	/* protected by lock */
+	struct feature_irq_stats stats;
 };
 
 struct feature {
@@ -1575,6 +1614,24 @@ struct feature {
 	struct feature_ops *ops;
 };
 
+/*
+ * The FME counters as seen by a port at one instant. Two snapshots only
+ * give a fabric delta if they have the same fab_key, i.e. the fabric
+ * counters counted for the port in the same way in between.
+ */
+struct fpga_port_usage_snap {
+	u64 fab_key;
+	struct fpga_port_usage counters;	/* time_ns is the instant */
+};
+
+/* usage accounted to a port, protected by pdata->lock */
+struct fpga_port_usage_acct {
+	u64 files;		/* port files closed */
+	u64 jobs;		/* port release to assign periods */
+	u64 fabric_ns;		/* time the fabric counters were accounted */
+	u64 fabric[FPGA_PORT_USAGE_EVENTS];
+};
+
 struct feature_platform_data {
 	/* list the feature dev to cci_drvdata->port_dev_list. */
 	struct list_head node;
@@ -1592,6 +1649,16 @@ struct feature_platform_data {
 	int (*config_port)(struct platform_device *, u32, bool);
 	struct platform_device *(*fpga_for_each_port)(struct platform_device *,
 			void *, int (*match)(struct platform_device *, void *));
+	/*
+	 * port: snapshot the FME counters of the port, through the
+	 * read_port_usage of the FME which is set by the FME driver.
+	 */
+	int (*read_usage)(struct platform_device *,
+			  struct fpga_port_usage_snap *);
+	int (*read_port_usage)(struct platform_device *, int,
+			       struct fpga_port_usage_snap *);
+	struct fpga_port_usage_acct usage;
+	struct dentry *debugfs;
 	struct feature features[0];
 };
 
@@ -1713,6 +1780,8 @@ enum fpga_devt_type {
 
 void fpga_chardev_uinit(void);
 int fpga_chardev_init(void);
+void fpga_debugfs_uinit(void);
+void fpga_debugfs_init(void);
 dev_t fpga_get_devt(enum fpga_devt_type type, int id);
 int fpga_register_dev_ops(struct platform_device *pdev,
 			  const struct file_operations *fops,
@@ -1727,8 +1796,16 @@ static inline int fpga_port_check_id(struct platform_device *pdev,
 	return fpga_port_id(pdev) == *(int *)pport_id;
 }
 
+void fpga_port_usage_delta(const struct fpga_port_usage_snap *start,
+			   const struct fpga_port_usage_snap *end,
+			   struct fpga_port_usage *delta);
+void fpga_port_usage_account(struct feature_platform_data *pdata,
+			     const struct fpga_port_usage *delta, bool job);
+
 void __fpga_port_enable(struct platform_device *pdev);
 int __fpga_port_disable(struct platform_device *pdev);
+bool __fpga_port_disable_begin(struct platform_device *pdev);
+int __fpga_port_disable_wait(struct platform_device *pdev);
 
 static inline void fpga_port_enable(struct platform_device *pdev)
 {
@@ -1751,6 +1828,30 @@ static inline int fpga_port_disable(struct platform_device *pdev)
 	return ret;
 }
 
+static inline bool fpga_port_disable_begin(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	bool ret;
+
+	mutex_lock(&pdata->lock);
+	ret = __fpga_port_disable_begin(pdev);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
+static inline int fpga_port_disable_wait(struct platform_device *pdev)
+{
+	struct feature_platform_data *pdata = dev_get_platdata(&pdev->dev);
+	int ret;
+
+	mutex_lock(&pdata->lock);
+	ret = __fpga_port_disable_wait(pdev);
+	mutex_unlock(&pdata->lock);
+
+	return ret;
+}
+
 static inline int __fpga_port_reset(struct platform_device *pdev)
 {
 	int ret;
@@ -1816,6 +1917,13 @@ void check_features_header(struct pci_dev *pdev, struct feature_header *hdr,
 			   enum fpga_devt_type type, int id);
 int fpga_msix_set_block(struct feature *feature, unsigned int start,
 			unsigned int count, int32_t *fds);
+int fpga_msix_set_moderation(struct feature *feature, unsigned int start,
+			     unsigned int count, u32 max_events,
+			     u32 max_delay_us);
+int fpga_msix_set_affinity(struct feature *feature, unsigned int start,
+			   unsigned int count, int cpu);
+int fpga_msix_set_poll(struct feature *feature, unsigned int vector,
+		       u64 *seq, u32 *armed);
 /*
  * Wait register's _field to be changed to the given value (_expect's _field)
  * by polling with given interval and timeout.
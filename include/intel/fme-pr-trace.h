@@ -0,0 +1,116 @@
+/*
+ * Tracepoints for FPGA Partial Reconfiguration
+ *
+ * Copyright 2026 Intel Corporation, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL version 2. See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM intel_fpga_pr
+
+#if !defined(_FME_PR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FME_PR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define show_pr_phase(phase)						\
+	__print_symbolic(phase,						\
+			 { FME_PR_PHASE_RESET,		"reset" },	\
+			 { FME_PR_PHASE_INIT,		"init" },	\
+			 { FME_PR_PHASE_PUSH,		"push" },	\
+			 { FME_PR_PHASE_COMPLETE,	"complete" })
+
+TRACE_EVENT(fme_pr_begin,
+	TP_PROTO(int port_id),
+	TP_ARGS(port_id),
+
+	TP_STRUCT__entry(
+		__field(int, port_id)
+	),
+
+	TP_fast_assign(
+		__entry->port_id = port_id;
+	),
+
+	TP_printk("port %d", __entry->port_id)
+);
+
+TRACE_EVENT(fme_pr_phase,
+	TP_PROTO(int port_id, int phase, u64 ns),
+	TP_ARGS(port_id, phase, ns),
+
+	TP_STRUCT__entry(
+		__field(int, port_id)
+		__field(int, phase)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->port_id = port_id;
+		__entry->phase = phase;
+		__entry->ns = ns;
+	),
+
+	TP_printk("port %d phase %s took %llu ns", __entry->port_id,
+		  show_pr_phase(__entry->phase),
+		  (unsigned long long)__entry->ns)
+);
+
+TRACE_EVENT(fme_pr_push,
+	TP_PROTO(int port_id, u64 bytes, u32 credit_stalls, u64 ns),
+	TP_ARGS(port_id, bytes, credit_stalls, ns),
+
+	TP_STRUCT__entry(
+		__field(int, port_id)
+		__field(u64, bytes)
+		__field(u32, credit_stalls)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->port_id = port_id;
+		__entry->bytes = bytes;
+		__entry->credit_stalls = credit_stalls;
+		__entry->ns = ns;
+	),
+
+	TP_printk("port %d pushed %llu bytes in %llu ns, %u credit stalls",
+		  __entry->port_id, (unsigned long long)__entry->bytes,
+		  (unsigned long long)__entry->ns, __entry->credit_stalls)
+);
+
+TRACE_EVENT(fme_pr_end,
+	TP_PROTO(int port_id, int result, u64 pr_err, u64 ns),
+	TP_ARGS(port_id, result, pr_err, ns),
+
+	TP_STRUCT__entry(
+		__field(int, port_id)
+		__field(int, result)
+		__field(u64, pr_err)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->port_id = port_id;
+		__entry->result = result;
+		__entry->pr_err = pr_err;
+		__entry->ns = ns;
+	),
+
+	TP_printk("port %d result %d error code 0x%llx in %llu ns",
+		  __entry->port_id, __entry->result,
+		  (unsigned long long)__entry->pr_err,
+		  (unsigned long long)__entry->ns)
+);
+
+#endif /* _FME_PR_TRACE_H */
+
+/* the header is found through the include/intel search path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fme-pr-trace
+#include <trace/define_trace.h>
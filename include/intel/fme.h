@@ -20,6 +20,9 @@
 #ifndef __INTEL_FME_PR_H
 #define __INTEL_FME_PR_H
 
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+
 #include "backport.h"
 #define PERF_OBJ_ROOT_ID	(~0)
 
@@ -48,15 +51,153 @@ struct perf_object {
 	struct kobject kobj;
 };
 
+struct fme_fab_mux;
+struct fme_pr_copy;
+struct fme_pr_async;
+struct fme_pr_cache;
+struct fme_pr_decomp;
+struct fme_pmu;
+struct fme_sampler;
+struct fpga_manager;
+struct fpga_image_info;
+struct sg_table;
+
+/* the widest PR data push in bytes */
+#define PR_MAX_BANDWIDTH	64
+
+/* phases of a PR operation, timed separately */
+#define FME_PR_PHASE_RESET	0	/* PR reset until acked */
+#define FME_PR_PHASE_INIT	1	/* waiting for HW to be idle */
+#define FME_PR_PHASE_PUSH	2	/* pushing the bitstream */
+#define FME_PR_PHASE_COMPLETE	3	/* waiting for HW to finish PR */
+#define FME_PR_PHASE_MAX	4
+
+/* the last PR operations reported in debugfs */
+#define PR_HISTORY_SIZE		16
+
+struct fme_pr_record {
+	time64_t time;
+	u32 port_id;
+	int result;
+	u64 pr_err;
+	u64 bytes;
+	u32 credit_stalls;
+	u64 total_ns;
+	u64 phase_ns[FME_PR_PHASE_MAX];
+};
+
+/* events per counter block, the event select is 4 bits wide */
+#define FME_PERF_EVENTS		16
+
+/*
+ * No event known to be selected in a counter block, see perf_evsel. The
+ * cache block selects a channel too, as the bit above the event.
+ */
+#define FME_PERF_EVSEL_NONE	0xff
+#define FME_PERF_EVSEL_CACHE(channel, event)	(((channel) << 4) | (event))
+
+/* width of the hardware counters */
+#define FME_PERF_CACHE_WIDTH	48
+#define FME_PERF_FABRIC_WIDTH	60
+#define FME_PERF_VTD_WIDTH	48
+
+/*
+ * A hardware counter extended to 64 bits in software. It stays exact as
+ * long as the counter is read at least once per wrap period of the
+ * hardware, which the background poll makes sure of.
+ */
+struct fme_perf_accum {
+	u64 last;	/* the hardware value last read */
+	u64 total;
+};
+
+/* the counters read for the derived metrics, see fme_perf_metric_show() */
+struct fme_perf_window {
+	u64 time_ns;
+	int fab_port;		/* the port the fabric counters counted for */
+	u64 cache[FME_PERF_EVENTS];
+	u64 fabric[FME_PERF_EVENTS];
+	u64 vtd_sip[FME_PERF_EVENTS];
+};
+
 struct fpga_fme {
+	/* serialize PR, pdata->lock is not held during PR */
+	struct mutex pr_lock;
+	/*
+	 * PRs pinning the FME, see fme_pr_get(), and set once the FME goes
+	 * away, both protected by pdata->lock.
+	 */
+	int pr_users;
+	bool pr_dying;
+	wait_queue_head_t pr_users_wq;
 	u8  port_id;
 	u64 pr_err;
 	u32 capability;
 	int pr_bandwidth;
-	bool pr_avx512;
+	/* 512-bit PR data push, NULL for 32-bit PR */
+	const struct fme_pr_copy *pr_copy;
+	/* partial PR data unit carried over to the next write */
+	u8 pr_tail[PR_MAX_BANDWIDTH];
+	int pr_tail_len;
+	/* push statistics and phase timing of the last PR */
+	u64 pr_push_bytes;
+	u32 pr_credit_stalls;
+	ktime_t pr_phase_start;
+	u64 pr_phase_ns[FME_PR_PHASE_MAX];
+	/* the last PR operations, a ring protected by pr_history_lock */
+	spinlock_t pr_history_lock;
+	struct fme_pr_record pr_history[PR_HISTORY_SIZE];
+	unsigned int pr_history_count;
+	struct fme_pr_async *pr_async;
+	/* bitstream cache, NULL if not supported */
+	struct fme_pr_cache *pr_cache;
 	struct device *dev_err;
 	struct perf_object *iperf_dev;
 	struct perf_object *dperf_dev;
+	/*
+	 * serialize access to the global performance counters, a spinlock
+	 * as perf reads them in atomic context.
+	 */
+	spinlock_t perf_lock;
+	/*
+	 * the event selected in each counter block, by FPGA_FME_PERF_BLOCK.
+	 * A read of the same event skips selecting it and waiting for the
+	 * counter if the counter register still reports it.
+	 */
+	u8 perf_evsel[FPGA_FME_PERF_BLOCK_VTD_SIP + 1];
+	/* perf fabric events counting, the port filter is pinned to theirs */
+	int perf_fab_users;
+	int perf_fab_port;
+	/* bumped whenever the port filter changes, perf_lock held */
+	u32 perf_fab_seq;
+	/*
+	 * 64-bit totals of the counters, protected by perf_lock. The cache
+	 * has two counters per event and channel.
+	 */
+	struct fme_perf_accum acc_cache[2][FME_PERF_EVENTS][2];
+	struct fme_perf_accum acc_fabric[FME_PERF_EVENTS];
+	struct fme_perf_accum acc_vtd[FME_PERF_EVENTS];
+	struct fme_perf_accum acc_vtd_sip[FME_PERF_EVENTS];
+	struct delayed_work acc_poll;
+	/* fabric port filter multiplexer, NULL if off, perf_lock held */
+	struct fme_fab_mux *fab_mux;
+	/*
+	 * the last two windows of the derived metrics, taken by metrics_work
+	 * every period while the metrics are read, and the jiffies of the
+	 * last read, all protected by pdata->lock.
+	 */
+	struct fme_perf_window metrics[2];
+	struct delayed_work metrics_work;
+	unsigned long metrics_read;
+	bool metrics_on;
+	bool metrics_dying;
+	/* perf PMU, NULL if not registered */
+	struct fme_pmu *pmu;
+	/* counter sampler, protected by pdata->lock */
+	struct fme_sampler *sampler;
+	/* the counters of the released ports, pdata->lock held */
+	unsigned long port_released;
+	struct fpga_port_usage_snap port_job[MAX_FPGA_PORT_NUM];
 	struct feature_platform_data *pdata;
 };
 
@@ -82,6 +223,158 @@ struct perf_obj_attributte perf_obj_attr_##_name =		\
 #define PERF_OBJ_ATTR_WO(_name)					\
 	struct perf_obj_attributte perf_obj_attr_##_name = __ATTR_WO(_name)
 
+/* the fme of a feature device, valid as long as its features are. */
+static inline struct fpga_fme *fme_perf_get_fme(struct device *fme_dev)
+{
+	return fpga_pdata_get_private(dev_get_platdata(fme_dev));
+}
+
+/*
+ * fold the @width bits wide @raw value into @acc, fme->perf_lock held. The
+ * counters are read far more often than they can wrap, so going back by
+ * more than half the range is a counter reset (e.g. the reset_counters
+ * bit or a port reset), not a wrap: only the counts since the reset are
+ * added then.
+ */
+static inline u64 fme_perf_accumulate(struct fme_perf_accum *acc, u64 raw,
+				      int width)
+{
+	u64 delta = (raw - acc->last) & GENMASK_ULL(width - 1, 0);
+
+	if (raw < acc->last && delta > GENMASK_ULL(width - 2, 0))
+		delta = raw;
+
+	acc->total += delta;
+	acc->last = raw;
+
+	return acc->total;
+}
+
+/*
+ * counter access of the performance features, fme->perf_lock held. The
+ * counters are returned as 64-bit totals, see struct fme_perf_accum.
+ */
+u8 fme_iperf_cache_channel(u8 event);
+int fme_iperf_read_cache(struct device *fme_dev, u8 channel, u8 event,
+			 u64 *counter);
+int fme_iperf_read_fabric(struct device *fme_dev, int port_id, u8 event,
+			  u64 *counter);
+void fme_iperf_set_fabric_port(struct device *fme_dev, int port_id);
+int fme_iperf_read_vtd(struct device *fme_dev, u8 event, u64 *counter);
+int fme_iperf_read_vtd_sip(struct device *fme_dev, u8 event, u64 *counter);
+int fme_dperf_read_fabric(struct device *fme_dev, int port_id, u8 event,
+			  u64 *counter);
+void fme_dperf_set_fabric_port(struct device *fme_dev, int port_id);
+void fme_perf_set_fabric_port(struct device *fme_dev, int port_id);
+int fme_perf_get_fabric_port(struct device *fme_dev);
+long fme_perf_snapshot_ioctl(struct platform_device *pdev, unsigned long arg,
+			     int (*snapshot)(struct platform_device *pdev,
+					struct fpga_fme_perf_snapshot *snap));
+
+/* FPGA_FME_PERF_CONFIG fields */
+#define FME_PERF_EVENT(config)		((u8)((config) & 0xf))
+#define FME_PERF_BLOCK(config)		(((config) >> 4) & 0xf)
+#define FME_PERF_PORTID(config)		(((config) >> 8) & 0x3)
+#define FME_PERF_FILTER(config)		(((config) >> 10) & 0x1)
+#define FME_PERF_CONFIG_MASK		0x7ffULL
+
+bool fme_perf_config_valid(struct device *fme_dev, u64 config);
+int fme_perf_read_config(struct device *fme_dev, u64 config, u64 *counter);
+u64 fme_perf_read_clock(struct device *fme_dev);
+
+void fme_perf_accum_init(struct platform_device *pdev);
+void fme_perf_accum_uinit(struct platform_device *pdev);
+
+/* metrics derived from the counters over the last interval */
+enum fme_perf_metric {
+	FME_PERF_CACHE_READ_HIT_RATIO,
+	FME_PERF_CACHE_WRITE_HIT_RATIO,
+	FME_PERF_PCIE0_READ_BW,
+	FME_PERF_PCIE0_WRITE_BW,
+	FME_PERF_PCIE1_READ_BW,
+	FME_PERF_PCIE1_WRITE_BW,
+	FME_PERF_UPI_READ_BW,
+	FME_PERF_UPI_WRITE_BW,
+	FME_PERF_IOTLB_4K_HIT_RATIO,
+	FME_PERF_IOTLB_2M_HIT_RATIO,
+	FME_PERF_IOTLB_1G_HIT_RATIO,
+	FME_PERF_METRIC_MAX,
+};
+
+ssize_t fme_perf_metric_show(struct perf_object *pobj, int metric, char *buf);
+void fme_perf_metrics_init(struct platform_device *pdev);
+void fme_perf_metrics_uinit(struct platform_device *pdev);
+
+/* the create_perf_obj() of the iperf and dperf features */
+typedef struct perf_object *
+(*perf_obj_create_t)(struct device *fme_dev, struct kobject *parent, int id,
+		     const struct attribute_group **groups, const char *name);
+
+int fme_fab_mux_create_objs(struct perf_object *fabric,
+			    perf_obj_create_t create);
+bool fme_fab_mux_read_port(struct fpga_fme *fme, int port_id, u64 *counter,
+			   u64 *fab_key);
+bool fme_fab_mux_read_rate(struct fpga_fme *fme, int port_id, u8 event,
+			   u64 *rate);
+void fme_fab_mux_uinit(struct platform_device *pdev);
+
+void fme_port_usage_init(struct platform_device *pdev);
+void fme_port_usage_uinit(struct platform_device *pdev);
+void fme_port_usage_release(struct platform_device *pdev, int port_id);
+void fme_port_usage_assign(struct platform_device *pdev, int port_id);
+
+int fme_pmu_hotplug_init(void);
+void fme_pmu_hotplug_uinit(void);
+int fme_pmu_init(struct platform_device *pdev);
+void fme_pmu_uinit(struct platform_device *pdev);
+
+int fme_sampler_start(struct platform_device *pdev, struct file *filp,
+		      void __user *arg);
+int fme_sampler_stop(struct platform_device *pdev, struct file *filp);
+int fme_sampler_mmap(struct platform_device *pdev,
+		     struct vm_area_struct *vma);
+void fme_sampler_release(struct platform_device *pdev, struct file *filp);
+void fme_sampler_uinit(struct platform_device *pdev);
+
+int fme_pr_check_port(struct platform_device *pdev, u32 port_id);
+/* what is known about a bitstream from its GBS header, if any */
+struct fme_pr_gbs {
+	size_t offset;		/* start of the raw bitstream */
+	size_t size;		/* size of the raw bitstream */
+	bool has_intfc_id;	/* interface id found in the metadata */
+	u64 intfc_id_l;
+	u64 intfc_id_h;
+};
+
+int fme_pr_gbs_parse(const void *buf, size_t size, struct fme_pr_gbs *gbs);
+int fme_pr_gbs_parse_user(u64 addr, size_t size, struct fme_pr_gbs *gbs);
+
+struct fme_pr_decomp *
+fme_pr_decomp_create(u32 format, int (*next)(void *priv, struct sg_table **sgt),
+		     void *priv);
+void fme_pr_decomp_destroy(struct fme_pr_decomp *d);
+int fme_pr_decomp_next(void *priv, struct sg_table **sgt);
+int fme_pr_decomp_peek(struct fme_pr_decomp *d, const void **buf,
+		       size_t *len);
+void fme_pr_decomp_skip(struct fme_pr_decomp *d, size_t len);
+
+/* writes the bitstream to the FPGA manager, see fme_pr_program() */
+typedef int (*fme_pr_load_t)(struct fpga_manager *mgr,
+			     struct fpga_image_info *info, void *priv);
+
+struct fpga_fme *fme_pr_get(struct feature_platform_data *pdata);
+void fme_pr_put(struct feature_platform_data *pdata, struct fpga_fme *fme);
+int fme_pr_program(struct platform_device *pdev, struct fpga_fme *fme,
+		   u32 port_id, const struct fme_pr_gbs *gbs,
+		   fme_pr_load_t load, void *priv, u64 *status);
+unsigned int fme_pr_poll(struct feature_platform_data *pdata,
+			 struct file *filp, poll_table *wait);
+
+int fme_pr_cache_init(struct fpga_fme *fme);
+void fme_pr_cache_uinit(struct fpga_fme *fme);
+int fme_pr_cache_add(struct platform_device *pdev, unsigned long arg);
+int fme_pr_cache_program(struct platform_device *pdev, unsigned long arg);
+
 extern struct feature_ops global_error_ops;
 extern struct feature_ops pr_mgmt_ops;
 extern struct feature_ops global_iperf_ops;
@@ -138,6 +138,9 @@ int fpga_mgr_buf_load(struct fpga_manager *mgr, struct fpga_image_info *info,
 		      const char *buf, size_t count);
 int fpga_mgr_buf_load_sg(struct fpga_manager *mgr, struct fpga_image_info *info,
 			 struct sg_table *sgt);
+int fpga_mgr_stream_load(struct fpga_manager *mgr, struct fpga_image_info *info,
+			 int (*next)(void *priv, struct sg_table **sgt),
+			 void *priv);
 
 int fpga_mgr_firmware_load(struct fpga_manager *mgr,
 			   struct fpga_image_info *info,
@@ -118,6 +118,7 @@ struct fpga_port_region_info {
 	__u32 index;		/* Region index */
 #define FPGA_PORT_INDEX_UAFU	0		/* User AFU */
 #define FPGA_PORT_INDEX_STP	1		/* Signal Tap */
+#define FPGA_PORT_INDEX_UINT_STATUS 2		/* UAFU interrupt status */
 	__u32 padding;
 	/* Output */
 	__u64 size;		/* Region size (bytes) */
@@ -244,13 +245,134 @@ struct fpga_port_uafu_irq_set {
 
 #define FPGA_PORT_UAFU_SET_IRQ		_IO(FPGA_MAGIC, PORT_BASE + 10)
 
+/**
+ * FPGA_PORT_UAFU_SET_IRQ_MODERATION - _IOW(FPGA_MAGIC, PORT_BASE + 11,
+ *                                   struct fpga_port_uafu_irq_moderation)
+ *
+ * Set interrupt moderation for a block of UAFU interrupts. Interrupts are
+ * accumulated and the eventfd is signalled once (with the number of
+ * interrupts as the counter increment) when max_events interrupts are
+ * pending or max_delay_us has passed since the first pending interrupt,
+ * whichever comes first. max_events of zero means no event limit. Set
+ * max_delay_us to zero (and max_events to zero or one) to turn moderation
+ * off, which is the default.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_port_uafu_irq_moderation {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 start;		/* First irq number */
+	__u32 count;		/* The number of irqs */
+	__u32 max_events;	/* Max pending interrupts before signal */
+	__u32 max_delay_us;	/* Max delay of a pending interrupt (us) */
+};
+
+#define FPGA_PORT_UAFU_SET_IRQ_MODERATION	_IO(FPGA_MAGIC, PORT_BASE + 11)
+
+/**
+ * FPGA_PORT_UAFU_SET_IRQ_AFFINITY - _IOW(FPGA_MAGIC, PORT_BASE + 12,
+ *                                 struct fpga_port_uafu_irq_affinity)
+ *
+ * Pin a block of UAFU interrupts to the given cpu, typically the one which
+ * consumes the eventfds. By default vectors are spread over the cpus of
+ * the device's NUMA node; cpu of -1 restores this default.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_port_uafu_irq_affinity {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 start;		/* First irq number */
+	__u32 count;		/* The number of irqs */
+	__s32 cpu;		/* Target cpu, -1 for default */
+};
+
+#define FPGA_PORT_UAFU_SET_IRQ_AFFINITY	_IO(FPGA_MAGIC, PORT_BASE + 12)
+
+/**
+ * FPGA_PORT_UAFU_SET_IRQ_MODE - _IOWR(FPGA_MAGIC, PORT_BASE + 13,
+ *                                     struct fpga_port_uafu_irq_mode)
+ *
+ * Switch a block of UAFU interrupts between eventfd and busy-poll delivery.
+ * In polling mode, the interrupt is not signalled to the eventfd but counted
+ * in the vector's entry of the FPGA_PORT_INDEX_UINT_STATUS region, which
+ * userspace mmaps and spins on. To fall back to blocking, userspace sets
+ * 'armed' in the entry, checks 'seq' once more and then waits on the
+ * eventfd; the next interrupt is signalled and clears 'armed'.
+ * In FPGA_PORT_UINT_MODE_POLL_DMA mode the vector is masked and the AFU is
+ * expected to update 'seq' itself, writing to status_iova by DMA.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_port_uafu_irq_mode {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 start;		/* First irq number */
+	__u32 count;		/* The number of irqs */
+	__u32 mode;
+#define FPGA_PORT_UINT_MODE_EVENTFD	0	/* Signal eventfd (default) */
+#define FPGA_PORT_UINT_MODE_POLL	1	/* Update status page */
+#define FPGA_PORT_UINT_MODE_POLL_DMA	2	/* Masked, AFU updates page */
+	__u32 padding;
+	/* Output */
+	__u64 status_iova;	/* IO virtual address of status region */
+};
+
+/* Entry of FPGA_PORT_INDEX_UINT_STATUS region, one per UAFU interrupt */
+struct fpga_port_uint_status {
+	__u64 seq;		/* Interrupts seen in polling mode */
+	__u32 armed;		/* Set by user to get next one signalled */
+	__u32 padding[13];	/* Pad to a cache line */
+};
+
+#define FPGA_PORT_UAFU_SET_IRQ_MODE	_IO(FPGA_MAGIC, PORT_BASE + 13)
+
+/**
+ * FPGA_PORT_GET_USAGE - _IOWR(FPGA_MAGIC, PORT_BASE + 14,
+ *                                struct fpga_port_usage)
+ *
+ * Report the FME global performance counters accumulated since the port
+ * file was opened. Counters are indexed by their event code as in struct
+ * fpga_fme_perf_snapshot. Only the fabric counters can be attributed to a
+ * port, they are reported if they counted for this port alone the whole
+ * time, through the fabric port filter or multiplexer. The cache counters
+ * are shared by all ports of the FME and are not reported.
+ * The same accounting of all closed files and of the jobs run between a
+ * port release and its assign is summarized in the port's usage directory
+ * in sysfs.
+ * Return: 0 on success, -errno on failure.
+ */
+#define FPGA_PORT_USAGE_EVENTS	16
+
+struct fpga_port_usage {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	/* Output */
+	__u32 valid;		/* Counter groups accounted */
+#define FPGA_PORT_USAGE_FABRIC	(1 << 0)
+	__u32 padding;
+	__u64 time_ns;		/* Time accounted */
+	__u64 fabric[FPGA_PORT_USAGE_EVENTS];
+};
+
+#define FPGA_PORT_GET_USAGE	_IO(FPGA_MAGIC, PORT_BASE + 14)
+
 /* IOCTLs for FME file descriptor */
 
 /**
  * FPGA_FME_PORT_PR - _IOWR(FPGA_MAGIC, FME_BASE + 0, struct fpga_fme_port_pr)
  *
  * Driver does Partial Reconfiguration based on Port ID and Buffer (Image)
- * provided by caller.
+ * provided by caller. The image is either a raw bitstream or a GBS file,
+ * the GBS metadata is stripped and its interface ID is checked against the
+ * FME before the port is disabled, -EINVAL is returned on mismatch. A raw
+ * bitstream is not checked.
+ * A compressed image is decompressed by the kernel while it is pushed, its
+ * format is given by flags. zstd frames must declare a window of 8MB at
+ * most in their header. LZ4 frames must use independent blocks.
+ * -EOPNOTSUPP is returned if the kernel lacks the decompressor.
  * Return: 0 on success, -errno on failure.
  * If FPGA_FME_PORT_PR returns -EIO, that indicates the HW has detected
  * some errors during PR, under this case, the user can fetch HW error code
@@ -275,7 +397,11 @@ static const char * const _name_[] = {			\
 struct fpga_fme_port_pr {
 	/* Input */
 	__u32 argsz;		/* Structure length */
-	__u32 flags;		/* Zero for now */
+	__u32 flags;		/* Compression of the image, zero if none */
+#define FPGA_FME_PR_COMPRESS_ZSTD	(1 << 0)	/* zstd frame */
+#define FPGA_FME_PR_COMPRESS_LZ4	(1 << 1)	/* LZ4 frame */
+#define FPGA_FME_PR_COMPRESS_MASK	(FPGA_FME_PR_COMPRESS_ZSTD | \
+					 FPGA_FME_PR_COMPRESS_LZ4)
 	__u32 port_id;
 	__u32 buffer_size;
 	__u64 buffer_address;	/* Userspace address to the buffer for PR */
@@ -351,4 +477,264 @@ struct fpga_fme_err_irq_set {
 
 #define FPGA_FME_ERR_SET_IRQ	_IO(FPGA_MAGIC, FME_BASE + 4)
 
+/**
+ * FPGA_FME_PORT_PR_ASYNC - _IOW(FPGA_MAGIC, FME_BASE + 5,
+ *                                      struct fpga_fme_port_pr_async)
+ *
+ * Same as FPGA_FME_PORT_PR, but the ioctl returns as soon as the PR is
+ * queued and the PR is done by a kernel worker. The buffer must stay valid
+ * and unchanged until the PR has completed. Completion is signalled to the
+ * eventfd if evtfd is not -1, and the FME device file becomes readable
+ * (POLLIN), then the result is fetched by FPGA_FME_PORT_PR_STATUS.
+ * Only one asynchronous PR may be in flight per FME, starting a new one
+ * discards any result which has not been fetched yet.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_fme_port_pr_async {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* FPGA_FME_PR_COMPRESS_* */
+	__u32 port_id;
+	__u32 buffer_size;
+	__u64 buffer_address;	/* Userspace address to the buffer for PR */
+	__s32 evtfd;		/* Eventfd signalled on completion, or -1 */
+};
+
+#define FPGA_FME_PORT_PR_ASYNC	_IO(FPGA_MAGIC, FME_BASE + 5)
+
+/**
+ * FPGA_FME_PORT_PR_STATUS - _IOR(FPGA_MAGIC, FME_BASE + 6,
+ *                                      struct fpga_fme_port_pr_status)
+ *
+ * Retrieve the state of the asynchronous PR. Once it has completed, the
+ * result is reported with state FPGA_FME_PR_STATE_DONE exactly once, the
+ * state goes back to FPGA_FME_PR_STATE_IDLE afterwards.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_fme_port_pr_status {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	/* Output */
+	__u32 state;
+#define FPGA_FME_PR_STATE_IDLE	0	/* No asynchronous PR */
+#define FPGA_FME_PR_STATE_BUSY	1	/* PR is in progress */
+#define FPGA_FME_PR_STATE_DONE	2	/* PR completed, see result */
+	__u32 port_id;		/* Port of the PR */
+	__s32 result;		/* 0 on success, -errno as FPGA_FME_PORT_PR */
+	__u32 padding;
+	__u64 status;		/* HW error code if result is -EIO */
+};
+
+#define FPGA_FME_PORT_PR_STATUS	_IO(FPGA_MAGIC, FME_BASE + 6)
+
+/* bitstream cache entries are identified by the SHA-256 of the content */
+#define FPGA_FME_PR_CACHE_ID_SIZE	32
+
+/**
+ * FPGA_FME_PR_CACHE_ADD - _IOWR(FPGA_MAGIC, FME_BASE + 7,
+ *                                      struct fpga_fme_pr_cache_add)
+ *
+ * Copy a bitstream into the in-kernel bitstream cache of the FME and
+ * return its ID. The cache is bounded, least recently used bitstreams are
+ * evicted when it is full. Adding a bitstream which is already cached
+ * only refreshes it.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_fme_pr_cache_add {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 buffer_size;
+	__u32 padding;
+	__u64 buffer_address;	/* Userspace address to the bitstream */
+	/* Output */
+	__u8 id[FPGA_FME_PR_CACHE_ID_SIZE];
+};
+
+#define FPGA_FME_PR_CACHE_ADD	_IO(FPGA_MAGIC, FME_BASE + 7)
+
+/**
+ * FPGA_FME_PORT_PR_CACHED - _IOWR(FPGA_MAGIC, FME_BASE + 8,
+ *                                      struct fpga_fme_port_pr_cached)
+ *
+ * Same as FPGA_FME_PORT_PR, but the bitstream is taken from the bitstream
+ * cache by ID. -ENOENT is returned if it is not (or no longer) cached.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_fme_port_pr_cached {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 port_id;
+	__u32 padding;
+	__u8 id[FPGA_FME_PR_CACHE_ID_SIZE];
+	/* Output */
+	__u64 status;		/* HW error code if ioctl returns -EIO */
+};
+
+#define FPGA_FME_PORT_PR_CACHED	_IO(FPGA_MAGIC, FME_BASE + 8)
+
+/**
+ * FPGA_FME_PORT_PR_FIRMWARE - _IOWR(FPGA_MAGIC, FME_BASE + 9,
+ *                                      struct fpga_fme_port_pr_firmware)
+ *
+ * Same as FPGA_FME_PORT_PR, but the bitstream is read by the kernel from
+ * the firmware search path (e.g. /lib/firmware), the image name is
+ * relative to it.
+ * Return: 0 on success, -errno on failure.
+ */
+struct fpga_fme_port_pr_firmware {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 port_id;
+	__u32 padding;
+	__u64 image_name;	/* Userspace address to NUL terminated name */
+	/* Output */
+	__u64 status;		/* HW error code if ioctl returns -EIO */
+};
+
+#define FPGA_FME_PORT_PR_FIRMWARE	_IO(FPGA_MAGIC, FME_BASE + 9)
+
+/**
+ * FPGA_FME_PORT_PR_BATCH - _IOWR(FPGA_MAGIC, FME_BASE + 10,
+ *                                  struct fpga_fme_port_pr_batch)
+ *
+ * Reconfigure several ports in one call, each port at most once. All
+ * images are validated first, then the ports are quiesced together and
+ * each one is re-enabled as soon as its own PR has finished. An entry
+ * which fails validation doesn't stop the others.
+ * Return: 0 if the batch was processed, the outcome of each port is in
+ * its entry; -errno if the batch itself is invalid.
+ */
+struct fpga_fme_port_pr_entry {
+	/* Input */
+	__u32 port_id;
+	__u32 flags;		/* FPGA_FME_PR_COMPRESS_* */
+	__u32 buffer_size;
+	__u32 padding;
+	__u64 buffer_address;	/* Userspace address to the buffer for PR */
+	/* Output */
+	__s32 result;		/* 0 or -errno as FPGA_FME_PORT_PR returns */
+	__u32 padding2;
+	__u64 status;		/* HW error code if result is -EIO */
+};
+
+struct fpga_fme_port_pr_batch {
+	/* Input */
+	__u32 argsz;		/* Structure length, including entries */
+	__u32 flags;		/* Zero for now */
+	__u32 count;		/* Number of entries */
+	__u32 padding;
+	struct fpga_fme_port_pr_entry entries[];
+};
+
+#define FPGA_FME_PORT_PR_BATCH	_IO(FPGA_MAGIC, FME_BASE + 10)
+
+/**
+ * FPGA_FME_PERF_SNAPSHOT - _IOWR(FPGA_MAGIC, FME_BASE + 11,
+ *                                  struct fpga_fme_perf_snapshot)
+ *
+ * Read all global performance counters of the FME in one pass. The
+ * counters are frozen while they are read, so all values and the clock
+ * are from the same instant. Counters are indexed by their event code,
+ * the ones the FME doesn't have read as zero.
+ * Return: 0 on success, -errno on failure.
+ */
+#define FPGA_FME_PERF_SNAPSHOT_VERSION	1
+#define FPGA_FME_PERF_EVENT_MAX		16
+
+struct fpga_fme_perf_snapshot {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	/* Output */
+	__u32 version;		/* FPGA_FME_PERF_SNAPSHOT_VERSION */
+	__u32 valid;		/* Counter groups filled in */
+#define FPGA_FME_PERF_SNAPSHOT_CACHE	(1 << 0)
+#define FPGA_FME_PERF_SNAPSHOT_FABRIC	(1 << 1)
+#define FPGA_FME_PERF_SNAPSHOT_VTD	(1 << 2)
+	__u64 clock;		/* FPGA clock counter */
+	__s32 fab_port;		/* Port of the fabric counters, -1 for all */
+	__u32 padding;
+	__u64 cache[FPGA_FME_PERF_EVENT_MAX];
+	__u64 fabric[FPGA_FME_PERF_EVENT_MAX];
+	__u64 vtd[FPGA_FME_PERF_EVENT_MAX];
+	__u64 vtd_sip[FPGA_FME_PERF_EVENT_MAX];
+};
+
+#define FPGA_FME_PERF_SNAPSHOT	_IO(FPGA_MAGIC, FME_BASE + 11)
+
+/*
+ * A global performance counter of the FME, as in the config of its perf
+ * PMU intel_fpga_fme<id> and in the sampler below.
+ */
+#define FPGA_FME_PERF_BLOCK_CACHE	0
+#define FPGA_FME_PERF_BLOCK_FABRIC	1
+#define FPGA_FME_PERF_BLOCK_VTD		2
+#define FPGA_FME_PERF_BLOCK_VTD_SIP	3
+#define FPGA_FME_PERF_CONFIG(block, event)	(((block) << 4) | (event))
+/* or'ed to a fabric counter, count the events of one port only */
+#define FPGA_FME_PERF_PORT(port_id)	((1 << 10) | ((port_id) << 8))
+
+/**
+ * FPGA_FME_PERF_SAMPLER_START - _IOW(FPGA_MAGIC, FME_BASE + 12,
+ *                                       struct fpga_fme_perf_sampler)
+ *
+ * Sample a set of counters every period_ms from a kernel timer into a
+ * ring buffer, which is mapped read-only by mmap() of the FME device
+ * file at offset 0. The sampler runs until FPGA_FME_PERF_SAMPLER_STOP or
+ * until the file which started it is closed, one sampler per FME.
+ * Return: 0 on success, -errno on failure.
+ */
+#define FPGA_FME_PERF_SAMPLER_EVENTS	16
+
+struct fpga_fme_perf_sampler {
+	/* Input */
+	__u32 argsz;		/* Structure length */
+	__u32 flags;		/* Zero for now */
+	__u32 period_ms;	/* Sampling period, 1ms at least */
+	__u32 ring_pages;	/* Ring size in pages, with the header page */
+	__u32 nr_events;	/* Number of counters to sample */
+	__u32 padding;
+	__u64 events[FPGA_FME_PERF_SAMPLER_EVENTS]; /* FPGA_FME_PERF_CONFIG */
+};
+
+/*
+ * The ring starts with this header page, the samples follow from
+ * data_offset. Sample n is at data_offset + (n % nr_samples) *
+ * sample_size. head is the number of samples written so far; a reader
+ * reads head, then the samples, then head again: samples older than
+ * that head - nr_samples were overwritten while they were read.
+ */
+struct fpga_fme_perf_ring {
+	__u64 head;
+	__u32 data_offset;
+	__u32 sample_size;
+	__u32 nr_samples;
+	__u32 nr_events;
+	__u64 events[FPGA_FME_PERF_SAMPLER_EVENTS];
+};
+
+struct fpga_fme_perf_sample {
+	__u64 time_ns;		/* CLOCK_MONOTONIC */
+	__u64 clock;		/* FPGA clock counter */
+	__u32 valid;		/* Bit n set if counters[n] was read */
+	__u32 padding;
+	__u64 counters[];	/* nr_events counters */
+};
+
+#define FPGA_FME_PERF_SAMPLER_START	_IO(FPGA_MAGIC, FME_BASE + 12)
+
+/**
+ * FPGA_FME_PERF_SAMPLER_STOP - _IO(FPGA_MAGIC, FME_BASE + 13)
+ *
+ * Stop the sampler, a mapped ring stays readable until it's unmapped.
+ * Only the file which started the sampler may stop it.
+ * Return: 0 on success, -EPERM if the sampler was started through another
+ * file, -errno on other failures.
+ */
+#define FPGA_FME_PERF_SAMPLER_STOP	_IO(FPGA_MAGIC, FME_BASE + 13)
+
 #endif /* _UAPI_INTEL_FPGA_H */